@@ -0,0 +1,191 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// A deterministic LC-3 program to time. It is loaded at PC_START, reads no
+// input and halts with `checksum` in R0, so every engine can be checked
+// against the same result before its time counts.
+struct Workload {
+  const char *name;
+  const char *description;
+  uint16_t checksum;
+  std::vector<uint16_t> words;
+};
+
+// Hand-assembled, with the source of each word next to it.
+inline const std::vector<Workload> &workloads() {
+  static const std::vector<Workload> all = {
+    {"arithmetic",
+     "ADD, AND and NOT in a loop of a million iterations.",
+     0xe00f,
+     {
+      0x220b, // LD R1, OUTER
+      0x240b, // OLOOP LD R2, INNER
+      0x16c2, // ILOOP ADD R3, R3, R2
+      0x58ef, // AND R4, R3, #15
+      0x9b3f, // NOT R5, R4
+      0x16c5, // ADD R3, R3, R5
+      0x14bf, // ADD R2, R2, #-1
+      0x03fa, // BRp ILOOP
+      0x127f, // ADD R1, R1, #-1
+      0x03f7, // BRp OLOOP
+      0x10e0, // ADD R0, R3, #0
+      0xf025, // HALT
+      0x0064, // OUTER .FILL #100
+      0x2710, // INNER .FILL #10000
+     }},
+    {"memory_copy",
+     "LDR and STR copying 4096 words, 100 times over.",
+     0x0800,
+     {
+      0x221a, // LD R1, SOURCE
+      0x241b, // LD R2, COUNT
+      0x7440, // FILL STR R2, R1, #0
+      0x1261, // ADD R1, R1, #1
+      0x14bf, // ADD R2, R2, #-1
+      0x03fc, // BRp FILL
+      0x2a17, // LD R5, PASSES
+      0x2213, // PASS LD R1, SOURCE
+      0x2413, // LD R2, TARGET
+      0x2613, // LD R3, COUNT
+      0x6840, // COPY LDR R4, R1, #0
+      0x7880, // STR R4, R2, #0
+      0x1261, // ADD R1, R1, #1
+      0x14a1, // ADD R2, R2, #1
+      0x16ff, // ADD R3, R3, #-1
+      0x03fa, // BRp COPY
+      0x1b7f, // ADD R5, R5, #-1
+      0x03f5, // BRp PASS
+      0x2409, // LD R2, TARGET
+      0x2609, // LD R3, COUNT
+      0x5020, // AND R0, R0, #0
+      0x6880, // SUM LDR R4, R2, #0
+      0x1004, // ADD R0, R0, R4
+      0x14a1, // ADD R2, R2, #1
+      0x16ff, // ADD R3, R3, #-1
+      0x03fb, // BRp SUM
+      0xf025, // HALT
+      0x4000, // SOURCE .FILL x4000
+      0x5000, // TARGET .FILL x5000
+      0x1000, // COUNT .FILL #4096
+      0x0064, // PASSES .FILL #100
+     }},
+    {"recursive_calls",
+     "A recursive fib(18) through JSR and a stack, 20 times.",
+     0x0a18,
+     {
+      0x2c06, // LD R6, STACK
+      0x2a06, // LD R5, PASSES
+      0x2006, // PASS LD R0, N
+      0x4806, // JSR FIB
+      0x1b7f, // ADD R5, R5, #-1
+      0x03fc, // BRp PASS
+      0xf025, // HALT
+      0xf000, // STACK .FILL xF000
+      0x0014, // PASSES .FILL #20
+      0x0012, // N .FILL #18
+      0x123e, // FIB ADD R1, R0, #-2
+      0x080f, // BRn BASE
+      0x1dbf, // ADD R6, R6, #-1
+      0x7f80, // STR R7, R6, #0
+      0x1dbf, // ADD R6, R6, #-1
+      0x7180, // STR R0, R6, #0
+      0x103f, // ADD R0, R0, #-1
+      0x4ff8, // JSR FIB
+      0x6380, // LDR R1, R6, #0
+      0x7180, // STR R0, R6, #0
+      0x107e, // ADD R0, R1, #-2
+      0x4ff4, // JSR FIB
+      0x6380, // LDR R1, R6, #0
+      0x1001, // ADD R0, R0, R1
+      0x1da1, // ADD R6, R6, #1
+      0x6f80, // LDR R7, R6, #0
+      0x1da1, // ADD R6, R6, #1
+      0xc1c0, // BASE RET
+     }},
+    {"string_output",
+     "PUTS and a loop of OUT over a string, 2000 times.",
+     0x4ff0,
+     {
+      0x260e, // LD R3, PASSES
+      0x54a0, // AND R2, R2, #0
+      0xe00d, // PASS LEA R0, TITLE
+      0xf022, // PUTS
+      0xe217, // LEA R1, BODY
+      0x6040, // CHAR LDR R0, R1, #0
+      0x0404, // BRz NEXT
+      0xf021, // OUT
+      0x14a1, // ADD R2, R2, #1
+      0x1261, // ADD R1, R1, #1
+      0x0ffa, // BRnzp CHAR
+      0x16ff, // NEXT ADD R3, R3, #-1
+      0x03f5, // BRp PASS
+      0x10a0, // ADD R0, R2, #0
+      0xf025, // HALT
+      0x07d0, // PASSES .FILL #2000
+      // TITLE .STRINGZ "lc3 bench: "
+      0x006c, 0x0063, 0x0033, 0x0020, 0x0062, 0x0065, 0x006e, 0x0063,
+      0x0068, 0x003a, 0x0020, 0x0000,
+      // BODY .STRINGZ "the quick brown fox jumps over the lazy dog"
+      0x0074, 0x0068, 0x0065, 0x0020, 0x0071, 0x0075, 0x0069, 0x0063,
+      0x006b, 0x0020, 0x0062, 0x0072, 0x006f, 0x0077, 0x006e, 0x0020,
+      0x0066, 0x006f, 0x0078, 0x0020, 0x006a, 0x0075, 0x006d, 0x0070,
+      0x0073, 0x0020, 0x006f, 0x0076, 0x0065, 0x0072, 0x0020, 0x0074,
+      0x0068, 0x0065, 0x0020, 0x006c, 0x0061, 0x007a, 0x0079, 0x0020,
+      0x0064, 0x006f, 0x0067, 0x0000,
+     }},
+    {"bubble_sort",
+     "Bubble sort of 200 pseudo-random words, 10 times.",
+     0x3e6e,
+     {
+      0x2a28, // LD R5, PASSES
+      0x2228, // PASS LD R1, ARRAY
+      0x2428, // LD R2, N
+      0x2628, // LD R3, SEED
+      0x18c3, // GEN ADD R4, R3, R3
+      0x1904, // ADD R4, R4, R4
+      0x1703, // ADD R3, R4, R3
+      0x16e7, // ADD R3, R3, #7
+      0x2824, // LD R4, MASK
+      0x58c4, // AND R4, R3, R4
+      0x7840, // STR R4, R1, #0
+      0x1261, // ADD R1, R1, #1
+      0x14bf, // ADD R2, R2, #-1
+      0x03f6, // BRp GEN
+      0x361d, // ST R3, SEED
+      0x241b, // LD R2, N
+      0x14bf, // ADD R2, R2, #-1
+      0x2218, // OUTER LD R1, ARRAY
+      0x16a0, // ADD R3, R2, #0
+      0x6840, // INNER LDR R4, R1, #0
+      0x6041, // LDR R0, R1, #1
+      0x9e3f, // NOT R7, R0
+      0x1fe1, // ADD R7, R7, #1
+      0x1f07, // ADD R7, R4, R7
+      0x0c02, // BRnz KEEP
+      0x7040, // STR R0, R1, #0
+      0x7841, // STR R4, R1, #1
+      0x1261, // KEEP ADD R1, R1, #1
+      0x16ff, // ADD R3, R3, #-1
+      0x03f5, // BRp INNER
+      0x14bf, // ADD R2, R2, #-1
+      0x03f1, // BRp OUTER
+      0x1b7f, // ADD R5, R5, #-1
+      0x03df, // BRp PASS
+      0x2207, // LD R1, ARRAY
+      0x6040, // LDR R0, R1, #0
+      0x2406, // LD R2, N
+      0x1242, // ADD R1, R1, R2
+      0x647f, // LDR R2, R1, #-1
+      0x1002, // ADD R0, R0, R2
+      0xf025, // HALT
+      0x000a, // PASSES .FILL #10
+      0x4000, // ARRAY .FILL x4000
+      0x00c8, // N .FILL #200
+      0x0001, // SEED .FILL #1
+      0x3fff, // MASK .FILL x3FFF
+     }},
+  };
+  return all;
+}
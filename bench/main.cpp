@@ -0,0 +1,118 @@
+#include "Workloads.h"
+#include <Platform.h>
+#include <VirtualMachine.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+struct Measurement {
+  uint64_t instructions = 0;
+  // The median over every repetition.
+  double seconds = 0;
+  uint16_t checksum = 0;
+};
+
+static Measurement measure(const Workload &workload, Engine engine,
+                           TraceLevel level, size_t repetitions) {
+  Measurement measurement;
+  std::vector<double> times;
+  for (size_t i = 0; i < repetitions; i++) {
+    // Each repetition starts from a fresh machine, so none of them reuses
+    // another's decoded or translated code.
+    auto vm = std::make_unique<VirtualMachine>();
+    vm->load(VirtualMachine::PC_START, workload.words.data(),
+             workload.words.size());
+    std::istringstream input;
+    std::ostringstream output;
+    vm->set_io(input, output);
+
+    auto start = std::chrono::steady_clock::now();
+    vm->execute(engine, level);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    times.push_back(elapsed.count());
+    measurement.instructions = vm->instructions();
+    measurement.checksum = vm->get_register(Register::R0);
+  }
+  std::sort(times.begin(), times.end());
+  measurement.seconds = times[times.size() / 2];
+  return measurement;
+}
+
+int main(int argc, const char **argv) {
+  std::vector<Engine> engines = {Engine::Switch, Engine::Threaded,
+                                 Engine::Jit};
+  // Profiling is the one configuration besides None that prints nothing.
+  std::vector<TraceLevel> levels = {TraceLevel::None, TraceLevel::Profile};
+  const char *only = nullptr;
+  size_t repetitions = 5;
+
+  for (int i = 1; i < argc; i++) {
+    auto argument = argv[i];
+    try {
+      if (strncmp(argument, "--engine=", 9) == 0) {
+        engines = {engine_from_name(argument + 9)};
+        continue;
+      }
+      if (strncmp(argument, "--trace=", 8) == 0) {
+        levels = {trace_level_from_name(argument + 8)};
+        continue;
+      }
+    } catch (InvalidEngine &) {
+      std::cout << "Unknown engine: " << argument + 9 << "\n";
+      return 2;
+    } catch (InvalidTraceLevel &) {
+      std::cout << "Unknown trace level: " << argument + 8 << "\n";
+      return 2;
+    }
+    if (strncmp(argument, "--workload=", 11) == 0) {
+      only = argument + 11;
+      continue;
+    }
+    if (strncmp(argument, "--repeat=", 9) == 0) {
+      repetitions = std::strtoul(argument + 9, nullptr, 10);
+      repetitions = std::max<size_t>(repetitions, 1);
+      continue;
+    }
+    std::cout << "Usage: vm_bench [--engine=switch|threaded|jit] "
+                 "[--trace=none|profile] [--workload=<name>] [--repeat=N]\n";
+    return 2;
+  }
+
+  bool correct = true;
+  std::cout << "workload\tengine\tlevel\tinstructions\tmips\tns/instruction"
+               "\tpeak_rss_kib\n";
+  std::cout << std::fixed << std::setprecision(2);
+  for (auto &workload : workloads()) {
+    if (only != nullptr && strcmp(only, workload.name) != 0) {
+      continue;
+    }
+    for (auto engine : engines) {
+      for (auto level : levels) {
+        // Each row's peak is its own where the platform can reset it.
+        bool resettable = reset_peak_resident();
+        auto measurement = measure(workload, engine, level, repetitions);
+        auto instructions = static_cast<double>(measurement.instructions);
+        std::cout << workload.name << "\t" << engine_name(engine) << "\t"
+                  << trace_level_name(level) << "\t"
+                  << measurement.instructions << "\t"
+                  << instructions / measurement.seconds / 1e6 << "\t"
+                  << measurement.seconds * 1e9 / instructions << "\t"
+                  << (resettable ? std::to_string(peak_resident_kib()) : "-")
+                  << "\n";
+        if (measurement.checksum != workload.checksum) {
+          std::cout << "  wrong checksum: " << hex(measurement.checksum)
+                    << ", expected " << hex(workload.checksum) << "\n";
+          correct = false;
+        }
+      }
+    }
+  }
+  return correct ? 0 : 1;
+}
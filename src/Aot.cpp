@@ -0,0 +1,311 @@
+#include <Aot.h>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+static uint16_t word_at(const VirtualMachine &vm, uint16_t address) {
+  auto page = vm.page(address >> Memory::PAGE_BITS);
+  return page[address & (Memory::PAGE_SIZE - 1)];
+}
+
+// `value` as a C++ hexadecimal literal.
+static std::string literal(uint32_t value) {
+  std::ostringstream text;
+  text << "0x" << std::hex << std::setw(4) << std::setfill('0') << value;
+  return text.str();
+}
+
+static std::string reg(uint8_t index) { return "r" + std::to_string(index); }
+
+// The condition BR tests for its n/z/p mask, on `result`.
+static const char *branch_condition(uint8_t nzp) {
+  switch (nzp) {
+  case 1:
+    return "int16_t(result) > 0";
+  case 2:
+    return "result == 0";
+  case 3:
+    return "int16_t(result) >= 0";
+  case 4:
+    return "int16_t(result) < 0";
+  case 5:
+    return "result != 0";
+  case 6:
+    return "int16_t(result) <= 0";
+  default:
+    return "true";
+  }
+}
+
+// The instructions reachable from the PC, and the ones that start a basic
+// block.
+struct ControlFlow {
+  std::vector<bool> code = std::vector<bool>(VirtualMachine::MEMORY_MAX);
+  std::vector<bool> leaders = std::vector<bool>(VirtualMachine::MEMORY_MAX);
+};
+
+static ControlFlow discover(const VirtualMachine &vm, uint16_t origin,
+                            size_t size) {
+  ControlFlow flow;
+  std::vector<uint16_t> pending;
+  // Nothing outside the image is translated, nor the last word of memory,
+  // which the interpreters stop at.
+  auto reach = [&](uint32_t address, bool leader) {
+    if (address < origin || address >= origin + size ||
+        address + 1 >= VirtualMachine::MEMORY_MAX) {
+      return;
+    }
+    if (leader) {
+      flow.leaders[address] = true;
+    }
+    if (!flow.code[address]) {
+      flow.code[address] = true;
+      pending.push_back(static_cast<uint16_t>(address));
+    }
+  };
+
+  reach(VirtualMachine::PC_START, true);
+  while (!pending.empty()) {
+    auto address = pending.back();
+    pending.pop_back();
+    auto instruction = decode(Instruction(word_at(vm, address)));
+    uint16_t next = address + 1;
+    uint16_t target = next + instruction.imm;
+    switch (instruction.handler) {
+    case Handler::BR:
+      if (instruction.dr != 0) {
+        reach(target, true);
+      }
+      if (instruction.dr != 7) {
+        reach(next, instruction.dr != 0);
+      }
+      break;
+    case Handler::JSR:
+      reach(target, true);
+      reach(next, true);
+      break;
+    case Handler::JSRR:
+      // Where RET comes back to.
+      reach(next, true);
+      break;
+    case Handler::JMP:
+    case Handler::RES:
+      break;
+    default:
+      reach(next, false);
+      break;
+    }
+  }
+  return flow;
+}
+
+// Writes the C++ for the instruction at `address`.
+static void translate(const VirtualMachine &vm, const ControlFlow &flow,
+                      uint16_t address, std::ostream &cpp) {
+  auto word = word_at(vm, address);
+  auto instruction = decode(Instruction(word));
+  auto dr = reg(instruction.dr);
+  auto sr1 = reg(instruction.sr1);
+  auto sr2 = reg(instruction.sr2);
+  auto imm = literal(instruction.imm);
+  uint16_t next = address + 1;
+  uint16_t target = next + instruction.imm;
+  // Control moves to `to`: straight to its label if it is translated.
+  auto go_to = [&](uint16_t to) {
+    if (flow.code[to]) {
+      return "goto L" + literal(to) + ";";
+    }
+    return "{ pc = " + literal(to) + "; goto leave; }";
+  };
+  auto set_dr = [&](const std::string &value) {
+    cpp << "  " << dr << " = uint16_t(" << value << ");\n";
+    cpp << "  result = " << dr << ";\n";
+  };
+
+  cpp << "  // " << literal(address) << ": " << literal(word) << " "
+      << handler_name(instruction.handler) << "\n";
+  cpp << "  n++;\n";
+  switch (instruction.handler) {
+  case Handler::ADD_REG:
+    set_dr(sr1 + " + " + sr2);
+    break;
+  case Handler::ADD_IMM:
+    set_dr(sr1 + " + " + imm);
+    break;
+  case Handler::AND_REG:
+    set_dr(sr1 + " & " + sr2);
+    break;
+  case Handler::AND_IMM:
+    set_dr(sr1 + " & " + imm);
+    break;
+  case Handler::NOT:
+    set_dr("~" + sr1);
+    break;
+  case Handler::LEA:
+    set_dr(literal(target));
+    break;
+  case Handler::LD:
+    set_dr("c.load(" + literal(target) + ", n)");
+    break;
+  case Handler::LDI:
+    set_dr("c.load(c.load(" + literal(target) + ", n), n)");
+    break;
+  case Handler::LDR:
+    set_dr("c.load(uint16_t(" + sr1 + " + " + imm + "), n)");
+    break;
+  case Handler::ST:
+  case Handler::STI:
+  case Handler::STR: {
+    auto to = instruction.handler == Handler::ST ? literal(target)
+              : instruction.handler == Handler::STI
+                  ? "c.load(" + literal(target) + ", n)"
+                  : "uint16_t(" + sr1 + " + " + imm + ")";
+    // Translated code that was just overwritten must not run.
+    cpp << "  if (c.store(" << to << ", " << dr << ")) {\n";
+    cpp << "    pc = " << literal(next) << ";\n";
+    cpp << "    goto leave;\n";
+    cpp << "  }\n";
+    break;
+  }
+  case Handler::BR:
+    if (instruction.dr == 7) {
+      cpp << "  " << go_to(target) << "\n";
+    } else if (instruction.dr != 0) {
+      cpp << "  if (" << branch_condition(instruction.dr) << ")\n";
+      cpp << "    " << go_to(target) << "\n";
+    }
+    break;
+  case Handler::JMP:
+    cpp << "  pc = " << sr1 << ";\n";
+    cpp << "  goto dispatch;\n";
+    return;
+  case Handler::JSR:
+    cpp << "  r7 = " << literal(next) << ";\n";
+    cpp << "  " << go_to(target) << "\n";
+    return;
+  case Handler::JSRR:
+    // R7 is written first, so JSRR R7 jumps to the next word.
+    cpp << "  r7 = " << literal(next) << ";\n";
+    cpp << "  pc = " << sr1 << ";\n";
+    cpp << "  goto dispatch;\n";
+    return;
+  default:
+    // TRAP, RTI and reserved opcodes.
+    cpp << "  pc = " << literal(next) << ";\n";
+    cpp << "  SPILL();\n";
+    cpp << "  if (auto exit = c.perform(" << literal(word)
+        << "); exit != AotExit::Continue)\n";
+    cpp << "    return exit;\n";
+    cpp << "  RELOAD();\n";
+    break;
+  }
+  if (instruction.handler == Handler::BR && instruction.dr == 7) {
+    return;
+  }
+  if (instruction.handler == Handler::RES) {
+    return;
+  }
+  // Falling through into code that is not translated.
+  if (!flow.code[next]) {
+    cpp << "  pc = " << literal(next) << ";\n";
+    cpp << "  goto leave;\n";
+  }
+}
+
+void translate_image(const VirtualMachine &vm, uint16_t origin, size_t size,
+                     std::ostream &cpp) {
+  auto flow = discover(vm, origin, size);
+
+  cpp << "// Translated from an LC-3 image by `vm aot`. Link it with lc3.\n";
+  cpp << "#include <AotRuntime.h>\n\n";
+
+  // A zero-length array is not C++, so both arrays get one spare entry.
+  cpp << "static const uint16_t WORDS[] = {";
+  for (size_t i = 0; i < size; i++) {
+    cpp << (i % 8 == 0 ? "\n    " : " ") << literal(word_at(vm, origin + i))
+        << ",";
+  }
+  cpp << "\n    0};\n\n";
+
+  cpp << "static const AotRange CODE[] = {\n";
+  size_t ranges = 0;
+  for (uint32_t address = 0; address < VirtualMachine::MEMORY_MAX;
+       address++) {
+    if (flow.code[address] && (address == 0 || !flow.code[address - 1])) {
+      auto end = address;
+      while (end < VirtualMachine::MEMORY_MAX && flow.code[end]) {
+        end++;
+      }
+      cpp << "    {" << literal(address) << ", " << literal(end) << "},\n";
+      ranges++;
+    }
+  }
+  cpp << "    {0, 0}};\n\n";
+
+  // Registers live in locals, copied out and back around calls that need
+  // the whole machine.
+  cpp << "#define SPILL() \\\n"
+         "  c.registers[0] = r0, c.registers[1] = r1, c.registers[2] = r2, \\\n"
+         "  c.registers[3] = r3, c.registers[4] = r4, c.registers[5] = r5, \\\n"
+         "  c.registers[6] = r6, c.registers[7] = r7, c.result = result, \\\n"
+         "  c.pc = pc, c.instructions = n\n"
+         "#define RELOAD() \\\n"
+         "  r0 = c.registers[0], r1 = c.registers[1], r2 = c.registers[2], \\\n"
+         "  r3 = c.registers[3], r4 = c.registers[4], r5 = c.registers[5], \\\n"
+         "  r6 = c.registers[6], r7 = c.registers[7], result = c.result, \\\n"
+         "  n = c.instructions\n\n";
+
+  cpp << "static AotExit run(AotContext &c) {\n";
+  cpp << "  uint16_t r0, r1, r2, r3, r4, r5, r6, r7, result;\n";
+  cpp << "  uint64_t n;\n";
+  cpp << "  uint16_t pc = c.pc;\n";
+  cpp << "  RELOAD();\n\n";
+  // The label only exists for computed jumps.
+  bool computed = false;
+  for (uint32_t address = 0; address < VirtualMachine::MEMORY_MAX;
+       address++) {
+    if (flow.code[address]) {
+      auto handler = decode(Instruction(word_at(vm, address))).handler;
+      computed |= handler == Handler::JMP || handler == Handler::JSRR;
+    }
+  }
+  if (computed) {
+    cpp << "dispatch:\n";
+  }
+  cpp << "  switch (pc) {\n";
+  for (uint32_t address = 0; address < VirtualMachine::MEMORY_MAX;
+       address++) {
+    if (flow.leaders[address]) {
+      cpp << "  case " << literal(address) << ":\n";
+      cpp << "    goto L" << literal(address) << ";\n";
+    }
+  }
+  cpp << "  default:\n";
+  cpp << "    goto leave;\n";
+  cpp << "  }\n";
+
+  for (uint32_t address = 0; address < VirtualMachine::MEMORY_MAX;
+       address++) {
+    if (!flow.code[address]) {
+      continue;
+    }
+    if (flow.leaders[address]) {
+      cpp << "\nL" << literal(address) << ":\n";
+    }
+    translate(vm, flow, static_cast<uint16_t>(address), cpp);
+  }
+
+  cpp << "\nleave:\n";
+  cpp << "  SPILL();\n";
+  cpp << "  return AotExit::Interpret;\n";
+  cpp << "}\n\n";
+
+  cpp << "static const AotProgram PROGRAM = {" << literal(origin)
+      << ", WORDS, " << size << ", CODE, " << ranges << ", run};\n\n";
+  cpp << "#ifdef LC3_AOT_PROGRAM\n";
+  cpp << "extern const AotProgram &LC3_AOT_PROGRAM;\n";
+  cpp << "const AotProgram &LC3_AOT_PROGRAM = PROGRAM;\n";
+  cpp << "#else\n";
+  cpp << "int main() { return aot_main(PROGRAM); }\n";
+  cpp << "#endif\n";
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <VirtualMachine.h>
+#include <cstdint>
+#include <iostream>
+
+// Writes C++ that runs the image of `size` words at `origin` onwards in
+// `vm`'s memory, ahead of time. Linked against lc3 it is a program of
+// its own; see aot_main(). Compiled with LC3_AOT_PROGRAM defined to a name
+// it has no main() and instead defines that name as a reference to its
+// AotProgram, for a program that runs it with run_translated().
+//
+// The translator follows control flow from VirtualMachine::PC_START through
+// every branch, JSR and fall-through that stays inside the image, and emits
+// the reachable instructions as one function with a label per basic block.
+// Known targets are direct gotos; JMP, RET and JSRR go through a switch over
+// the block labels. Registers live in locals, and only memory, devices and
+// traps go through the VirtualMachine.
+void translate_image(const VirtualMachine &vm, uint16_t origin, size_t size,
+                     std::ostream &cpp);
@@ -0,0 +1,83 @@
+#include <AotRuntime.h>
+#include <Platform.h>
+#include <csignal>
+
+AotContext::AotContext(VirtualMachine &vm, const AotProgram &program)
+    : m_vm(vm) {
+  for (size_t i = 0; i < program.code_ranges; i++) {
+    for (uint32_t address = program.code[i].first;
+         address < program.code[i].end; address++) {
+      m_code.set(address);
+    }
+  }
+  sync_from_machine();
+}
+
+AotExit AotContext::perform(uint16_t word) {
+  auto next = pc;
+  sync_to_machine();
+  auto should_break = m_vm.perform(Instruction(word));
+  sync_from_machine();
+  if (should_break == VirtualMachine::ShouldBreak::Yes) {
+    return AotExit::Stopped;
+  }
+  return pc == next ? AotExit::Continue : AotExit::Interpret;
+}
+
+void AotContext::sync_to_machine() {
+  for (uint16_t r = 0; r < 8; r++) {
+    m_vm.set_register(static_cast<Register>(r), registers[r],
+                      VirtualMachine::ShouldUpdateCondition::No);
+  }
+  m_vm.set_register(Register::PC, pc,
+                    VirtualMachine::ShouldUpdateCondition::No);
+  // Any value with the same sign and zeroness sets the same flag.
+  uint16_t flag = result == 0        ? to_underlying(ConditionFlag::ZRO)
+                  : result >> 15 ? to_underlying(ConditionFlag::NEG)
+                                 : to_underlying(ConditionFlag::POS);
+  m_vm.set_register(Register::COND, flag);
+  m_vm.set_instructions(instructions);
+}
+
+void AotContext::sync_from_machine() {
+  for (uint16_t r = 0; r < 8; r++) {
+    registers[r] = m_vm.get_register(static_cast<Register>(r));
+  }
+  pc = m_vm.get_register(Register::PC);
+  switch (static_cast<ConditionFlag>(m_vm.get_register(Register::COND))) {
+  case ConditionFlag::NEG:
+    result = 0x8000;
+    break;
+  case ConditionFlag::ZRO:
+    result = 0;
+    break;
+  default:
+    result = 1;
+    break;
+  }
+  instructions = m_vm.instructions();
+}
+
+void run_translated(VirtualMachine &vm, const AotProgram &program) {
+  AotContext context(vm, program);
+  auto exit = program.run(context);
+  context.sync_to_machine();
+  if (exit == AotExit::Interpret) {
+    vm.execute(Engine::Threaded);
+  }
+}
+
+int aot_main(const AotProgram &program) {
+  signal(SIGINT, handle_interrupt);
+  disable_input_buffering();
+
+  VirtualMachine vm;
+  vm.load(program.origin, program.words, program.size);
+  run_translated(vm, program);
+  std::cout.flush();
+
+  restore_input_buffering();
+  // The same status vm exits with for the image, which keeps the original
+  // exit(1) on HALT.
+  return vm.exit_reason() == ExitReason::Halted ? 1 : 0;
+}
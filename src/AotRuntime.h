@@ -0,0 +1,82 @@
+#pragma once
+
+#include <VirtualMachine.h>
+#include <bitset>
+#include <cstdint>
+
+// What the C++ that `vm aot` writes links against. The translated code keeps
+// the guest registers in locals and only goes through the VirtualMachine for
+// memory, devices and traps, so it behaves exactly as the interpreters do.
+
+enum class AotExit {
+  Stopped,   /* the machine stopped; see VirtualMachine::exit_reason() */
+  Interpret, /* carry on in the interpreter from AotContext::pc */
+  Continue   /* AotContext::perform() only: carry on with the next word */
+};
+
+// A run of translated words, [first, end).
+struct AotRange {
+  uint16_t first;
+  uint32_t end;
+};
+
+class AotContext;
+
+// Everything one translated image carries.
+struct AotProgram {
+  uint16_t origin;
+  const uint16_t *words;
+  size_t size;
+  const AotRange *code;
+  size_t code_ranges;
+  // Runs from AotContext::pc, which must start a translated block.
+  AotExit (*run)(AotContext &);
+};
+
+// The machine state translated code works on, with the VirtualMachine
+// underneath it.
+class AotContext {
+public:
+  AotContext(VirtualMachine &vm, const AotProgram &program);
+
+  uint16_t registers[8] = {};
+  // The last flag-setting value, as in VirtualMachine.
+  uint16_t result = 0;
+  uint16_t pc = 0;
+  uint64_t instructions = 0;
+
+  // `instructions` is the count up to and including the load, which input
+  // from the keyboard is logged with.
+  uint16_t load(uint16_t address, uint64_t instructions) {
+    if (address >= 0xfe00) [[unlikely]] {
+      m_vm.set_instructions(instructions);
+    }
+    return m_vm.read_memory(address);
+  }
+  // Whether the store overwrote translated code, which must not run again.
+  bool store(uint16_t address, uint16_t value) {
+    m_vm.write_memory(address, value);
+    return m_code[address];
+  }
+  // Runs `word`, the instruction before `pc`, through the VirtualMachine.
+  // A trap into a guest service routine leaves for the interpreter, which
+  // runs the routine.
+  AotExit perform(uint16_t word);
+
+  // Copies the state between the context and the VirtualMachine.
+  void sync_to_machine();
+  void sync_from_machine();
+
+private:
+  VirtualMachine &m_vm;
+  std::bitset<VirtualMachine::MEMORY_MAX> m_code;
+};
+
+// Runs `program` on `vm`, which must hold its image, from the machine's PC.
+// Translated code runs for as long as control stays in it; an unknown
+// computed jump or a write to translated code hands the rest of the run to
+// the threaded interpreter.
+void run_translated(VirtualMachine &vm, const AotProgram &program);
+
+// The main() of a translated image: loads it and runs it on the console.
+int aot_main(const AotProgram &program);
@@ -0,0 +1,514 @@
+#include <Assembler.h>
+#include <Opcode.h>
+#include <Trap.h>
+#include <algorithm>
+#include <charconv>
+#include <optional>
+#include <unordered_map>
+
+enum class Mnemonic {
+  ADD,
+  AND,
+  NOT,
+  BR,
+  JMP,
+  RET,
+  JSR,
+  JSRR,
+  LD,
+  LDI,
+  LDR,
+  LEA,
+  ST,
+  STI,
+  STR,
+  TRAP,
+  RTI,
+  GETC,
+  OUT,
+  PUTS,
+  IN,
+  PUTSP,
+  HALT,
+  ORIG,
+  FILL,
+  BLKW,
+  STRINGZ,
+  END
+};
+
+struct MnemonicName {
+  std::string_view name;
+  Mnemonic mnemonic;
+  uint8_t operands;
+};
+
+// BR and its condition suffixes are parsed apart.
+static constexpr MnemonicName MNEMONICS[] = {
+    {"ADD", Mnemonic::ADD, 3},         {"AND", Mnemonic::AND, 3},
+    {"NOT", Mnemonic::NOT, 2},         {"JMP", Mnemonic::JMP, 1},
+    {"RET", Mnemonic::RET, 0},         {"JSR", Mnemonic::JSR, 1},
+    {"JSRR", Mnemonic::JSRR, 1},       {"LD", Mnemonic::LD, 2},
+    {"LDI", Mnemonic::LDI, 2},         {"LDR", Mnemonic::LDR, 3},
+    {"LEA", Mnemonic::LEA, 2},         {"ST", Mnemonic::ST, 2},
+    {"STI", Mnemonic::STI, 2},         {"STR", Mnemonic::STR, 3},
+    {"TRAP", Mnemonic::TRAP, 1},       {"RTI", Mnemonic::RTI, 0},
+    {"GETC", Mnemonic::GETC, 0},       {"OUT", Mnemonic::OUT, 0},
+    {"PUTS", Mnemonic::PUTS, 0},       {"IN", Mnemonic::IN, 0},
+    {"PUTSP", Mnemonic::PUTSP, 0},     {"HALT", Mnemonic::HALT, 0},
+    {".ORIG", Mnemonic::ORIG, 1},      {".FILL", Mnemonic::FILL, 1},
+    {".BLKW", Mnemonic::BLKW, 1},      {".STRINGZ", Mnemonic::STRINGZ, 1},
+    {".END", Mnemonic::END, 0},
+};
+
+// One instruction or directive, laid out by the first pass.
+struct Statement {
+  size_t line;
+  uint16_t address;
+  Mnemonic mnemonic;
+  // BR's n, z and p bits.
+  uint8_t nzp;
+  std::string_view operands[3];
+};
+
+using Symbols = std::unordered_map<std::string_view, uint16_t>;
+
+static constexpr size_t MAX_TOKENS = 5;
+
+static bool is_space(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\v' || ch == '\f';
+}
+
+static bool is_digit(char ch) { return ch >= '0' && ch <= '9'; }
+
+static char to_upper(char ch) {
+  return ch >= 'a' && ch <= 'z' ? static_cast<char>(ch - 'a' + 'A') : ch;
+}
+
+static bool equal_ignoring_case(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    if (to_upper(a[i]) != b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Splits `line` into at most MAX_TOKENS tokens, dropping the comment. A
+// quoted string is one token, quotes included.
+static size_t split(std::string_view line, size_t number,
+                    std::string_view *tokens) {
+  size_t count = 0;
+  size_t i = 0;
+  while (i < line.size()) {
+    char ch = line[i];
+    if (ch == ';') {
+      break;
+    }
+    if (is_space(ch) || ch == ',') {
+      i++;
+      continue;
+    }
+    size_t start = i;
+    if (ch == '"') {
+      for (i++; i < line.size() && line[i] != '"'; i++) {
+        if (line[i] == '\\') {
+          i++;
+        }
+      }
+      if (i >= line.size()) {
+        throw AssemblyError{number, "unterminated string"};
+      }
+      i++;
+    } else {
+      while (i < line.size() && !is_space(line[i]) && line[i] != ',' &&
+             line[i] != ';') {
+        i++;
+      }
+    }
+    if (count == MAX_TOKENS) {
+      throw AssemblyError{number, "too many operands"};
+    }
+    tokens[count++] = line.substr(start, i - start);
+  }
+  return count;
+}
+
+static const MnemonicName *find_mnemonic(std::string_view token,
+                                         uint8_t &nzp) {
+  static constexpr MnemonicName BR = {"BR", Mnemonic::BR, 1};
+  if (token.size() >= 2 && equal_ignoring_case(token.substr(0, 2), "BR")) {
+    // BRn, BRz, BRp and their combinations, in that order. A bare BR is
+    // BRnzp.
+    size_t i = 2;
+    nzp = 0;
+    for (auto [flag, bit] : {std::pair{'N', 4}, {'Z', 2}, {'P', 1}}) {
+      if (i < token.size() && to_upper(token[i]) == flag) {
+        nzp |= bit;
+        i++;
+      }
+    }
+    if (i == token.size()) {
+      nzp = nzp == 0 ? 7 : nzp;
+      return &BR;
+    }
+  }
+  for (auto &entry : MNEMONICS) {
+    if (equal_ignoring_case(token, entry.name)) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+static bool is_label(std::string_view token) {
+  auto is_start = [](char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_';
+  };
+  if (token.empty() || !is_start(token[0])) {
+    return false;
+  }
+  for (char ch : token) {
+    if (!is_start(ch) && !is_digit(ch)) {
+      return false;
+    }
+  }
+  // R0 to R7 name registers.
+  return !(token.size() == 2 && to_upper(token[0]) == 'R' && token[1] >= '0' &&
+           token[1] <= '7');
+}
+
+// #-12, -12, 12, x1F or x-1F. Empty if `token` is no number at all.
+static std::optional<int32_t> parse_number(std::string_view token,
+                                           size_t line) {
+  int base = 10;
+  if (!token.empty() && token[0] == '#') {
+    token.remove_prefix(1);
+  } else if (token.size() > 1 && (token[0] == 'x' || token[0] == 'X')) {
+    base = 16;
+    token.remove_prefix(1);
+  } else if (token.empty() || !(token[0] == '-' || is_digit(token[0]))) {
+    return std::nullopt;
+  }
+  bool negative = !token.empty() && token[0] == '-';
+  if (negative) {
+    token.remove_prefix(1);
+  }
+  int32_t value = 0;
+  auto end = token.data() + token.size();
+  auto [parsed, error] = std::from_chars(token.data(), end, value, base);
+  if (parsed != end || error != std::errc()) {
+    // x followed by anything but hexadecimal digits may still be a label.
+    if (base == 16 && !negative) {
+      return std::nullopt;
+    }
+    throw AssemblyError{line, "invalid number"};
+  }
+  return negative ? -value : value;
+}
+
+static int32_t number(const Statement &statement, size_t index, int32_t min,
+                      int32_t max) {
+  auto value = parse_number(statement.operands[index], statement.line);
+  if (!value) {
+    throw AssemblyError{statement.line, "expected a number"};
+  }
+  if (*value < min || *value > max) {
+    throw AssemblyError{statement.line, "number out of range"};
+  }
+  return *value;
+}
+
+static uint16_t reg(const Statement &statement, size_t index) {
+  auto token = statement.operands[index];
+  if (token.size() != 2 || to_upper(token[0]) != 'R' || token[1] < '0' ||
+      token[1] > '7') {
+    throw AssemblyError{statement.line, "expected a register"};
+  }
+  return static_cast<uint16_t>(token[1] - '0');
+}
+
+// The `bits`-bit two's complement field for `value`.
+static uint16_t field(const Statement &statement, int32_t value, int bits) {
+  if (value < -(1 << (bits - 1)) || value >= (1 << (bits - 1))) {
+    throw AssemblyError{statement.line, "number out of range"};
+  }
+  return static_cast<uint16_t>(value & ((1 << bits) - 1));
+}
+
+static uint16_t immediate(const Statement &statement, size_t index, int bits) {
+  return field(statement, number(statement, index, INT16_MIN, UINT16_MAX),
+               bits);
+}
+
+static uint16_t address_of(const Statement &statement, size_t index,
+                           const Symbols &symbols) {
+  auto symbol = symbols.find(statement.operands[index]);
+  if (symbol == symbols.end()) {
+    throw AssemblyError{statement.line, "undefined label"};
+  }
+  return symbol->second;
+}
+
+// A label's distance from the incremented PC, or the offset itself.
+static uint16_t pc_offset(const Statement &statement, size_t index, int bits,
+                          const Symbols &symbols) {
+  auto token = statement.operands[index];
+  if (!is_label(token) || parse_number(token, statement.line)) {
+    return immediate(statement, index, bits);
+  }
+  int32_t target = address_of(statement, index, symbols);
+  return field(statement, target - (statement.address + 1), bits);
+}
+
+// Calls put(ch) for every character of a .STRINGZ operand and returns how
+// many there were.
+template <typename Put>
+static size_t unescape(const Statement &statement, Put &&put) {
+  auto token = statement.operands[0];
+  if (token.size() < 2 || token.front() != '"' || token.back() != '"') {
+    throw AssemblyError{statement.line, "expected a string"};
+  }
+  size_t count = 0;
+  for (size_t i = 1; i + 1 < token.size(); i++, count++) {
+    char ch = token[i];
+    if (ch == '\\') {
+      switch (token[++i]) {
+      case 'n':
+        ch = '\n';
+        break;
+      case 't':
+        ch = '\t';
+        break;
+      case '0':
+        ch = '\0';
+        break;
+      case '"':
+      case '\\':
+        ch = token[i];
+        break;
+      default:
+        throw AssemblyError{statement.line, "unknown escape"};
+      }
+    }
+    put(static_cast<uint8_t>(ch));
+  }
+  return count;
+}
+
+// How many words `statement` takes.
+static size_t size_of(const Statement &statement) {
+  switch (statement.mnemonic) {
+  case Mnemonic::BLKW:
+    return number(statement, 0, 0, VirtualMachine::MEMORY_MAX);
+  case Mnemonic::STRINGZ:
+    return unescape(statement, [](uint8_t) {}) + 1;
+  default:
+    return 1;
+  }
+}
+
+static uint16_t opcode(OpCode op) {
+  return static_cast<uint16_t>(to_underlying(op) << 12);
+}
+
+static uint16_t trap(Trap vector) {
+  return opcode(OpCode::TRAP) | static_cast<uint16_t>(to_underlying(vector));
+}
+
+// Writes the words of `statement` to `out`.
+static void encode(const Statement &statement, const Symbols &symbols,
+                   uint16_t *out) {
+  auto &s = statement;
+  switch (s.mnemonic) {
+  case Mnemonic::ADD:
+  case Mnemonic::AND: {
+    auto op = s.mnemonic == Mnemonic::ADD ? OpCode::ADD : OpCode::AND;
+    *out = opcode(op) | reg(s, 0) << 9 | reg(s, 1) << 6;
+    auto last = s.operands[2];
+    if (last.size() == 2 && to_upper(last[0]) == 'R') {
+      *out |= reg(s, 2);
+    } else {
+      *out |= 1 << 5 | immediate(s, 2, 5);
+    }
+    break;
+  }
+  case Mnemonic::NOT:
+    *out = opcode(OpCode::NOT) | reg(s, 0) << 9 | reg(s, 1) << 6 | 0x3f;
+    break;
+  case Mnemonic::BR:
+    *out = opcode(OpCode::BR) | s.nzp << 9 | pc_offset(s, 0, 9, symbols);
+    break;
+  case Mnemonic::JMP:
+    *out = opcode(OpCode::JMP) | reg(s, 0) << 6;
+    break;
+  case Mnemonic::RET:
+    *out = opcode(OpCode::JMP) | 7 << 6;
+    break;
+  case Mnemonic::JSR:
+    *out = opcode(OpCode::JSR) | 1 << 11 | pc_offset(s, 0, 11, symbols);
+    break;
+  case Mnemonic::JSRR:
+    *out = opcode(OpCode::JSR) | reg(s, 0) << 6;
+    break;
+  case Mnemonic::LD:
+  case Mnemonic::LDI:
+  case Mnemonic::LEA:
+  case Mnemonic::ST:
+  case Mnemonic::STI: {
+    auto op = s.mnemonic == Mnemonic::LD    ? OpCode::LD
+              : s.mnemonic == Mnemonic::LDI ? OpCode::LDI
+              : s.mnemonic == Mnemonic::LEA ? OpCode::LEA
+              : s.mnemonic == Mnemonic::ST  ? OpCode::ST
+                                            : OpCode::STI;
+    *out = opcode(op) | reg(s, 0) << 9 | pc_offset(s, 1, 9, symbols);
+    break;
+  }
+  case Mnemonic::LDR:
+  case Mnemonic::STR: {
+    auto op = s.mnemonic == Mnemonic::LDR ? OpCode::LDR : OpCode::STR;
+    *out =
+        opcode(op) | reg(s, 0) << 9 | reg(s, 1) << 6 | immediate(s, 2, 6);
+    break;
+  }
+  case Mnemonic::TRAP:
+    *out = opcode(OpCode::TRAP) | number(s, 0, 0, 0xff);
+    break;
+  case Mnemonic::RTI:
+    *out = opcode(OpCode::RTI);
+    break;
+  case Mnemonic::GETC:
+    *out = trap(Trap::GETC);
+    break;
+  case Mnemonic::OUT:
+    *out = trap(Trap::OUT_);
+    break;
+  case Mnemonic::PUTS:
+    *out = trap(Trap::PUTS);
+    break;
+  case Mnemonic::IN:
+    *out = trap(Trap::IN_);
+    break;
+  case Mnemonic::PUTSP:
+    *out = trap(Trap::PUTSP);
+    break;
+  case Mnemonic::HALT:
+    *out = trap(Trap::HALT);
+    break;
+  case Mnemonic::FILL:
+    *out = is_label(s.operands[0]) && !parse_number(s.operands[0], s.line)
+               ? address_of(s, 0, symbols)
+               : static_cast<uint16_t>(number(s, 0, INT16_MIN, UINT16_MAX));
+    break;
+  case Mnemonic::BLKW:
+    // Already zero.
+    break;
+  case Mnemonic::STRINGZ:
+    // The terminating zero is already there.
+    unescape(s, [&out](uint8_t ch) { *out++ = ch; });
+    break;
+  case Mnemonic::ORIG:
+  case Mnemonic::END:
+    break;
+  }
+}
+
+Assembly assemble(std::string_view source) {
+  Assembly assembly;
+  std::vector<Statement> statements;
+  Symbols symbols;
+  std::optional<size_t> address;
+
+  // First pass: where every statement and label goes.
+  size_t line_number = 0;
+  while (!source.empty()) {
+    auto end = source.find('\n');
+    auto line = source.substr(0, end);
+    source.remove_prefix(end == source.npos ? source.size() : end + 1);
+    line_number++;
+
+    std::string_view tokens[MAX_TOKENS];
+    auto count = split(line, line_number, tokens);
+    if (count == 0) {
+      continue;
+    }
+    uint8_t nzp = 0;
+    size_t first = 0;
+    auto mnemonic = find_mnemonic(tokens[0], nzp);
+    if (mnemonic == nullptr) {
+      auto label = tokens[0];
+      if (label.back() == ':') {
+        label.remove_suffix(1);
+      }
+      if (!is_label(label)) {
+        throw AssemblyError{line_number, "invalid label"};
+      }
+      if (!address) {
+        throw AssemblyError{line_number, "expected .ORIG"};
+      }
+      if (!symbols.emplace(label, static_cast<uint16_t>(*address)).second) {
+        throw AssemblyError{line_number, "duplicate label"};
+      }
+      if (count == 1) {
+        continue;
+      }
+      first = 1;
+      mnemonic = find_mnemonic(tokens[1], nzp);
+      if (mnemonic == nullptr) {
+        throw AssemblyError{line_number, "unknown instruction"};
+      }
+    }
+    if (count - first - 1 != mnemonic->operands) {
+      throw AssemblyError{line_number, "wrong number of operands"};
+    }
+
+    Statement statement = {line_number,
+                           static_cast<uint16_t>(address.value_or(0)),
+                           mnemonic->mnemonic, nzp};
+    std::copy(tokens + first + 1, tokens + count, statement.operands);
+    if (statement.mnemonic == Mnemonic::ORIG) {
+      if (address) {
+        throw AssemblyError{line_number, "more than one .ORIG"};
+      }
+      address = assembly.origin =
+          static_cast<uint16_t>(number(statement, 0, 0, UINT16_MAX));
+      continue;
+    }
+    if (!address) {
+      throw AssemblyError{line_number, "expected .ORIG"};
+    }
+    if (statement.mnemonic == Mnemonic::END) {
+      break;
+    }
+    *address += size_of(statement);
+    if (*address > VirtualMachine::MEMORY_MAX) {
+      throw AssemblyError{line_number, "program does not fit in memory"};
+    }
+    statements.push_back(statement);
+  }
+  if (!address) {
+    throw AssemblyError{line_number, "expected .ORIG"};
+  }
+
+  // Second pass: every label is known, so every word can be encoded.
+  assembly.words.resize(*address - assembly.origin);
+  for (auto &statement : statements) {
+    encode(statement, symbols,
+           assembly.words.data() + (statement.address - assembly.origin));
+  }
+  return assembly;
+}
+
+void Assembly::write_image(std::ostream &image) const {
+  auto put = [&image](uint16_t word) {
+    image.put(static_cast<char>(word >> 8));
+    image.put(static_cast<char>(word & 0xff));
+  };
+  put(origin);
+  for (auto word : words) {
+    put(word);
+  }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <VirtualMachine.h>
+#include <cstdint>
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+// Where and why assemble() gave up. `line` counts from 1.
+struct AssemblyError {
+  size_t line;
+  const char *message;
+};
+
+// The words of an assembled program, to be placed at `origin` onwards.
+struct Assembly {
+  uint16_t origin = 0;
+  std::vector<uint16_t> words;
+
+  // Copies the words straight into `vm`'s memory, as ImageFile does.
+  void load_into(VirtualMachine &vm) const {
+    vm.load(origin, words.data(), words.size());
+  }
+  // Writes the object file ImageFile reads: the origin, then the words, all
+  // big-endian.
+  void write_image(std::ostream &image) const;
+};
+
+// Assembles LC-3 source in two passes: the first lays out every statement
+// and records its label in a hash table, the second encodes the statements.
+//
+// A line holds an optional label, an instruction or directive and its
+// operands, separated by spaces or commas; ';' starts a comment. Opcodes,
+// directives and registers are case-insensitive, labels are not. Numbers are
+// decimal, with or without '#', or hexadecimal after 'x'. The program starts
+// with .ORIG and ends with .END (or the end of the source); .FILL, .BLKW and
+// .STRINGZ (with \n, \t, \", \\ and \0 escapes) lay out data. PC-relative
+// operands take a label or the offset itself.
+//
+// Throws AssemblyError on the first mistake.
+Assembly assemble(std::string_view source);
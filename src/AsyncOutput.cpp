@@ -0,0 +1,105 @@
+#include <AsyncOutput.h>
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+AsyncOutput::AsyncOutput(FILE *file, size_t capacity,
+                         std::chrono::milliseconds interval)
+    : m_file(file), m_capacity(std::bit_ceil(std::max<size_t>(capacity, 2))),
+      m_interval(interval) {
+  m_ring = std::make_unique<char[]>(m_capacity);
+  m_writer = std::thread([this] { drain(); });
+}
+
+AsyncOutput::~AsyncOutput() {
+  sync();
+  {
+    std::lock_guard lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_one();
+  m_writer.join();
+}
+
+AsyncOutput::int_type AsyncOutput::overflow(int_type ch) {
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    char byte = traits_type::to_char_type(ch);
+    write(&byte, 1);
+  }
+  return traits_type::not_eof(ch);
+}
+
+std::streamsize AsyncOutput::xsputn(const char *data, std::streamsize count) {
+  write(data, static_cast<size_t>(count));
+  return count;
+}
+
+int AsyncOutput::sync() {
+  std::unique_lock lock(m_mutex);
+  if (pending() == 0) {
+    return 0;
+  }
+  m_flush = true;
+  m_wake.notify_one();
+  m_drained.wait(lock, [this] { return pending() == 0; });
+  return 0;
+}
+
+void AsyncOutput::write(const char *data, size_t count) {
+  while (count > 0) {
+    auto head = m_head.load(std::memory_order_relaxed);
+    auto used = head - m_tail.load(std::memory_order_acquire);
+    if (used == m_capacity) {
+      // Full: wait for the writer thread to catch up.
+      std::unique_lock lock(m_mutex);
+      m_flush = true;
+      m_wake.notify_one();
+      m_drained.wait(lock, [this] { return pending() < m_capacity; });
+      continue;
+    }
+
+    auto chunk = std::min(count, m_capacity - used);
+    auto offset = head & (m_capacity - 1);
+    auto first = std::min(chunk, m_capacity - offset);
+    std::memcpy(&m_ring[offset], data, first);
+    std::memcpy(&m_ring[0], data + first, chunk - first);
+    m_head.store(head + chunk, std::memory_order_release);
+
+    // Crossing the half-full mark is the size threshold. A notification that
+    // races with the writer thread going to sleep is covered by its timeout.
+    if (used < m_capacity / 2 && used + chunk >= m_capacity / 2) {
+      m_wake.notify_one();
+    }
+    data += chunk;
+    count -= chunk;
+  }
+}
+
+void AsyncOutput::drain() {
+  std::unique_lock lock(m_mutex);
+  for (;;) {
+    m_wake.wait_for(lock, m_interval, [this] {
+      return m_stop || m_flush || pending() >= m_capacity / 2;
+    });
+    m_flush = false;
+
+    auto head = m_head.load(std::memory_order_acquire);
+    auto tail = m_tail.load(std::memory_order_relaxed);
+    if (head != tail) {
+      // Writing does not need the lock: only this thread reads the ring.
+      lock.unlock();
+      while (tail != head) {
+        auto offset = tail & (m_capacity - 1);
+        auto chunk = std::min(head - tail, m_capacity - offset);
+        std::fwrite(&m_ring[offset], 1, chunk, m_file);
+        tail += chunk;
+      }
+      std::fflush(m_file);
+      lock.lock();
+      m_tail.store(tail, std::memory_order_release);
+      m_drained.notify_all();
+    } else if (m_stop) {
+      return;
+    }
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <thread>
+
+// A stream buffer that hands everything written to it to a background thread
+// through a ring buffer, so that guest output costs a copy instead of a
+// syscall per character. The writer thread drains the ring when it is half
+// full, every `interval`, and whenever the stream is flushed; the VM flushes
+// only before it waits for input and when it stops.
+//
+// One thread writes to the stream at a time.
+class AsyncOutput : public std::streambuf {
+public:
+  explicit AsyncOutput(FILE *file, size_t capacity = 1 << 20,
+                       std::chrono::milliseconds interval =
+                           std::chrono::milliseconds(50));
+  ~AsyncOutput() override;
+
+  AsyncOutput(const AsyncOutput &) = delete;
+  AsyncOutput &operator=(const AsyncOutput &) = delete;
+
+protected:
+  int_type overflow(int_type ch) override;
+  std::streamsize xsputn(const char *data, std::streamsize count) override;
+  // Returns once everything written so far reached the file.
+  int sync() override;
+
+private:
+  void write(const char *data, size_t count);
+  void drain();
+  size_t pending() const {
+    return m_head.load(std::memory_order_relaxed) -
+           m_tail.load(std::memory_order_relaxed);
+  }
+
+  FILE *m_file;
+  std::unique_ptr<char[]> m_ring;
+  // A power of two, so positions wrap with a mask.
+  size_t m_capacity;
+  std::chrono::milliseconds m_interval;
+
+  // Free-running positions: the writer thread only moves m_tail, the
+  // stream's user only m_head.
+  std::atomic<size_t> m_head = 0;
+  std::atomic<size_t> m_tail = 0;
+
+  std::mutex m_mutex;
+  // Wakes the writer thread early.
+  std::condition_variable m_wake;
+  // Signalled by the writer thread after every drain.
+  std::condition_variable m_drained;
+  bool m_flush = false;
+  bool m_stop = false;
+
+  std::thread m_writer;
+};
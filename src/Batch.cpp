@@ -0,0 +1,241 @@
+#include <Batch.h>
+#include <Image.h>
+#include <Lockstep.h>
+#include <Trap.h>
+#include <VirtualMachine.h>
+#include <WorkStealingPool.h>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+
+std::vector<BatchJob> read_manifest(std::istream &manifest) {
+  std::vector<BatchJob> jobs;
+  std::string line;
+  while (std::getline(manifest, line)) {
+    std::istringstream fields(line);
+    BatchJob job;
+    if (!(fields >> job.image) || job.image[0] == '#') {
+      continue;
+    }
+    fields >> job.input;
+    std::string extra;
+    if (fields >> extra) {
+      throw InvalidManifest();
+    }
+    jobs.push_back(std::move(job));
+  }
+  return jobs;
+}
+
+static BatchResult run_job_unguarded(const BatchJob &job,
+                                     const ImageCache &images, Engine engine,
+                                     uint64_t budget) {
+  BatchResult result;
+
+  auto image = images.find(job.image);
+  if (!image->image) {
+    result.error = image->error;
+    return result;
+  }
+
+  std::ifstream input_file;
+  if (!job.input.empty()) {
+    input_file.open(job.input, std::ios::binary);
+    if (!input_file) {
+      result.error = "cannot open input";
+      return result;
+    }
+  }
+  std::istringstream no_input;
+  std::istream &input = job.input.empty()
+                            ? static_cast<std::istream &>(no_input)
+                            : input_file;
+
+  // Too big for a worker's stack.
+  auto vm = std::make_unique<VirtualMachine>();
+  image->image->load_into(*vm);
+
+  std::ostringstream output;
+  vm->set_io(input, output);
+  try {
+    result.exit_reason = vm->execute(engine, TraceLevel::None, budget);
+  } catch (InvalidTrap &) {
+    result.error = "invalid trap";
+  }
+  result.instructions = vm->instructions();
+  result.output = output.str();
+  return result;
+}
+
+// Pool tasks must not throw, so whatever a job throws ends up in its result
+// rather than taking the whole batch down.
+static BatchResult run_job(const BatchJob &job, const ImageCache &images,
+                           Engine engine, uint64_t budget) {
+  try {
+    return run_job_unguarded(job, images, engine, budget);
+  } catch (std::exception &e) {
+    BatchResult result;
+    result.error = e.what();
+    return result;
+  } catch (...) {
+    BatchResult result;
+    result.error = "unexpected error";
+    return result;
+  }
+}
+
+// Runs jobs `group`, which all run the same image, as the lanes of one
+// Lockstep. Every lane reads its own input and writes its own output.
+static void run_lockstep_unguarded(const std::vector<BatchJob> &jobs,
+                                   const std::vector<size_t> &group,
+                                   const ImageCache &images, uint64_t budget,
+                                   std::vector<BatchResult> &results) {
+  auto image = images.find(jobs[group[0]].image);
+  if (!image->image) {
+    for (auto i : group) {
+      results[i].error = image->error;
+    }
+    return;
+  }
+
+  std::vector<size_t> runnable;
+  std::vector<std::unique_ptr<std::istream>> inputs;
+  for (auto i : group) {
+    if (jobs[i].input.empty()) {
+      inputs.push_back(std::make_unique<std::istringstream>());
+    } else {
+      auto file =
+          std::make_unique<std::ifstream>(jobs[i].input, std::ios::binary);
+      if (!*file) {
+        results[i].error = "cannot open input";
+        continue;
+      }
+      inputs.push_back(std::move(file));
+    }
+    runnable.push_back(i);
+  }
+  if (runnable.empty()) {
+    return;
+  }
+
+  auto base = std::make_unique<VirtualMachine>();
+  image->image->load_into(*base);
+  Lockstep lockstep(*base, runnable.size());
+  std::vector<std::ostringstream> outputs(runnable.size());
+  for (size_t lane = 0; lane < runnable.size(); lane++) {
+    lockstep.lane(lane).set_io(*inputs[lane], outputs[lane]);
+  }
+  lockstep.run(budget);
+
+  for (size_t lane = 0; lane < runnable.size(); lane++) {
+    auto &vm = lockstep.lane(lane);
+    auto &result = results[runnable[lane]];
+    if (lockstep.error(lane)) {
+      result.error = lockstep.error(lane);
+    } else {
+      result.exit_reason = vm.exit_reason();
+    }
+    result.instructions = vm.instructions();
+    result.output = outputs[lane].str();
+  }
+}
+
+// As run_job(), for every job of the group that has no result yet.
+static void run_lockstep(const std::vector<BatchJob> &jobs,
+                         const std::vector<size_t> &group,
+                         const ImageCache &images, uint64_t budget,
+                         std::vector<BatchResult> &results) {
+  std::string error;
+  try {
+    run_lockstep_unguarded(jobs, group, images, budget, results);
+    return;
+  } catch (std::exception &e) {
+    error = e.what();
+  } catch (...) {
+    error = "unexpected error";
+  }
+  for (auto i : group) {
+    if (!results[i].exit_reason && results[i].error.empty()) {
+      results[i].error = error;
+    }
+  }
+}
+
+std::vector<BatchResult> run_batch(const std::vector<BatchJob> &jobs,
+                                   Engine engine, size_t threads,
+                                   uint64_t budget) {
+  // Every image is mapped and validated once, however many jobs run it.
+  std::vector<std::string> paths;
+  for (auto &job : jobs) {
+    paths.push_back(job.image);
+  }
+  ImageCache images;
+  images.preload(paths);
+
+  std::vector<BatchResult> results(jobs.size());
+  WorkStealingPool pool(threads);
+  if (engine == Engine::Lockstep) {
+    // Jobs of the same image, up to a full set of lanes each.
+    std::map<std::string, std::vector<size_t>> by_image;
+    std::vector<std::vector<size_t>> groups;
+    for (size_t i = 0; i < jobs.size(); i++) {
+      auto &group = by_image[jobs[i].image];
+      group.push_back(i);
+      if (group.size() == Lockstep::LANES) {
+        groups.push_back(std::move(group));
+        group.clear();
+      }
+    }
+    for (auto &[image, group] : by_image) {
+      if (!group.empty()) {
+        groups.push_back(std::move(group));
+      }
+    }
+    pool.run(groups.size(), [&](size_t i) {
+      run_lockstep(jobs, groups[i], images, budget, results);
+    });
+    return results;
+  }
+  pool.run(jobs.size(), [&](size_t i) {
+    results[i] = run_job(jobs[i], images, engine, budget);
+  });
+  return results;
+}
+
+static void write_escaped(std::ostream &report, const std::string &text) {
+  for (char ch : text) {
+    switch (ch) {
+    case '\t':
+      report << "\\t";
+      break;
+    case '\n':
+      report << "\\n";
+      break;
+    case '\\':
+      report << "\\\\";
+      break;
+    default:
+      report << ch;
+      break;
+    }
+  }
+}
+
+void write_report(std::ostream &report, const std::vector<BatchJob> &jobs,
+                  const std::vector<BatchResult> &results) {
+  report << "image\tinput\texit\tinstructions\toutput\n";
+  for (size_t i = 0; i < jobs.size(); i++) {
+    auto &result = results[i];
+    report << jobs[i].image << '\t' << jobs[i].input << '\t';
+    if (result.exit_reason) {
+      report << exit_reason_name(*result.exit_reason);
+    } else {
+      report << "Error: " << result.error;
+    }
+    report << '\t' << result.instructions << '\t';
+    write_escaped(report, result.output);
+    report << '\n';
+  }
+}
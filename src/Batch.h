@@ -0,0 +1,46 @@
+#pragma once
+
+#include <Engine.h>
+#include <ExitReason.h>
+#include <VirtualMachine.h>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+// One image to run on a fresh VirtualMachine, reading the traps' and the
+// keyboard's input from `input` (nothing if empty).
+struct BatchJob {
+  std::string image;
+  std::string input;
+};
+
+struct BatchResult {
+  // Empty if the job could not run to completion; `error` says why.
+  std::optional<ExitReason> exit_reason;
+  std::string error;
+  uint64_t instructions = 0;
+  std::string output;
+};
+
+class InvalidManifest {};
+
+// One job per line: the image path, optionally followed by the input path.
+// Blank lines and lines starting with '#' are skipped. Throws InvalidManifest
+// on a line with more than two fields.
+std::vector<BatchJob> read_manifest(std::istream &manifest);
+
+// Runs every job on its own VirtualMachine, spread over `threads` workers.
+// The results are in the same order as the jobs. Engine::Lockstep instead
+// runs the jobs of each image together, up to Lockstep::LANES at a time.
+// A job stops with ExitReason::BudgetExhausted after `budget` instructions,
+// so that one that never halts cannot hold up the batch.
+std::vector<BatchResult>
+run_batch(const std::vector<BatchJob> &jobs, Engine engine, size_t threads,
+          uint64_t budget = VirtualMachine::UNLIMITED);
+
+// A tab-separated line per job, with tabs, newlines and backslashes in the
+// output escaped.
+void write_report(std::ostream &report, const std::vector<BatchJob> &jobs,
+                  const std::vector<BatchResult> &results);
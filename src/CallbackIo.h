@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <streambuf>
+#include <string_view>
+
+// The next character of input, or nothing if there is none yet. Called
+// whenever the machine wants one, so it must not block.
+using ReadInput = std::function<std::optional<uint8_t>()>;
+// Characters the machine wrote, in order.
+using WriteOutput = std::function<void(std::string_view)>;
+
+// Streams over a pair of callbacks, so that a VirtualMachine embedded in
+// another program takes its I/O from wherever that program likes. Reading
+// past what `read` has yields end of file, which clear() undoes.
+class CallbackStreams {
+public:
+  CallbackStreams(ReadInput read, WriteOutput write)
+      : m_input_buffer(std::move(read)), m_output_buffer(std::move(write)) {}
+
+  CallbackStreams(const CallbackStreams &) = delete;
+  CallbackStreams &operator=(const CallbackStreams &) = delete;
+
+  std::istream &input() { return m_input; }
+  std::ostream &output() { return m_output; }
+
+private:
+  class InputBuffer : public std::streambuf {
+  public:
+    explicit InputBuffer(ReadInput read) : m_read(std::move(read)) {}
+
+  protected:
+    int_type underflow() override {
+      auto ch = m_read();
+      if (!ch) {
+        return traits_type::eof();
+      }
+      m_ch = static_cast<char>(*ch);
+      setg(&m_ch, &m_ch, &m_ch + 1);
+      return traits_type::to_int_type(m_ch);
+    }
+
+  private:
+    ReadInput m_read;
+    char m_ch = 0;
+  };
+
+  // Collects output until the buffer fills up or the stream is flushed,
+  // which the machine does before waiting for input and when it stops.
+  class OutputBuffer : public std::streambuf {
+  public:
+    explicit OutputBuffer(WriteOutput write) : m_write(std::move(write)) {
+      setp(m_buffer, m_buffer + sizeof(m_buffer));
+    }
+
+  protected:
+    int_type overflow(int_type ch) override {
+      sync();
+      if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+      }
+      return traits_type::not_eof(ch);
+    }
+
+    int sync() override {
+      if (pptr() != pbase()) {
+        m_write(std::string_view(pbase(), pptr() - pbase()));
+        setp(m_buffer, m_buffer + sizeof(m_buffer));
+      }
+      return 0;
+    }
+
+  private:
+    WriteOutput m_write;
+    char m_buffer[256];
+  };
+
+  InputBuffer m_input_buffer;
+  OutputBuffer m_output_buffer;
+  std::istream m_input{&m_input_buffer};
+  std::ostream m_output{&m_output_buffer};
+};
@@ -0,0 +1,145 @@
+#include <Checkpoint.h>
+#include <Platform.h>
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+
+// A checkpoint is this header followed by the words of every page in
+// `pages`, lowest page first. It is all in host byte order, so restoring is a
+// copy; `byte_order` keeps a host of the other order from misreading it.
+struct CheckpointHeader {
+  char magic[8];
+  uint16_t version;
+  uint16_t byte_order;
+  uint32_t kind;
+  uint64_t instructions;
+  // instructions() at the checkpoint an incremental one follows.
+  uint64_t base_instructions;
+  uint32_t pages;
+  uint16_t registers[to_underlying(Register::COUNT)];
+};
+static_assert(std::is_trivially_copyable_v<CheckpointHeader>);
+static_assert(sizeof(CheckpointHeader) % alignof(uint16_t) == 0);
+
+static constexpr char MAGIC[8] = "LC3CKPT";
+static constexpr uint16_t VERSION = 1;
+static constexpr uint16_t HOST_ORDER = 0x0102;
+
+static bool all_zero(const uint16_t *words) {
+  for (size_t i = 0; i < Memory::PAGE_SIZE; i++) {
+    if (words[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void save_checkpoint(VirtualMachine &vm, const char *path,
+                     CheckpointKind kind) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    throw CannotOpenCheckpoint();
+  }
+
+  auto dirty = vm.take_dirty_pages();
+  CheckpointHeader header = {};
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.byte_order = HOST_ORDER;
+  header.kind = static_cast<uint32_t>(kind);
+  header.instructions = vm.instructions();
+  header.base_instructions = dirty.since;
+  if (kind == CheckpointKind::Full) {
+    // Pages left out of a full checkpoint are zero.
+    for (size_t i = 0; i < Memory::PAGE_COUNT; i++) {
+      if (!all_zero(vm.page(i))) {
+        header.pages |= uint32_t(1) << i;
+      }
+    }
+  } else {
+    header.pages = dirty.pages;
+  }
+  for (size_t i = 0; i < to_underlying(Register::COUNT); i++) {
+    header.registers[i] = vm.get_register(static_cast<Register>(i));
+  }
+
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (size_t i = 0; i < Memory::PAGE_COUNT; i++) {
+    if (header.pages & (uint32_t(1) << i)) {
+      file.write(reinterpret_cast<const char *>(vm.page(i)),
+                 Memory::PAGE_SIZE * sizeof(uint16_t));
+    }
+  }
+  if (!file.flush()) {
+    throw CannotOpenCheckpoint();
+  }
+}
+
+// The mapped file starts with a validated header.
+static const CheckpointHeader &header_of(const MappedFile &file) {
+  return *reinterpret_cast<const CheckpointHeader *>(file.data);
+}
+
+CheckpointFile::CheckpointFile(const char *path) {
+  MappedFile mapped;
+  if (!map_file(path, mapped)) {
+    throw CannotOpenCheckpoint();
+  }
+  m_file = std::shared_ptr<const MappedFile>(
+      new MappedFile(mapped), [](const MappedFile *file) {
+        auto unmapped = *file;
+        unmap_file(unmapped);
+        delete file;
+      });
+
+  if (mapped.size < sizeof(CheckpointHeader)) {
+    throw InvalidCheckpoint();
+  }
+  auto &header = header_of(mapped);
+  auto page_bytes = Memory::PAGE_SIZE * sizeof(uint16_t);
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != VERSION || header.byte_order != HOST_ORDER ||
+      header.kind > static_cast<uint32_t>(CheckpointKind::Incremental) ||
+      mapped.size != sizeof(header) +
+                         std::popcount(header.pages) * page_bytes) {
+    throw InvalidCheckpoint();
+  }
+}
+
+CheckpointKind CheckpointFile::kind() const {
+  return static_cast<CheckpointKind>(header_of(*m_file).kind);
+}
+
+uint64_t CheckpointFile::instructions() const {
+  return header_of(*m_file).instructions;
+}
+
+void CheckpointFile::restore_into(VirtualMachine &vm) const {
+  auto &header = header_of(*m_file);
+  if (kind() == CheckpointKind::Incremental &&
+      vm.instructions() != header.base_instructions) {
+    throw InvalidCheckpoint();
+  }
+
+  auto words =
+      reinterpret_cast<const uint16_t *>(m_file->data + sizeof(header));
+  static const uint16_t zeros[Memory::PAGE_SIZE] = {};
+  for (size_t i = 0; i < Memory::PAGE_COUNT; i++) {
+    auto origin = static_cast<uint16_t>(i * Memory::PAGE_SIZE);
+    if (header.pages & (uint32_t(1) << i)) {
+      vm.load(origin, words, Memory::PAGE_SIZE);
+      words += Memory::PAGE_SIZE;
+    } else if (kind() == CheckpointKind::Full && !all_zero(vm.page(i))) {
+      vm.load(origin, zeros, Memory::PAGE_SIZE);
+    }
+  }
+  for (size_t i = 0; i < to_underlying(Register::COUNT); i++) {
+    vm.set_register(static_cast<Register>(i), header.registers[i],
+                    VirtualMachine::ShouldUpdateCondition::No);
+  }
+  vm.set_instructions(header.instructions);
+  // The machine is now exactly the checkpoint, so the next incremental one
+  // starts from here.
+  vm.take_dirty_pages();
+}
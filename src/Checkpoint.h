@@ -0,0 +1,44 @@
+#pragma once
+
+#include <VirtualMachine.h>
+#include <cstdint>
+#include <memory>
+
+struct MappedFile;
+
+enum class CheckpointKind {
+  Full,       /* every register and every page that is not all zeros */
+  Incremental /* every register, but only pages written since the last
+                 checkpoint */
+};
+
+class CannotOpenCheckpoint {};
+class InvalidCheckpoint {};
+
+// Writes the state of `vm` to `path`: its registers, instruction count and
+// memory, which holds the device registers too. Either kind starts a new
+// round of dirty-page tracking, so the next incremental checkpoint only holds
+// what changed after this one. Throws CannotOpenCheckpoint if `path` cannot
+// be written.
+void save_checkpoint(VirtualMachine &vm, const char *path, CheckpointKind);
+
+// A checkpoint file, mapped into memory. Opening one validates it, so
+// restoring it cannot fail for a malformed file.
+class CheckpointFile {
+public:
+  // Throws CannotOpenCheckpoint if the file cannot be mapped, or
+  // InvalidCheckpoint if it is not a checkpoint this build wrote.
+  explicit CheckpointFile(const char *path);
+
+  CheckpointKind kind() const;
+  uint64_t instructions() const;
+
+  // Copies the saved state into `vm`. An incremental checkpoint only applies
+  // to the state it was taken after, so restore a chain in order, starting
+  // from a full one; throws InvalidCheckpoint if `vm` has run a different
+  // number of instructions than that state had.
+  void restore_into(VirtualMachine &vm) const;
+
+private:
+  std::shared_ptr<const MappedFile> m_file;
+};
@@ -0,0 +1,146 @@
+#include <Debugger.h>
+#include <Trace.h>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+
+// The word at `address`, read without touching devices or watchpoints.
+static uint16_t peek(const VirtualMachine &vm, uint16_t address) {
+  auto page = vm.page(address >> Memory::PAGE_BITS);
+  return page[address & (Memory::PAGE_SIZE - 1)];
+}
+
+static std::optional<uint16_t> parse_address(const std::string &text) {
+  auto digits = text.c_str();
+  if (text.starts_with("0x") || text.starts_with("0X")) {
+    digits += 2;
+  } else if (text.starts_with("x") || text.starts_with("X")) {
+    digits += 1;
+  }
+  char *end = nullptr;
+  auto value = std::strtoul(digits, &end, 16);
+  if (*digits == '\0' || *end != '\0' ||
+      value >= VirtualMachine::MEMORY_MAX) {
+    return std::nullopt;
+  }
+  return static_cast<uint16_t>(value);
+}
+
+static void show_registers(VirtualMachine &vm, std::ostream &out) {
+  for (uint16_t r = 0; r < 8; r++) {
+    out << "R" << r << " = " << hex(vm.get_register(static_cast<Register>(r)))
+        << (r % 4 == 3 ? "\n" : "  ");
+  }
+  out << "PC = " << hex(vm.get_register(Register::PC)) << "  COND = "
+      << hex(vm.get_register(Register::COND))
+      << "  instructions = " << vm.instructions() << "\n";
+}
+
+// Where and why the machine stopped, and the instruction at its PC.
+static void show_stop(VirtualMachine &vm, ExitReason reason,
+                      std::ostream &out) {
+  out << exit_reason_name(reason);
+  if (reason == ExitReason::Watchpoint) {
+    auto hit = vm.watch_hit();
+    out << ": " << watch_kind_name(hit.kind) << " of " << hex(hit.value)
+        << " at " << hex(hit.address) << " by " << hex(hit.pc);
+  }
+  auto pc = vm.get_register(Register::PC);
+  auto word = peek(vm, pc);
+  out << "\n"
+      << hex(pc) << ": " << hex(word) << " "
+      << handler_name(decode(Instruction(word)).handler) << "\n";
+}
+
+void run_debugger(VirtualMachine &vm, Engine engine, std::istream &commands,
+                  std::ostream &out) {
+  std::string line;
+  while (out << "(lc3) " << std::flush, std::getline(commands, line)) {
+    std::istringstream words(line);
+    std::string command, first, second, third;
+    words >> command >> first >> second >> third;
+    if (command.empty()) {
+      continue;
+    }
+    if (command == "q") {
+      return;
+    }
+
+    if (command == "b" || command == "d") {
+      auto address = parse_address(first);
+      if (!address) {
+        out << "Expected an address\n";
+      } else if (command == "b") {
+        vm.set_breakpoint(*address);
+      } else {
+        vm.clear_breakpoint(*address);
+      }
+    } else if (command == "w") {
+      auto from = parse_address(first);
+      // The last address is optional, so the kind may come second.
+      auto to = parse_address(second);
+      auto kind_name = to ? third : second;
+      if (!to) {
+        to = from;
+      }
+      try {
+        auto kind = kind_name.empty()
+                        ? WatchKind::Access
+                        : watch_kind_from_name(kind_name.c_str());
+        if (!from) {
+          out << "Expected an address\n";
+        } else {
+          vm.add_watchpoint({*from, *to, kind});
+        }
+      } catch (InvalidWatchKind &) {
+        out << "Expected r, w or rw: " << kind_name << "\n";
+      }
+    } else if (command == "W") {
+      vm.clear_watchpoints();
+    } else if (command == "l") {
+      for (uint32_t address = 0; address < VirtualMachine::MEMORY_MAX;
+           address++) {
+        if (vm.has_breakpoint(address)) {
+          out << "break " << hex(address) << "\n";
+        }
+      }
+      for (auto &watchpoint : vm.watchpoints()) {
+        out << "watch " << hex(watchpoint.first) << "-" << hex(watchpoint.last)
+            << " " << watch_kind_name(watchpoint.kind) << "\n";
+      }
+    } else if (command == "c" || command == "s") {
+      uint64_t budget = VirtualMachine::UNLIMITED;
+      if (command == "s") {
+        budget =
+            first.empty() ? 1 : std::strtoull(first.c_str(), nullptr, 10);
+      }
+      try {
+        show_stop(vm, vm.execute(engine, TraceLevel::None, budget), out);
+      } catch (InvalidTrap &) {
+        // The PC is already past the trap.
+        out << "Invalid trap at "
+            << hex(vm.get_register(Register::PC) - 1) << "\n";
+      }
+    } else if (command == "r") {
+      show_registers(vm, out);
+    } else if (command == "x") {
+      auto address = parse_address(first);
+      if (!address) {
+        out << "Expected an address\n";
+        continue;
+      }
+      size_t count =
+          second.empty() ? 8 : std::strtoul(second.c_str(), nullptr, 10);
+      for (size_t i = 0; i < count; i++) {
+        uint16_t at = *address + i;
+        if (i % 8 == 0) {
+          out << (i == 0 ? "" : "\n") << hex(at) << ":";
+        }
+        out << " " << hex(peek(vm, at));
+      }
+      out << "\n";
+    } else {
+      out << "Unknown command: " << command << "\n";
+    }
+  }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <Engine.h>
+#include <VirtualMachine.h>
+#include <iostream>
+
+// A small interactive console over the breakpoints and watchpoints of `vm`,
+// reading one command per line from `commands` until "q" or the end of it.
+// The machine runs at full speed with `engine` between stops; its own I/O
+// stays wherever set_io() put it. Addresses are hexadecimal, with or without
+// a leading x.
+//
+//   b <addr>                 set a breakpoint
+//   d <addr>                 clear a breakpoint
+//   w <first> [last] [r|w|rw] watch reads, writes or both (default)
+//   W                        clear every watchpoint
+//   l                        list breakpoints and watchpoints
+//   c                        continue until the machine stops
+//   s [n]                    perform n instructions (1 by default)
+//   r                        show the registers
+//   x <addr> [n]             show n words of memory (8 by default)
+//   q                        quit
+void run_debugger(VirtualMachine &vm, Engine engine, std::istream &commands,
+                  std::ostream &out);
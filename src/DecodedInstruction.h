@@ -0,0 +1,292 @@
+#pragma once
+
+#include <Instruction.h>
+#include <Opcode.h>
+#include <Register.h>
+#include <Utils.h>
+#include <cstddef>
+#include <cstdint>
+
+// What the interpreter dispatches on. Unlike OpCode, the addressing modes of
+// ADD, AND and JSR get their own handler so that bit [5] / bit [11] is only
+// tested once, at decode time. The handlers after TRAP are superinstructions:
+// see fuse().
+enum class Handler : uint8_t {
+  // Zero so that a value-initialized table starts out fully undecoded.
+  Undecoded = 0,
+  BR,
+  ADD_REG,
+  ADD_IMM,
+  LD,
+  ST,
+  JSR,
+  JSRR,
+  AND_REG,
+  AND_IMM,
+  LDR,
+  STR,
+  RTI,
+  NOT,
+  LDI,
+  STI,
+  JMP,
+  RES,
+  LEA,
+  TRAP,
+  // AND Rx, Ry, #0 followed by ADD Rx, Rx, #imm5: loads a constant.
+  AND_ADD,
+  // ADD or NOT followed by BR: compare and branch.
+  ADD_REG_BR,
+  ADD_IMM_BR,
+  NOT_BR,
+  // LDR Rx, Rb, #o; ADD Rx, Rx, #imm5; STR Rx, Rb, #o: adds to a word in
+  // memory.
+  LDR_ADD_STR,
+  // A breakpoint, standing in for the instruction at its word; see
+  // VirtualMachine::set_breakpoint().
+  BREAK,
+  COUNT
+};
+
+// The longest run of instructions a single fused handler stands for.
+inline constexpr size_t MAX_FUSED_LENGTH = 3;
+
+inline const char *handler_name(Handler handler) {
+  switch (handler) {
+  case Handler::Undecoded:
+    return "Handler::Undecoded";
+  case Handler::BR:
+    return "Handler::BR";
+  case Handler::ADD_REG:
+    return "Handler::ADD_REG";
+  case Handler::ADD_IMM:
+    return "Handler::ADD_IMM";
+  case Handler::LD:
+    return "Handler::LD";
+  case Handler::ST:
+    return "Handler::ST";
+  case Handler::JSR:
+    return "Handler::JSR";
+  case Handler::JSRR:
+    return "Handler::JSRR";
+  case Handler::AND_REG:
+    return "Handler::AND_REG";
+  case Handler::AND_IMM:
+    return "Handler::AND_IMM";
+  case Handler::LDR:
+    return "Handler::LDR";
+  case Handler::STR:
+    return "Handler::STR";
+  case Handler::RTI:
+    return "Handler::RTI";
+  case Handler::NOT:
+    return "Handler::NOT";
+  case Handler::LDI:
+    return "Handler::LDI";
+  case Handler::STI:
+    return "Handler::STI";
+  case Handler::JMP:
+    return "Handler::JMP";
+  case Handler::RES:
+    return "Handler::RES";
+  case Handler::LEA:
+    return "Handler::LEA";
+  case Handler::TRAP:
+    return "Handler::TRAP";
+  case Handler::AND_ADD:
+    return "Handler::AND_ADD";
+  case Handler::ADD_REG_BR:
+    return "Handler::ADD_REG_BR";
+  case Handler::ADD_IMM_BR:
+    return "Handler::ADD_IMM_BR";
+  case Handler::NOT_BR:
+    return "Handler::NOT_BR";
+  case Handler::LDR_ADD_STR:
+    return "Handler::LDR_ADD_STR";
+  case Handler::BREAK:
+    return "Handler::BREAK";
+  case Handler::COUNT:
+    return "Handler::COUNT";
+  }
+  return "Unrecognized";
+}
+
+// A memory word with every field already extracted, so executing it needs no
+// shifts, masks, register validation or sign extension. A fused record keeps
+// the fields of the first instruction of its group; the others are read from
+// the records that follow it.
+struct DecodedInstruction {
+  Handler handler = Handler::Undecoded;
+  // DR (or SR for the stores). For BR this holds the n/z/p mask instead.
+  uint8_t dr = 0;
+  // SR1 (or BaseR for LDR, STR, JMP and JSRR).
+  uint8_t sr1 = 0;
+  uint8_t sr2 = 0;
+  // The already sign-extended imm5, offset6, PCoffset9 or PCoffset11 field, or
+  // the zero-extended trapvect8 for TRAP.
+  uint16_t imm = 0;
+
+  Register destination() const { return static_cast<Register>(dr); }
+  Register source1() const { return static_cast<Register>(sr1); }
+  Register source2() const { return static_cast<Register>(sr2); }
+};
+
+// Whether control can continue anywhere but the next word after `handler`.
+inline bool ends_basic_block(Handler handler) {
+  switch (handler) {
+  case Handler::BR:
+  case Handler::JMP:
+  case Handler::JSR:
+  case Handler::JSRR:
+  case Handler::TRAP:
+  case Handler::RES:
+  case Handler::ADD_REG_BR:
+  case Handler::ADD_IMM_BR:
+  case Handler::NOT_BR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// How many consecutive words a record with `handler` executes.
+inline size_t fused_length(Handler handler) {
+  switch (handler) {
+  case Handler::AND_ADD:
+  case Handler::ADD_REG_BR:
+  case Handler::ADD_IMM_BR:
+  case Handler::NOT_BR:
+    return 2;
+  case Handler::LDR_ADD_STR:
+    return 3;
+  default:
+    return 1;
+  }
+}
+
+// Picks the superinstruction for the `length` plain records starting at
+// `group`, or returns group[0].handler if they do not form one.
+inline Handler fuse(const DecodedInstruction *group, size_t length) {
+  auto first = group[0];
+  if (length < 2) {
+    return first.handler;
+  }
+  auto second = group[1];
+
+  switch (first.handler) {
+  case Handler::AND_IMM:
+    if (first.imm == 0 && second.handler == Handler::ADD_IMM &&
+        second.dr == first.dr && second.sr1 == first.dr) {
+      return Handler::AND_ADD;
+    }
+    break;
+  case Handler::ADD_REG:
+  case Handler::ADD_IMM:
+  case Handler::NOT:
+    if (second.handler == Handler::BR) {
+      return first.handler == Handler::ADD_REG   ? Handler::ADD_REG_BR
+             : first.handler == Handler::ADD_IMM ? Handler::ADD_IMM_BR
+                                                 : Handler::NOT_BR;
+    }
+    break;
+  case Handler::LDR: {
+    if (length < 3) {
+      break;
+    }
+    auto third = group[2];
+    // The load must not overwrite its own base register, or the store would
+    // go somewhere else.
+    if (first.dr != first.sr1 && second.handler == Handler::ADD_IMM &&
+        second.dr == first.dr && second.sr1 == first.dr &&
+        third.handler == Handler::STR && third.dr == first.dr &&
+        third.sr1 == first.sr1 && third.imm == first.imm) {
+      return Handler::LDR_ADD_STR;
+    }
+    break;
+  }
+  default:
+    break;
+  }
+  return first.handler;
+}
+
+inline DecodedInstruction decode(Instruction instruction) {
+  auto data = instruction.data();
+  DecodedInstruction decoded;
+  // Every 3-bit register field is a valid R0-R7 index, so no validation is
+  // needed here.
+  decoded.dr = (data >> 9) & 0x7;
+  decoded.sr1 = (data >> 6) & 0x7;
+  decoded.sr2 = data & 0x7;
+
+  switch (instruction.opcode()) {
+  case OpCode::BR:
+    decoded.handler = Handler::BR;
+    decoded.imm = sign_extend(data & 0x1ff, 9);
+    break;
+  case OpCode::ADD:
+  case OpCode::AND: {
+    bool is_add = instruction.opcode() == OpCode::ADD;
+    if ((data >> 5) & 0x1) {
+      decoded.handler = is_add ? Handler::ADD_IMM : Handler::AND_IMM;
+      decoded.imm = sign_extend(data & 0x1f, 5);
+    } else {
+      decoded.handler = is_add ? Handler::ADD_REG : Handler::AND_REG;
+    }
+    break;
+  }
+  case OpCode::LD:
+    decoded.handler = Handler::LD;
+    decoded.imm = sign_extend(data & 0x1ff, 9);
+    break;
+  case OpCode::LDI:
+    decoded.handler = Handler::LDI;
+    decoded.imm = sign_extend(data & 0x1ff, 9);
+    break;
+  case OpCode::LEA:
+    decoded.handler = Handler::LEA;
+    decoded.imm = sign_extend(data & 0x1ff, 9);
+    break;
+  case OpCode::ST:
+    decoded.handler = Handler::ST;
+    decoded.imm = sign_extend(data & 0x1ff, 9);
+    break;
+  case OpCode::STI:
+    decoded.handler = Handler::STI;
+    decoded.imm = sign_extend(data & 0x1ff, 9);
+    break;
+  case OpCode::LDR:
+    decoded.handler = Handler::LDR;
+    decoded.imm = sign_extend(data & 0x3f, 6);
+    break;
+  case OpCode::STR:
+    decoded.handler = Handler::STR;
+    decoded.imm = sign_extend(data & 0x3f, 6);
+    break;
+  case OpCode::JSR:
+    if ((data >> 11) & 0x1) {
+      decoded.handler = Handler::JSR;
+      decoded.imm = sign_extend(data & 0x7ff, 11);
+    } else {
+      decoded.handler = Handler::JSRR;
+    }
+    break;
+  case OpCode::NOT:
+    decoded.handler = Handler::NOT;
+    break;
+  case OpCode::JMP:
+    decoded.handler = Handler::JMP;
+    break;
+  case OpCode::RTI:
+    decoded.handler = Handler::RTI;
+    break;
+  case OpCode::TRAP:
+    decoded.handler = Handler::TRAP;
+    decoded.imm = data & 0xff;
+    break;
+  default:
+    decoded.handler = Handler::RES;
+    break;
+  }
+  return decoded;
+}
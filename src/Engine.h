@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstring>
+
+// How VirtualMachine::execute dispatches instructions. All engines share the
+// same semantics, so they can be benchmarked against each other on one image.
+enum class Engine {
+  Switch,   /* one switch in perform(), returning to the loop every step */
+  Threaded, /* each handler jumps straight to the next one */
+  Jit,      /* hot basic blocks run as x86-64 code */
+  Lockstep  /* batches of one image run in SIMD lanes; see Lockstep.h */
+};
+
+class InvalidEngine {};
+
+inline Engine engine_from_name(const char *name) {
+  if (std::strcmp(name, "switch") == 0) {
+    return Engine::Switch;
+  }
+  if (std::strcmp(name, "threaded") == 0) {
+    return Engine::Threaded;
+  }
+  if (std::strcmp(name, "jit") == 0) {
+    return Engine::Jit;
+  }
+  if (std::strcmp(name, "lockstep") == 0) {
+    return Engine::Lockstep;
+  }
+  throw InvalidEngine();
+}
+
+inline const char *engine_name(Engine engine) {
+  switch (engine) {
+  case Engine::Switch:
+    return "Engine::Switch";
+  case Engine::Threaded:
+    return "Engine::Threaded";
+  case Engine::Jit:
+    return "Engine::Jit";
+  case Engine::Lockstep:
+    return "Engine::Lockstep";
+  }
+  return "Unrecognized";
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// Why VirtualMachine::execute returned. The machine can carry on after the
+// last four by executing again.
+enum class ExitReason {
+  Halted,          /* TRAP HALT */
+  BadOpcode,       /* a reserved opcode */
+  EndOfMemory,     /* the PC reached the last word of memory */
+  ReplayDiverged,  /* the machine wanted input its replayed log does not have */
+  BudgetExhausted, /* it performed as many instructions as it was allowed */
+  WaitingForInput, /* a trap needs input that its callback does not have yet */
+  Breakpoint,      /* the PC reached a breakpoint */
+  Watchpoint       /* an instruction accessed a watched word */
+};
+
+inline const char *exit_reason_name(ExitReason reason) {
+  switch (reason) {
+  case ExitReason::Halted:
+    return "ExitReason::Halted";
+  case ExitReason::BadOpcode:
+    return "ExitReason::BadOpcode";
+  case ExitReason::EndOfMemory:
+    return "ExitReason::EndOfMemory";
+  case ExitReason::ReplayDiverged:
+    return "ExitReason::ReplayDiverged";
+  case ExitReason::BudgetExhausted:
+    return "ExitReason::BudgetExhausted";
+  case ExitReason::WaitingForInput:
+    return "ExitReason::WaitingForInput";
+  case ExitReason::Breakpoint:
+    return "ExitReason::Breakpoint";
+  case ExitReason::Watchpoint:
+    return "ExitReason::Watchpoint";
+  }
+  return "Unrecognized";
+}
@@ -0,0 +1,86 @@
+#include <HostTraps.h>
+
+static std::optional<ExitReason> host_mul(VirtualMachine &vm) {
+  // In 32 unsigned bits, so that xFFFF * xFFFF cannot overflow an int.
+  auto product =
+      uint32_t(vm.get_register(Register::R0)) * vm.get_register(Register::R1);
+  vm.set_register(Register::R0, static_cast<uint16_t>(product));
+  return std::nullopt;
+}
+
+static std::optional<ExitReason> host_div(VirtualMachine &vm) {
+  auto dividend = static_cast<int16_t>(vm.get_register(Register::R0));
+  auto divisor = static_cast<int16_t>(vm.get_register(Register::R1));
+  int32_t quotient = 0;
+  int32_t remainder = 0;
+  // In 32 bits -32768 / -1 cannot overflow; it wraps back to -32768.
+  if (divisor != 0) {
+    quotient = int32_t(dividend) / divisor;
+    remainder = int32_t(dividend) % divisor;
+  }
+  vm.set_register(Register::R1, static_cast<uint16_t>(remainder));
+  vm.set_register(Register::R0, static_cast<uint16_t>(quotient));
+  return std::nullopt;
+}
+
+static std::optional<ExitReason> host_memcpy(VirtualMachine &vm) {
+  uint16_t to = vm.get_register(Register::R0);
+  uint16_t from = vm.get_register(Register::R1);
+  // Word by word from the first, as the loop it replaces would, so
+  // overlapping copies come out the same.
+  for (uint16_t count = vm.get_register(Register::R2); count != 0; count--) {
+    vm.write_memory(to++, vm.read_memory(from++));
+  }
+  return std::nullopt;
+}
+
+static std::optional<ExitReason> host_strcmp(VirtualMachine &vm) {
+  uint16_t a = vm.get_register(Register::R0);
+  uint16_t b = vm.get_register(Register::R1);
+  uint16_t x = 0, y = 0;
+  // Memory wraps around, so a string without its terminator ends somewhere.
+  for (size_t i = 0; i < VirtualMachine::MEMORY_MAX; i++) {
+    x = vm.read_memory(a++);
+    y = vm.read_memory(b++);
+    if (x != y || x == 0) {
+      break;
+    }
+  }
+  int16_t order = x < y ? -1 : x > y ? 1 : 0;
+  vm.set_register(Register::R0, static_cast<uint16_t>(order));
+  return std::nullopt;
+}
+
+static std::optional<ExitReason> host_strlen(VirtualMachine &vm) {
+  uint16_t address = vm.get_register(Register::R0);
+  size_t length = 0;
+  while (length < VirtualMachine::MEMORY_MAX &&
+         vm.read_memory(address++) != 0) {
+    length++;
+  }
+  vm.set_register(Register::R0, static_cast<uint16_t>(length));
+  return std::nullopt;
+}
+
+TrapHandler host_trap_handler(HostTrap trap) {
+  switch (trap) {
+  case HostTrap::MUL:
+    return host_mul;
+  case HostTrap::DIV:
+    return host_div;
+  case HostTrap::MEMCPY:
+    return host_memcpy;
+  case HostTrap::STRCMP:
+    return host_strcmp;
+  case HostTrap::STRLEN:
+    return host_strlen;
+  }
+  return nullptr;
+}
+
+void install_host_traps(VirtualMachine &vm) {
+  for (auto trap : {HostTrap::MUL, HostTrap::DIV, HostTrap::MEMCPY,
+                    HostTrap::STRCMP, HostTrap::STRLEN}) {
+    vm.set_trap_handler(to_underlying(trap), host_trap_handler(trap));
+  }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Trap.h>
+#include <VirtualMachine.h>
+
+// Service routines that LC-3 programs otherwise write as loops, since the
+// ISA has no multiply, divide or block instructions. As native traps each
+// one costs a single instruction. Arguments go in R0 to R2 and results come
+// back in R0 and R1, with the condition codes set from R0. Strings are
+// zero-terminated, one character per word, as PUTS takes them.
+enum class HostTrap {
+  MUL = 0x30,    /* R0 = R0 * R1, the low 16 bits */
+  DIV = 0x31,    /* R0 = R0 / R1 and R1 = R0 % R1, signed; by 0 both are 0 */
+  MEMCPY = 0x32, /* copies R2 words from R1 onwards to R0 onwards */
+  STRCMP = 0x33, /* R0 = -1, 0 or 1 as the string at R0 sorts before, with
+                    or after the one at R1 */
+  STRLEN = 0x34  /* R0 = the length of the string at R0 */
+};
+
+inline const char *host_trap_name(HostTrap trap) {
+  switch (trap) {
+  case HostTrap::MUL:
+    return "HostTrap::MUL";
+  case HostTrap::DIV:
+    return "HostTrap::DIV";
+  case HostTrap::MEMCPY:
+    return "HostTrap::MEMCPY";
+  case HostTrap::STRCMP:
+    return "HostTrap::STRCMP";
+  case HostTrap::STRLEN:
+    return "HostTrap::STRLEN";
+  }
+  return "Unrecognized";
+}
+
+TrapHandler host_trap_handler(HostTrap);
+
+// Sets the handler of every HostTrap at its vector.
+void install_host_traps(VirtualMachine &);
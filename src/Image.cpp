@@ -0,0 +1,74 @@
+#include <Image.h>
+#include <Platform.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// dst[i] = the big-endian word at src + 2 * i.
+static void swap_words(uint16_t *dst, const uint8_t *src, size_t count) {
+  size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  // Eight words at a time: swapping the bytes of every 16-bit lane is one
+  // shift each way.
+  for (; i + 8 <= count; i += 8) {
+    auto words =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i));
+    words = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), words);
+  }
+#endif
+  for (; i < count; i++) {
+    dst[i] = static_cast<uint16_t>((src[2 * i] << 8) | src[2 * i + 1]);
+  }
+}
+
+ImageFile::ImageFile(const char *path) {
+  MappedFile mapped;
+  if (!map_file(path, mapped)) {
+    throw CannotOpenImage();
+  }
+  m_file = std::shared_ptr<const MappedFile>(
+      new MappedFile(mapped), [](const MappedFile *file) {
+        auto unmapped = *file;
+        unmap_file(unmapped);
+        delete file;
+      });
+
+  if (mapped.size < 2 || mapped.size % 2 != 0) {
+    throw InvalidImage();
+  }
+  m_origin = static_cast<uint16_t>((mapped.data[0] << 8) | mapped.data[1]);
+  m_words = mapped.data + 2;
+  m_size = mapped.size / 2 - 1;
+  if (m_size > VirtualMachine::MEMORY_MAX - m_origin) {
+    throw InvalidImage();
+  }
+}
+
+void ImageFile::load_into(VirtualMachine &vm) const {
+  vm.load(m_origin, m_size, [this](uint16_t *words, size_t done, size_t run) {
+    swap_words(words, m_words + 2 * done, run);
+  });
+}
+
+void ImageCache::preload(const std::vector<std::string> &paths) {
+  for (auto &path : paths) {
+    if (m_entries.contains(path)) {
+      continue;
+    }
+    auto &entry = m_entries[path];
+    try {
+      entry.image.emplace(path.c_str());
+    } catch (CannotOpenImage &) {
+      entry.error = "cannot open image";
+    } catch (InvalidImage &) {
+      entry.error = "invalid image";
+    }
+  }
+}
+
+const ImageCache::Entry *ImageCache::find(const std::string &path) const {
+  auto entry = m_entries.find(path);
+  return entry == m_entries.end() ? nullptr : &entry->second;
+}
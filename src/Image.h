@@ -0,0 +1,59 @@
+#pragma once
+
+#include <VirtualMachine.h>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct MappedFile;
+
+class CannotOpenImage {};
+class InvalidImage {};
+
+// An LC-3 object file, mapped into memory: a big-endian origin followed by
+// the big-endian words to place there. Opening one validates it, so loading
+// it cannot fail, and one opened image can be loaded into any number of
+// machines. Copies share the mapping.
+class ImageFile {
+public:
+  // Throws CannotOpenImage if the file cannot be mapped, or InvalidImage if
+  // it has no origin, an odd number of bytes or more words than fit between
+  // the origin and the end of memory.
+  explicit ImageFile(const char *path);
+
+  uint16_t origin() const { return m_origin; }
+  // In words, not counting the origin.
+  size_t size() const { return m_size; }
+
+  // Byte-swaps the words straight into `vm`'s memory.
+  void load_into(VirtualMachine &vm) const;
+
+private:
+  std::shared_ptr<const MappedFile> m_file;
+  const uint8_t *m_words = nullptr;
+  uint16_t m_origin = 0;
+  size_t m_size = 0;
+};
+
+// Opened images by path, for loading the same few images into many machines.
+// Only preload() changes it, so any number of threads may find() afterwards.
+class ImageCache {
+public:
+  struct Entry {
+    // Empty if the image could not be opened; `error` then says why.
+    std::optional<ImageFile> image;
+    const char *error = nullptr;
+  };
+
+  // Opens every path that was not opened yet, remembering failures too.
+  void preload(const std::vector<std::string> &paths);
+
+  // nullptr for a path preload() never saw.
+  const Entry *find(const std::string &path) const;
+
+private:
+  std::map<std::string, Entry> m_entries;
+};
@@ -0,0 +1,71 @@
+#include <InputLog.h>
+#include <cstring>
+#include <iterator>
+
+static constexpr char MAGIC[8] = {'L', 'C', '3', 'I', 'N', 'L', 'O', 'G'};
+
+InputRecorder::InputRecorder(const char *path)
+    : m_file(path, std::ios::binary | std::ios::trunc) {
+  if (!m_file.write(MAGIC, sizeof(MAGIC)).flush()) {
+    throw CannotOpenInputLog();
+  }
+}
+
+void InputRecorder::record(InputRecord record) {
+  auto delta = record.instruction - m_last;
+  m_last = record.instruction;
+  do {
+    uint8_t byte = delta & 0x7f;
+    delta >>= 7;
+    m_file.put(static_cast<char>(byte | (delta != 0 ? 0x80 : 0)));
+  } while (delta != 0);
+  m_file.put(static_cast<char>(record.event));
+  m_file.put(static_cast<char>(record.character));
+  // Input is as slow as a person typing, and the point of the log is to
+  // survive whatever comes next.
+  m_file.flush();
+}
+
+InputReplay::InputReplay(const char *path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw CannotOpenInputLog();
+  }
+  std::vector<uint8_t> bytes{std::istreambuf_iterator<char>(file),
+                             std::istreambuf_iterator<char>()};
+  if (bytes.size() < sizeof(MAGIC) ||
+      std::memcmp(bytes.data(), MAGIC, sizeof(MAGIC)) != 0) {
+    throw InvalidInputLog();
+  }
+
+  size_t at = sizeof(MAGIC);
+  uint64_t instruction = 0;
+  while (at < bytes.size()) {
+    uint64_t delta = 0;
+    for (int shift = 0;; shift += 7) {
+      if (at == bytes.size() || shift > 63) {
+        throw InvalidInputLog();
+      }
+      auto byte = bytes[at++];
+      delta |= uint64_t(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        break;
+      }
+    }
+    if (bytes.size() - at < 2 ||
+        bytes[at] > static_cast<uint8_t>(InputEvent::IN)) {
+      throw InvalidInputLog();
+    }
+    instruction += delta;
+    m_records.push_back({instruction, static_cast<InputEvent>(bytes[at]),
+                         bytes[at + 1]});
+    at += 2;
+  }
+}
+
+uint8_t InputReplay::take(InputEvent event, uint64_t instruction) {
+  if (!ready(event, instruction)) {
+    throw ReplayDiverged();
+  }
+  return m_records[m_next++].character;
+}
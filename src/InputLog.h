@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+// Where a character of input went.
+enum class InputEvent : uint8_t {
+  Key,  /* read from KBDR after KBSR reported it */
+  GETC, /* TRAP GETC */
+  IN    /* TRAP IN */
+};
+
+inline const char *input_event_name(InputEvent event) {
+  switch (event) {
+  case InputEvent::Key:
+    return "InputEvent::Key";
+  case InputEvent::GETC:
+    return "InputEvent::GETC";
+  case InputEvent::IN:
+    return "InputEvent::IN";
+  }
+  return "Unrecognized";
+}
+
+// One character the machine took, and the instruction count when it did.
+struct InputRecord {
+  uint64_t instruction;
+  InputEvent event;
+  uint8_t character;
+};
+
+class CannotOpenInputLog {};
+class InvalidInputLog {};
+// Thrown when a replayed machine asks for input that is not the next record
+// in the log, or once the log has run out. execute() turns it into
+// ExitReason::ReplayDiverged.
+class ReplayDiverged {};
+
+// Appends every record to a log file as it happens, so the log survives the
+// process dying. The file holds a magic number, then per record the
+// instruction count as a LEB128 delta from the previous record's, the event
+// and the character.
+class InputRecorder {
+public:
+  // Throws CannotOpenInputLog.
+  explicit InputRecorder(const char *path);
+
+  void record(InputRecord);
+
+private:
+  std::ofstream m_file;
+  uint64_t m_last = 0;
+};
+
+// Hands out the records of a log in order, without ever waiting: the key
+// KBSR reports is there exactly at the instruction it was recorded at.
+class InputReplay {
+public:
+  // Throws CannotOpenInputLog, or InvalidInputLog for a truncated or foreign
+  // file.
+  explicit InputReplay(const char *path);
+
+  // Whether the next record is `event` due by `instruction`.
+  bool ready(InputEvent event, uint64_t instruction) const {
+    return m_next < m_records.size() &&
+           m_records[m_next].event == event &&
+           m_records[m_next].instruction <= instruction;
+  }
+  // The next record's character. Throws ReplayDiverged unless ready().
+  uint8_t take(InputEvent event, uint64_t instruction);
+
+  bool finished() const { return m_next == m_records.size(); }
+
+private:
+  std::vector<InputRecord> m_records;
+  size_t m_next = 0;
+};
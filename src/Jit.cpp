@@ -0,0 +1,453 @@
+#include <Jit.h>
+#include <MemoryMappedRegister.h>
+#include <Platform.h>
+#include <VirtualMachine.h>
+#include <X64Emitter.h>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <vector>
+
+// Host registers every block agrees on. RAX, RCX and RDX are scratch.
+static constexpr X64Register CONTEXT = X64Register::RDI;
+static constexpr X64Register PAGES = X64Register::RBX;
+static constexpr X64Register TRANSLATED = X64Register::RBP;
+static constexpr X64Register RESULT = X64Register::RSI;
+
+// Callee-saved registers the blocks clobber.
+#ifdef _WIN64
+static constexpr X64Register SAVED[] = {
+    X64Register::RBX, X64Register::RBP, X64Register::RSI, X64Register::RDI,
+    X64Register::R12, X64Register::R13, X64Register::R14, X64Register::R15};
+#else
+static constexpr X64Register SAVED[] = {X64Register::RBX, X64Register::RBP,
+                                        X64Register::R12, X64Register::R13,
+                                        X64Register::R14, X64Register::R15};
+#endif
+
+// R0-R7 live in R8D-R15D.
+static X64Register guest(uint8_t reg) {
+  return static_cast<X64Register>(to_underlying(X64Register::R8) + reg);
+}
+
+static X64Memory field(size_t offset) {
+  return {CONTEXT, static_cast<int32_t>(offset)};
+}
+
+static bool is_device(uint16_t address) {
+  return address == MemoryMappedRegister::KBSR ||
+         address == MemoryMappedRegister::KBDR;
+}
+
+// The jump taken when any of BR's n/z/p bits match, right after
+// `test si, si` on the last result.
+static X64Condition branch_condition(uint8_t nzp) {
+  switch (nzp) {
+  case 0b100:
+    return X64Condition::Sign;
+  case 0b010:
+    return X64Condition::Equal;
+  case 0b001:
+    return X64Condition::Greater;
+  case 0b110:
+    return X64Condition::LessEqual;
+  case 0b101:
+    return X64Condition::NotEqual;
+  default:
+    return X64Condition::NotSign;
+  }
+}
+
+Jit::Jit()
+    : m_blocks(std::make_unique<const void *[]>(VirtualMachine::MEMORY_MAX)),
+      m_translated(std::make_unique<uint8_t[]>(VirtualMachine::MEMORY_MAX)),
+      m_hotness(std::make_unique<uint8_t[]>(VirtualMachine::MEMORY_MAX)) {
+  m_code = static_cast<uint8_t *>(allocate_executable(CODE_SIZE));
+  if (m_code == nullptr) {
+    throw std::bad_alloc();
+  }
+  m_cursor = m_code;
+  emit_trampolines();
+}
+
+Jit::~Jit() { free_executable(m_code, CODE_SIZE); }
+
+void Jit::emit_trampolines() {
+  X64Emitter e(m_cursor, m_code + CODE_SIZE);
+
+  // void entry(JitContext *context, const void *block)
+  m_entry = reinterpret_cast<Entry>(e.cursor());
+  for (auto reg : SAVED) {
+    e.push(reg);
+  }
+#ifdef _WIN64
+  e.mov64(CONTEXT, X64Register::RCX);
+  e.mov64(X64Register::RAX, X64Register::RDX);
+#else
+  e.mov64(X64Register::RAX, X64Register::RSI);
+#endif
+  e.load64(PAGES, field(offsetof(JitContext, pages)));
+  e.load64(TRANSLATED, field(offsetof(JitContext, translated)));
+  for (uint8_t i = 0; i < 8; i++) {
+    e.movzx16(guest(i), field(offsetof(JitContext, registers) + 2 * i));
+  }
+  e.movzx16(RESULT, field(offsetof(JitContext, result)));
+  e.jmp(X64Register::RAX);
+
+  // Every block leaves through here with the next PC in EAX and the Exit in
+  // EDX.
+  m_exit = e.cursor();
+  e.store16(field(offsetof(JitContext, pc)), X64Register::RAX);
+  e.store32(field(offsetof(JitContext, exit)), X64Register::RDX);
+  for (uint8_t i = 0; i < 8; i++) {
+    e.store16(field(offsetof(JitContext, registers) + 2 * i), guest(i));
+  }
+  e.store16(field(offsetof(JitContext, result)), RESULT);
+  for (auto reg = std::rbegin(SAVED); reg != std::rend(SAVED); ++reg) {
+    e.pop(*reg);
+  }
+  e.ret();
+
+  m_cursor = m_blocks_start = e.cursor();
+}
+
+void Jit::flush() {
+  m_cursor = m_blocks_start;
+  std::fill_n(m_blocks.get(), VirtualMachine::MEMORY_MAX, nullptr);
+  std::fill_n(m_translated.get(), VirtualMachine::MEMORY_MAX, 0);
+  m_pending_links.clear();
+}
+
+const void *Jit::compile(uint16_t start, const Memory &memory,
+                         const std::vector<bool> &breakpoints) {
+  // No guest instruction needs anywhere near 64 bytes of host code.
+  if (static_cast<size_t>(m_code + CODE_SIZE - m_cursor) <
+      MAX_BLOCK_LENGTH * 64 + 256) {
+    flush();
+  }
+
+  X64Emitter e(m_cursor, m_code + CODE_SIZE);
+  const void *block = e.cursor();
+
+  using enum X64Register;
+
+  struct SideExit {
+    uint8_t *jump;
+    uint16_t pc;
+    Exit exit;
+    // Instructions of the block performed before leaving.
+    size_t performed;
+  };
+  std::vector<SideExit> side_exits;
+  // Exits to blocks that are not translated yet.
+  std::vector<std::pair<uint16_t, uint8_t *>> links;
+
+  uint16_t pc = start;
+  size_t length = 0;
+  bool terminated = false;
+
+  auto exit_to = [&](uint16_t pc, Exit exit) {
+    e.mov(RAX, pc);
+    e.mov(RDX, to_underlying(exit));
+    e.jmp(m_exit);
+  };
+  // Continues at a known address: directly if it is already translated,
+  // otherwise through an exit whose first instruction gets patched into a
+  // jump once it is.
+  auto jump_to = [&](uint16_t pc) {
+    if (auto target = m_blocks[pc]) {
+      e.jmp(target);
+      return;
+    }
+    links.push_back({pc, e.cursor()});
+    exit_to(pc, Exit::Jump);
+  };
+  // Continues at the address in EAX.
+  auto jump_indirect = [&] {
+    e.load64(RCX, field(offsetof(JitContext, blocks)));
+    e.load64(RCX, {RCX, 0, RAX, 8});
+    e.test64(RCX, RCX);
+    auto miss = e.jcc(X64Condition::Equal);
+    e.jmp(RCX);
+    e.bind(miss);
+    e.mov(RDX, to_underlying(Exit::Jump));
+    e.jmp(m_exit);
+  };
+  // Leaves for the interpreter if the address in EAX is KBSR or KBDR, which
+  // only differ in bit 1.
+  static_assert((MemoryMappedRegister::KBSR | 2) ==
+                MemoryMappedRegister::KBDR);
+  auto check_device = [&](uint16_t pc) {
+    e.mov(RCX, RAX);
+    e.and_(RCX, 0xfffd);
+    e.cmp(RCX, MemoryMappedRegister::KBSR);
+    side_exits.push_back(
+        {e.jcc(X64Condition::Equal), pc, Exit::Interpret, length});
+  };
+  // After storing to the address in EAX: drop the interpreter's decoded
+  // records of the word and of the words before it, which may start a fused
+  // group covering it, and leave if the word was translated.
+  auto after_store = [&](uint16_t next) {
+    e.load64(RDX, field(offsetof(JitContext, decoded)));
+    constexpr auto handler = offsetof(DecodedInstruction, handler);
+    for (int32_t back = 0; back < MAX_FUSED_LENGTH; back++) {
+      e.lea(RCX, {RAX, -back});
+      e.movzx16(RCX, RCX);
+      e.imul(RCX, RCX, sizeof(DecodedInstruction));
+      e.store8({RDX, handler, RCX}, to_underlying(Handler::Undecoded));
+    }
+    e.cmp8({TRANSLATED, 0, RAX, 1}, 0);
+    side_exits.push_back(
+        {e.jcc(X64Condition::NotEqual), next, Exit::CodeWrite, length + 1});
+  };
+
+  constexpr auto page_mask = static_cast<int32_t>(Memory::PAGE_SIZE - 1);
+  // Loads the word at `address` into `dst`.
+  auto load_word = [&](X64Register dst, uint16_t address) {
+    e.load64(RCX, {PAGES, (address >> Memory::PAGE_BITS) * 8});
+    e.movzx16(dst, {RCX, (address & page_mask) * 2});
+  };
+  // Loads the word at the address in EAX into `dst`.
+  auto load_word_at = [&](X64Register dst) {
+    e.mov(RCX, RAX);
+    e.shr(RCX, Memory::PAGE_BITS);
+    e.load64(RCX, {PAGES, 0, RCX, 8});
+    e.mov(RDX, RAX);
+    e.and_(RDX, page_mask);
+    e.movzx16(dst, {RCX, 0, RDX, 2});
+  };
+  // Stores `src` to the address in EAX. Pages this machine shares with a
+  // fork have no writable entry; the interpreter copies those, so the
+  // instruction at `pc` is left to it.
+  auto store_word_at = [&](X64Register src, uint16_t pc) {
+    e.load64(RDX, field(offsetof(JitContext, writable_pages)));
+    e.mov(RCX, RAX);
+    e.shr(RCX, Memory::PAGE_BITS);
+    e.load64(RCX, {RDX, 0, RCX, 8});
+    e.test64(RCX, RCX);
+    side_exits.push_back(
+        {e.jcc(X64Condition::Equal), pc, Exit::Interpret, length});
+    e.mov(RDX, RAX);
+    e.and_(RDX, page_mask);
+    e.store16({RCX, 0, RDX, 2}, src);
+  };
+
+  // Blocks count all of their instructions on entry, and side exits take
+  // back the ones they skip. The length is patched in at the end.
+  auto instructions = field(offsetof(JitContext, instructions));
+  e.add64(instructions, 0);
+  auto block_length = e.cursor() - 4;
+  e.load64(RCX, instructions);
+  e.cmp64(RCX, field(offsetof(JitContext, limit)));
+  side_exits.push_back({e.jcc(X64Condition::Above), pc, Exit::Interpret, 0});
+
+  while (length < MAX_BLOCK_LENGTH) {
+    // The interpreter never runs the last word, and fetching from the
+    // keyboard registers has side effects.
+    if (pc == VirtualMachine::MEMORY_MAX - 1 || is_device(pc)) {
+      break;
+    }
+    // The interpreter stops there.
+    if (!breakpoints.empty() && breakpoints[pc]) {
+      break;
+    }
+
+    auto instruction = decode(Instruction(memory.read(pc)));
+    uint16_t next = pc + 1;
+    auto dr = guest(instruction.dr);
+    auto sr1 = guest(instruction.sr1);
+    auto sr2 = guest(instruction.sr2);
+    auto imm = static_cast<int16_t>(instruction.imm);
+    bool translated = true;
+
+    switch (instruction.handler) {
+    case Handler::ADD_REG:
+      e.mov(RAX, sr1);
+      e.add(RAX, sr2);
+      e.movzx16(dr, RAX);
+      e.mov(RESULT, dr);
+      break;
+    case Handler::ADD_IMM:
+      e.lea(RAX, {sr1, imm});
+      e.movzx16(dr, RAX);
+      e.mov(RESULT, dr);
+      break;
+    case Handler::AND_REG:
+      e.mov(RAX, sr1);
+      e.and_(RAX, sr2);
+      e.mov(dr, RAX);
+      e.mov(RESULT, dr);
+      break;
+    case Handler::AND_IMM:
+      e.mov(RAX, sr1);
+      e.and_(RAX, instruction.imm);
+      e.mov(dr, RAX);
+      e.mov(RESULT, dr);
+      break;
+    case Handler::NOT:
+      e.mov(RAX, sr1);
+      e.not_(RAX);
+      e.movzx16(dr, RAX);
+      e.mov(RESULT, dr);
+      break;
+    case Handler::LEA:
+      e.mov(dr, static_cast<uint16_t>(next + instruction.imm));
+      e.mov(RESULT, dr);
+      break;
+    case Handler::LD: {
+      uint16_t address = next + instruction.imm;
+      if (is_device(address)) {
+        translated = false;
+        break;
+      }
+      load_word(dr, address);
+      e.mov(RESULT, dr);
+      break;
+    }
+    case Handler::LDI: {
+      uint16_t address = next + instruction.imm;
+      if (is_device(address)) {
+        translated = false;
+        break;
+      }
+      load_word(RAX, address);
+      check_device(pc);
+      load_word_at(dr);
+      e.mov(RESULT, dr);
+      break;
+    }
+    case Handler::LDR:
+      e.lea(RAX, {sr1, imm});
+      e.movzx16(RAX, RAX);
+      check_device(pc);
+      load_word_at(dr);
+      e.mov(RESULT, dr);
+      break;
+    case Handler::ST:
+      e.mov(RAX, static_cast<uint16_t>(next + instruction.imm));
+      store_word_at(dr, pc);
+      after_store(next);
+      break;
+    case Handler::STI: {
+      uint16_t address = next + instruction.imm;
+      if (is_device(address)) {
+        translated = false;
+        break;
+      }
+      load_word(RAX, address);
+      store_word_at(dr, pc);
+      after_store(next);
+      break;
+    }
+    case Handler::STR:
+      e.lea(RAX, {sr1, imm});
+      e.movzx16(RAX, RAX);
+      store_word_at(dr, pc);
+      after_store(next);
+      break;
+    case Handler::RTI:
+      // A no-op in the interpreter as well.
+      break;
+    case Handler::BR: {
+      auto nzp = instruction.dr;
+      uint16_t target = next + instruction.imm;
+      if (nzp == 0) {
+        // Never taken.
+        break;
+      }
+      if (nzp == 0b111) {
+        jump_to(target);
+      } else {
+        e.test16(RESULT, RESULT);
+        auto taken = e.jcc(branch_condition(nzp));
+        jump_to(next);
+        e.bind(taken);
+        jump_to(target);
+      }
+      terminated = true;
+      break;
+    }
+    case Handler::JMP:
+      e.mov(RAX, sr1);
+      jump_indirect();
+      terminated = true;
+      break;
+    case Handler::JSR:
+      e.mov(guest(7), next);
+      jump_to(next + instruction.imm);
+      terminated = true;
+      break;
+    case Handler::JSRR:
+      // R7 is written first, exactly like the interpreter does, so JSRR R7
+      // lands on the next instruction.
+      e.mov(guest(7), next);
+      e.mov(RAX, sr1);
+      jump_indirect();
+      terminated = true;
+      break;
+    default:
+      // TRAP and RES are left to the interpreter.
+      translated = false;
+      break;
+    }
+
+    if (!translated) {
+      break;
+    }
+    length++;
+    pc = next;
+    if (terminated) {
+      break;
+    }
+  }
+
+  if (length == 0) {
+    m_hotness[start] = 0;
+    return nullptr;
+  }
+  if (!terminated) {
+    if (length == MAX_BLOCK_LENGTH) {
+      jump_to(pc);
+    } else {
+      exit_to(pc, Exit::Interpret);
+    }
+  }
+
+  for (auto &side_exit : side_exits) {
+    e.bind(side_exit.jump);
+    if (side_exit.exit == Exit::CodeWrite) {
+      e.store32(field(offsetof(JitContext, address)), RAX);
+    }
+    if (side_exit.performed != length) {
+      e.add64(instructions,
+              static_cast<int32_t>(side_exit.performed) -
+                  static_cast<int32_t>(length));
+    }
+    exit_to(side_exit.pc, side_exit.exit);
+  }
+
+  if (e.overflowed()) {
+    flush();
+    return nullptr;
+  }
+  auto count = static_cast<int32_t>(length);
+  std::memcpy(block_length, &count, sizeof(count));
+
+  m_cursor = e.cursor();
+  std::fill_n(m_translated.get() + start, length, 1);
+  m_blocks[start] = block;
+
+  for (auto &[target, site] : links) {
+    m_pending_links.emplace(target, site);
+  }
+  auto [first, last] = m_pending_links.equal_range(start);
+  for (auto link = first; link != last; ++link) {
+    // Overwrite the exit's `mov eax, pc` with `jmp block`; both are 5 bytes.
+    auto site = link->second;
+    site[0] = 0xe9;
+    X64Emitter::link(site + 1, block);
+  }
+  m_pending_links.erase(first, last);
+
+  return block;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <DecodedInstruction.h>
+#include <Memory.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Everything native code reads or writes, handed to it in RDI. The layout is
+// shared with the emitted code, so fields are only ever added at the end.
+struct JitContext {
+  // Memory::pages(), indexed by page.
+  uint16_t *const *pages;
+  DecodedInstruction *decoded;
+  const uint8_t *translated;
+  const void *const *blocks;
+  uint16_t registers[8];
+  // The last value the condition codes were derived from, standing in for
+  // COND: 0x8000 for N, 0 for Z and 1 for P.
+  uint16_t result;
+  uint16_t pc;
+  uint32_t exit;
+  // The address of the store that triggered Jit::Exit::CodeWrite.
+  uint32_t address;
+  // VirtualMachine::instructions(), kept up to date by every block.
+  uint64_t instructions;
+  // Memory::writable_pages(). Stores to a page without an entry leave for the
+  // interpreter, which copies it.
+  uint16_t *const *writable_pages;
+  // The instruction count the machine must stop at. A block that would run
+  // past it leaves for the interpreter, which stops exactly there.
+  uint64_t limit;
+};
+
+// Translates hot LC-3 basic blocks into x86-64 code. Guest registers live in
+// host registers for the whole block, blocks ending in a known target are
+// chained directly, and anything that needs the interpreter (TRAPs, reads of
+// the keyboard registers, stores into translated code) leaves native code.
+class Jit {
+public:
+#if defined(__x86_64__) || defined(_M_X64)
+  static constexpr bool SUPPORTED = true;
+#else
+  static constexpr bool SUPPORTED = false;
+#endif
+
+  // Interpreted entries into a block before it gets translated.
+  static constexpr uint8_t HOT_THRESHOLD = 32;
+  static constexpr size_t MAX_BLOCK_LENGTH = 128;
+  static constexpr size_t CODE_SIZE = 4 << 20;
+
+  // Why native code returned. JitContext::pc says where to continue.
+  enum class Exit : uint32_t {
+    // Continue at pc, which has no translated block (yet).
+    Jump,
+    // The instruction at pc must be performed by the interpreter.
+    Interpret,
+    // A store hit a translated address, which native code already wrote.
+    CodeWrite
+  };
+
+  Jit();
+  ~Jit();
+
+  Jit(const Jit &) = delete;
+  Jit &operator=(const Jit &) = delete;
+
+  const void *lookup(uint16_t pc) const { return m_blocks[pc]; }
+
+  // Counts an interpreted entry at `pc`, returning true once it is hot.
+  bool is_hot(uint16_t pc) { return ++m_hotness[pc] >= HOT_THRESHOLD; }
+
+  // Translates the block starting at `pc`, stopping short of any address
+  // flagged in `breakpoints` (which may be empty). Returns nullptr if not
+  // even its first instruction can run natively.
+  const void *compile(uint16_t pc, const Memory &memory,
+                      const std::vector<bool> &breakpoints);
+
+  // Runs native code from `block` until it exits.
+  void enter(JitContext &context, const void *block) {
+    m_entry(&context, block);
+  }
+
+  bool is_translated(uint16_t address) const { return m_translated[address]; }
+
+  // Throws away every translated block.
+  void flush();
+
+  void prepare(JitContext &context) const {
+    context.translated = m_translated.get();
+    context.blocks = m_blocks.get();
+  }
+
+private:
+  void emit_trampolines();
+
+  using Entry = void (*)(JitContext *, const void *);
+
+  uint8_t *m_code = nullptr;
+  uint8_t *m_cursor = nullptr;
+  // Where the code emitted by emit_trampolines() ends. flush() keeps it.
+  uint8_t *m_blocks_start = nullptr;
+  Entry m_entry = nullptr;
+  const void *m_exit = nullptr;
+
+  std::unique_ptr<const void *[]> m_blocks;
+  std::unique_ptr<uint8_t[]> m_translated;
+  std::unique_ptr<uint8_t[]> m_hotness;
+  // Exits to blocks that do not exist yet, patched into direct jumps once the
+  // block is translated.
+  std::unordered_multimap<uint16_t, uint8_t *> m_pending_links;
+};
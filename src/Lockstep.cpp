@@ -0,0 +1,437 @@
+#include <Lockstep.h>
+#include <Trap.h>
+#include <algorithm>
+#include <bit>
+#include <exception>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define LOCKSTEP_SSE2
+#endif
+
+static_assert(Lockstep::LANES == std::size(LaneVector{}.lanes));
+
+// The handful of lane-wise operations the vectorized instructions need. A
+// mask has every bit of a lane set or clear.
+namespace lanes {
+
+#if defined(__AVX2__)
+static __m256i load(const LaneVector &v) {
+  return _mm256_load_si256(reinterpret_cast<const __m256i *>(v.lanes));
+}
+static LaneVector store(__m256i x) {
+  LaneVector v;
+  _mm256_store_si256(reinterpret_cast<__m256i *>(v.lanes), x);
+  return v;
+}
+#define BINARY(name, op)                                                       \
+  static LaneVector name(const LaneVector &a, const LaneVector &b) {           \
+    return store(op(load(a), load(b)));                                        \
+  }
+BINARY(add, _mm256_add_epi16)
+BINARY(and_, _mm256_and_si256)
+BINARY(or_, _mm256_or_si256)
+BINARY(equal, _mm256_cmpeq_epi16)
+#undef BINARY
+
+static LaneVector splat(uint16_t value) {
+  return store(_mm256_set1_epi16(static_cast<short>(value)));
+}
+static LaneVector not_(const LaneVector &a) {
+  return store(_mm256_xor_si256(load(a), _mm256_set1_epi16(-1)));
+}
+// A mask of the lanes holding a negative value.
+static LaneVector negative(const LaneVector &a) {
+  return store(_mm256_srai_epi16(load(a), 15));
+}
+// mask ? a : b, lane by lane.
+static LaneVector select(const LaneVector &mask, const LaneVector &a,
+                         const LaneVector &b) {
+  return store(_mm256_blendv_epi8(load(b), load(a), load(mask)));
+}
+#elif defined(LOCKSTEP_SSE2)
+// Two vectors of eight lanes each.
+static __m128i load(const LaneVector &v, size_t half) {
+  return _mm_load_si128(reinterpret_cast<const __m128i *>(v.lanes) + half);
+}
+static void store(LaneVector &v, size_t half, __m128i x) {
+  _mm_store_si128(reinterpret_cast<__m128i *>(v.lanes) + half, x);
+}
+#define BINARY(name, op)                                                       \
+  static LaneVector name(const LaneVector &a, const LaneVector &b) {           \
+    LaneVector v;                                                              \
+    store(v, 0, op(load(a, 0), load(b, 0)));                                   \
+    store(v, 1, op(load(a, 1), load(b, 1)));                                   \
+    return v;                                                                  \
+  }
+BINARY(add, _mm_add_epi16)
+BINARY(and_, _mm_and_si128)
+BINARY(or_, _mm_or_si128)
+BINARY(equal, _mm_cmpeq_epi16)
+#undef BINARY
+
+static LaneVector splat(uint16_t value) {
+  LaneVector v;
+  auto x = _mm_set1_epi16(static_cast<short>(value));
+  store(v, 0, x);
+  store(v, 1, x);
+  return v;
+}
+static LaneVector not_(const LaneVector &a) {
+  LaneVector v;
+  auto ones = _mm_set1_epi16(-1);
+  store(v, 0, _mm_xor_si128(load(a, 0), ones));
+  store(v, 1, _mm_xor_si128(load(a, 1), ones));
+  return v;
+}
+static LaneVector negative(const LaneVector &a) {
+  LaneVector v;
+  store(v, 0, _mm_srai_epi16(load(a, 0), 15));
+  store(v, 1, _mm_srai_epi16(load(a, 1), 15));
+  return v;
+}
+static LaneVector select(const LaneVector &mask, const LaneVector &a,
+                         const LaneVector &b) {
+  LaneVector v;
+  for (size_t half = 0; half < 2; half++) {
+    auto m = load(mask, half);
+    store(v, half,
+          _mm_or_si128(_mm_and_si128(m, load(a, half)),
+                       _mm_andnot_si128(m, load(b, half))));
+  }
+  return v;
+}
+#else
+// Plain loops, which the compiler may still vectorize.
+#define BINARY(name, expression)                                               \
+  static LaneVector name(const LaneVector &a, const LaneVector &b) {           \
+    LaneVector v;                                                              \
+    for (size_t i = 0; i < Lockstep::LANES; i++) {                             \
+      v.lanes[i] = static_cast<uint16_t>(expression);                          \
+    }                                                                          \
+    return v;                                                                  \
+  }
+BINARY(add, a.lanes[i] + b.lanes[i])
+BINARY(and_, a.lanes[i] & b.lanes[i])
+BINARY(or_, a.lanes[i] | b.lanes[i])
+BINARY(equal, a.lanes[i] == b.lanes[i] ? 0xffff : 0)
+#undef BINARY
+
+static LaneVector splat(uint16_t value) {
+  LaneVector v;
+  std::fill_n(v.lanes, Lockstep::LANES, value);
+  return v;
+}
+static LaneVector not_(const LaneVector &a) {
+  LaneVector v;
+  for (size_t i = 0; i < Lockstep::LANES; i++) {
+    v.lanes[i] = static_cast<uint16_t>(~a.lanes[i]);
+  }
+  return v;
+}
+static LaneVector negative(const LaneVector &a) {
+  LaneVector v;
+  for (size_t i = 0; i < Lockstep::LANES; i++) {
+    v.lanes[i] = a.lanes[i] >> 15 ? 0xffff : 0;
+  }
+  return v;
+}
+static LaneVector select(const LaneVector &mask, const LaneVector &a,
+                         const LaneVector &b) {
+  LaneVector v;
+  for (size_t i = 0; i < Lockstep::LANES; i++) {
+    v.lanes[i] = (mask.lanes[i] & a.lanes[i]) | (~mask.lanes[i] & b.lanes[i]);
+  }
+  return v;
+}
+#endif
+
+// The mask with the lanes of bit mask `bits` set.
+static LaneVector expand(uint32_t bits) {
+  static const LaneVector lane_bits = {{1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4,
+                                        1 << 5, 1 << 6, 1 << 7, 1 << 8, 1 << 9,
+                                        1 << 10, 1 << 11, 1 << 12, 1 << 13,
+                                        1 << 14, 1 << 15}};
+  return equal(and_(splat(static_cast<uint16_t>(bits)), lane_bits), lane_bits);
+}
+
+// The bit mask of the lanes equal to `value`.
+static uint32_t bits_equal(const LaneVector &a, uint16_t value) {
+  auto mask = equal(a, splat(value));
+  uint32_t bits = 0;
+  for (size_t i = 0; i < Lockstep::LANES; i++) {
+    bits |= (mask.lanes[i] & 1u) << i;
+  }
+  return bits;
+}
+
+} // namespace lanes
+
+// A value with the sign and zeroness of the single condition flag in `flags`.
+static uint16_t result_for(uint16_t flags) {
+  switch (static_cast<ConditionFlag>(flags)) {
+  case ConditionFlag::NEG:
+    return 0x8000;
+  case ConditionFlag::ZRO:
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+// The condition flag VirtualMachine would derive from `result`.
+static uint16_t flag_for(uint16_t result) {
+  if (result == 0) {
+    return to_underlying(ConditionFlag::ZRO);
+  }
+  return result >> 15 ? to_underlying(ConditionFlag::NEG)
+                      : to_underlying(ConditionFlag::POS);
+}
+
+Lockstep::Lockstep(VirtualMachine &base, size_t lanes)
+    : m_errors(std::min(lanes, LANES)) {
+  lanes = std::min(lanes, LANES);
+  m_pc = lanes::splat(0xffff);
+  for (size_t i = 0; i < lanes; i++) {
+    m_lanes.push_back(base.fork());
+    sync_from_machine(i);
+    m_running |= 1u << i;
+  }
+}
+
+void Lockstep::run(uint64_t budget) {
+  uint64_t limits[LANES];
+  for (size_t i = 0; i < LANES; i++) {
+    limits[i] = m_instructions[i] +
+                std::min(budget, VirtualMachine::UNLIMITED - m_instructions[i]);
+  }
+  // Lanes that ran in this window, and those held back for it.
+  uint32_t stepped = 0;
+  uint32_t deferred = 0;
+  size_t window = 0;
+  while (m_running != 0) {
+    if (++window == FAIRNESS_WINDOW) {
+      // Lanes that never got a step were starved by lower ones, which sit
+      // the next window out.
+      auto starved = m_running & ~stepped;
+      deferred = starved != 0 ? stepped & m_running : 0;
+      stepped = 0;
+      window = 0;
+    }
+    auto eligible = m_running & ~deferred;
+    if (eligible == 0) {
+      eligible = m_running;
+      deferred = 0;
+    }
+
+    uint16_t pc = 0xffff;
+    for (auto bits = eligible; bits != 0; bits &= bits - 1) {
+      pc = std::min(pc, m_pc.lanes[std::countr_zero(bits)]);
+    }
+    uint32_t at = lanes::bits_equal(m_pc, pc) & eligible;
+
+    if (budget != VirtualMachine::UNLIMITED) {
+      for (auto bits = at; bits != 0; bits &= bits - 1) {
+        auto i = std::countr_zero(bits);
+        if (m_instructions[i] >= limits[i]) {
+          stop_lane(i);
+          m_lanes[i]->set_exit_reason(ExitReason::BudgetExhausted);
+          at &= ~(1u << i);
+        }
+      }
+      if (at == 0) {
+        continue;
+      }
+    }
+
+    // The last word of memory is never executed: see step().
+    if (pc + 1 >= VirtualMachine::MEMORY_MAX) {
+      for (auto bits = at; bits != 0; bits &= bits - 1) {
+        stop_lane(std::countr_zero(bits));
+      }
+      continue;
+    }
+
+    // Lanes that wrote to the page hold their own copy of it, which may not
+    // hold the same code.
+    auto leader = std::countr_zero(at);
+    auto page_index = pc >> Memory::PAGE_BITS;
+    auto offset = pc & (Memory::PAGE_SIZE - 1);
+    auto page = m_lanes[leader]->page(page_index);
+    auto word = page[offset];
+    for (auto bits = at & (at - 1); bits != 0; bits &= bits - 1) {
+      auto i = std::countr_zero(bits);
+      auto other = m_lanes[i]->page(page_index);
+      if (other != page && other[offset] != word) {
+        at &= ~(1u << i);
+      }
+    }
+
+    stepped |= at;
+    step(pc, word, at);
+  }
+}
+
+void Lockstep::step(uint16_t pc, uint16_t word, uint32_t at) {
+  using namespace lanes;
+
+  for (auto bits = at; bits != 0; bits &= bits - 1) {
+    m_instructions[std::countr_zero(bits)]++;
+  }
+  auto mask = expand(at);
+  uint16_t next = pc + 1;
+  m_pc = select(mask, splat(next), m_pc);
+
+  auto instruction = decode(Instruction(word));
+  auto &dr = m_registers[instruction.dr];
+  auto &sr1 = m_registers[instruction.sr1];
+  auto &sr2 = m_registers[instruction.sr2];
+  // Writes `value` to DR and sets the condition codes from it.
+  auto set_dr = [&](const LaneVector &value) {
+    dr = select(mask, value, dr);
+    m_result = select(mask, value, m_result);
+  };
+
+  switch (instruction.handler) {
+  case Handler::ADD_REG:
+    set_dr(add(sr1, sr2));
+    break;
+  case Handler::ADD_IMM:
+    set_dr(add(sr1, splat(instruction.imm)));
+    break;
+  case Handler::AND_REG:
+    set_dr(and_(sr1, sr2));
+    break;
+  case Handler::AND_IMM:
+    set_dr(and_(sr1, splat(instruction.imm)));
+    break;
+  case Handler::NOT:
+    set_dr(not_(sr1));
+    break;
+  case Handler::LEA:
+    set_dr(splat(next + instruction.imm));
+    break;
+  case Handler::BR: {
+    auto is_negative = negative(m_result);
+    auto is_zero = equal(m_result, splat(0));
+    auto is_positive = not_(or_(is_negative, is_zero));
+    // BR's dr holds n/z/p in the bit order of ConditionFlag.
+    auto taken = splat(0);
+    if (instruction.dr & to_underlying(ConditionFlag::NEG)) {
+      taken = or_(taken, is_negative);
+    }
+    if (instruction.dr & to_underlying(ConditionFlag::ZRO)) {
+      taken = or_(taken, is_zero);
+    }
+    if (instruction.dr & to_underlying(ConditionFlag::POS)) {
+      taken = or_(taken, is_positive);
+    }
+    m_pc = select(and_(mask, taken), splat(next + instruction.imm), m_pc);
+    break;
+  }
+  case Handler::JMP:
+    m_pc = select(mask, sr1, m_pc);
+    break;
+  case Handler::JSR:
+    m_registers[7] = select(mask, splat(next), m_registers[7]);
+    m_pc = select(mask, splat(next + instruction.imm), m_pc);
+    break;
+  case Handler::JSRR:
+    // R7 is written first, as perform() does, so JSRR R7 sees the new value.
+    m_registers[7] = select(mask, splat(next), m_registers[7]);
+    m_pc = select(mask, sr1, m_pc);
+    break;
+  // Memory goes to each lane's own machine.
+  case Handler::LD:
+  case Handler::LDR:
+  case Handler::LDI:
+    for (auto bits = at; bits != 0; bits &= bits - 1) {
+      auto i = std::countr_zero(bits);
+      auto &vm = *m_lanes[i];
+      uint16_t address = instruction.handler == Handler::LDR
+                             ? sr1.lanes[i] + instruction.imm
+                             : next + instruction.imm;
+      // Reading KBSR may consume input, which is logged with the count.
+      vm.set_instructions(m_instructions[i]);
+      if (instruction.handler == Handler::LDI) {
+        address = vm.read_memory(address);
+      }
+      auto value = vm.read_memory(address);
+      dr.lanes[i] = value;
+      m_result.lanes[i] = value;
+    }
+    break;
+  case Handler::ST:
+  case Handler::STR:
+  case Handler::STI:
+    for (auto bits = at; bits != 0; bits &= bits - 1) {
+      auto i = std::countr_zero(bits);
+      auto &vm = *m_lanes[i];
+      uint16_t address = instruction.handler == Handler::STR
+                             ? sr1.lanes[i] + instruction.imm
+                             : next + instruction.imm;
+      vm.set_instructions(m_instructions[i]);
+      if (instruction.handler == Handler::STI) {
+        address = vm.read_memory(address);
+      }
+      vm.write_memory(address, dr.lanes[i]);
+    }
+    break;
+  default:
+    // TRAP, RTI and reserved opcodes.
+    for (auto bits = at; bits != 0; bits &= bits - 1) {
+      perform_on_lane(std::countr_zero(bits), word);
+    }
+    break;
+  }
+}
+
+void Lockstep::perform_on_lane(size_t i, uint16_t word) {
+  auto &vm = *m_lanes[i];
+  sync_to_machine(i);
+  auto should_break = VirtualMachine::ShouldBreak::Yes;
+  try {
+    should_break = vm.perform(Instruction(word));
+  } catch (InvalidTrap &) {
+    m_errors[i] = "invalid trap";
+  } catch (std::exception &e) {
+    m_errors[i] = e.what();
+  } catch (...) {
+    m_errors[i] = "unexpected error";
+  }
+  sync_from_machine(i);
+  if (should_break == VirtualMachine::ShouldBreak::Yes) {
+    stop_lane(i);
+  }
+}
+
+void Lockstep::stop_lane(size_t i) {
+  // The machine keeps the state the lane stopped in.
+  sync_to_machine(i);
+  m_running &= ~(1u << i);
+  m_pc.lanes[i] = 0xffff;
+}
+
+void Lockstep::sync_to_machine(size_t i) {
+  auto &vm = *m_lanes[i];
+  for (uint16_t r = 0; r < 8; r++) {
+    vm.set_register(static_cast<Register>(r), m_registers[r].lanes[i],
+                    VirtualMachine::ShouldUpdateCondition::No);
+  }
+  vm.set_register(Register::PC, m_pc.lanes[i],
+                  VirtualMachine::ShouldUpdateCondition::No);
+  vm.set_register(Register::COND, flag_for(m_result.lanes[i]));
+  vm.set_instructions(m_instructions[i]);
+}
+
+void Lockstep::sync_from_machine(size_t i) {
+  auto &vm = *m_lanes[i];
+  for (uint16_t r = 0; r < 8; r++) {
+    m_registers[r].lanes[i] = vm.get_register(static_cast<Register>(r));
+  }
+  m_pc.lanes[i] = vm.get_register(Register::PC);
+  m_result.lanes[i] = result_for(vm.get_register(Register::COND));
+  m_instructions[i] = vm.instructions();
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <DecodedInstruction.h>
+#include <VirtualMachine.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// One 16-bit value per lane, laid out so that a whole register of every lane
+// is one AVX2 vector (or two SSE2 ones).
+struct alignas(32) LaneVector {
+  uint16_t lanes[16];
+};
+
+// Up to LANES machines that start from the same state and run the same
+// image, typically on different inputs. Their registers are kept structure
+// of arrays: every step picks the lowest PC any lane is at and runs that
+// instruction once for all lanes there, with ADD, AND, NOT, LEA and BR
+// computed for every lane by one vector instruction. Lanes whose control
+// flow diverged simply sit at other PCs until they are the lowest; loops
+// that meet again run together again. So that a lane spinning below the
+// others cannot hold them up forever, lanes that went a whole
+// FAIRNESS_WINDOW of steps without running get the next window to
+// themselves.
+//
+// Each lane is also a VirtualMachine, forked from the base, which holds its
+// memory and streams. Loads and stores go to it lane by lane, and traps and
+// the rest run through its perform(), so every lane behaves exactly as the
+// interpreters would.
+class Lockstep {
+public:
+  static constexpr size_t LANES = 16;
+  static constexpr size_t FAIRNESS_WINDOW = 4096;
+
+  // `lanes` forks of `base`, at most LANES.
+  Lockstep(VirtualMachine &base, size_t lanes);
+
+  size_t size() const { return m_lanes.size(); }
+  // Set its streams before run(); read its registers, instruction count and
+  // exit reason after.
+  VirtualMachine &lane(size_t i) { return *m_lanes[i]; }
+  // Why lane `i` could not run to completion, or nullptr.
+  const char *error(size_t i) const {
+    return m_errors[i].empty() ? nullptr : m_errors[i].c_str();
+  }
+
+  // Runs until every lane stopped or has performed `budget` more
+  // instructions, which leaves it at ExitReason::BudgetExhausted.
+  void run(uint64_t budget = VirtualMachine::UNLIMITED);
+
+private:
+  // Runs `word`, the instruction at `pc`, for the lanes in `mask`.
+  void step(uint16_t pc, uint16_t word, uint32_t mask);
+  // Runs `word` through the lane's own VirtualMachine.
+  void perform_on_lane(size_t i, uint16_t word);
+  void stop_lane(size_t i);
+
+  // Copies lane `i` between the vectors and its VirtualMachine.
+  void sync_to_machine(size_t i);
+  void sync_from_machine(size_t i);
+
+  std::vector<std::unique_ptr<VirtualMachine>> m_lanes;
+  std::vector<std::string> m_errors;
+
+  LaneVector m_registers[8] = {};
+  // Lanes that stopped sit at 0xFFFF, which no running lane can execute.
+  LaneVector m_pc = {};
+  // The last flag-setting value, as in VirtualMachine.
+  LaneVector m_result = {};
+  uint64_t m_instructions[LANES] = {};
+  // Bit i for every lane still running.
+  uint32_t m_running = 0;
+};
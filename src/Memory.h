@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// The 64K words of LC-3 memory, split into pages that forked machines share
+// until one of them writes to it. Reads go through one table of page
+// pointers; writes through a second one that only holds the pages this
+// Memory owns alone, so the copy-on-write check is a single null test.
+//
+// The same slow path tracks which pages were written: take_dirty_pages()
+// empties the write table, so the first write to each page afterwards goes
+// through make_writable() again and marks it.
+class Memory {
+public:
+  static constexpr size_t SIZE = 1 << 16;
+  // 4 KiB, the same as a host page.
+  static constexpr size_t PAGE_BITS = 11;
+  static constexpr size_t PAGE_SIZE = 1 << PAGE_BITS;
+  static constexpr size_t PAGE_COUNT = SIZE / PAGE_SIZE;
+  static_assert(PAGE_COUNT <= 32, "dirty pages are a 32-bit mask");
+
+  // Every page starts out as the one shared zero page.
+  Memory() {
+    for (size_t i = 0; i < PAGE_COUNT; i++) {
+      m_owners[i] = zero_page();
+      m_read[i] = m_owners[i]->words;
+    }
+  }
+
+  Memory(const Memory &) = delete;
+  Memory &operator=(const Memory &) = delete;
+
+  uint16_t read(uint16_t address) const {
+    return m_read[address >> PAGE_BITS][address & (PAGE_SIZE - 1)];
+  }
+
+  void write(uint16_t address, uint16_t value) {
+    auto page = m_write[address >> PAGE_BITS];
+    if (page == nullptr) [[unlikely]] {
+      page = make_writable(address >> PAGE_BITS);
+    }
+    page[address & (PAGE_SIZE - 1)] = value;
+  }
+
+  // Calls fill(words, done, count) for each run of the `count` words from
+  // `address` onwards that lies within one page, `done` words in. `words`
+  // points at the run's writable memory.
+  template <typename Fill>
+  void fill(uint16_t address, size_t count, Fill &&fill) {
+    count = std::min(count, SIZE - address);
+    size_t done = 0;
+    while (done < count) {
+      size_t at = address + done;
+      size_t index = at >> PAGE_BITS;
+      size_t offset = at & (PAGE_SIZE - 1);
+      size_t run = std::min(count - done, PAGE_SIZE - offset);
+      auto page = m_write[index];
+      if (page == nullptr) {
+        page = make_writable(index);
+      }
+      fill(page + offset, done, run);
+      done += run;
+    }
+  }
+
+  // Copies `count` words to `address` onwards.
+  void copy_from(uint16_t address, const uint16_t *words, size_t count) {
+    fill(address, count, [words](uint16_t *page, size_t done, size_t run) {
+      std::copy_n(words + done, run, page);
+    });
+  }
+
+  // Makes `child` share every page of this memory. Neither side can write
+  // to a shared page without copying it first.
+  void fork_into(Memory &child) {
+    for (size_t i = 0; i < PAGE_COUNT; i++) {
+      child.m_owners[i] = m_owners[i];
+      child.m_read[i] = m_read[i];
+      child.m_write[i] = nullptr;
+      m_write[i] = nullptr;
+    }
+  }
+
+  // The pages written since the last call, bit i for page i. The first call
+  // reports every page written since the Memory was created.
+  uint32_t take_dirty_pages() {
+    auto dirty = m_dirty;
+    m_dirty = 0;
+    std::fill_n(m_write, PAGE_COUNT, nullptr);
+    return dirty;
+  }
+
+  // The tables native code indexes with `address >> PAGE_BITS`.
+  uint16_t *const *pages() const { return m_read; }
+  uint16_t *const *writable_pages() const { return m_write; }
+
+private:
+  struct Page {
+    uint16_t words[PAGE_SIZE] = {0};
+  };
+
+  static const std::shared_ptr<Page> &zero_page() {
+    static const auto page = std::make_shared<Page>();
+    return page;
+  }
+
+  uint16_t *make_writable(size_t index) {
+    auto &owner = m_owners[index];
+    // Another Memory may drop its reference concurrently, but none can gain
+    // one: that takes fork_into() on this Memory.
+    if (owner.use_count() > 1) {
+      owner = std::make_shared<Page>(*owner);
+      m_read[index] = owner->words;
+    } else {
+      // Whoever dropped the last other reference is done reading the page.
+      std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    m_dirty |= uint32_t(1) << index;
+    return m_write[index] = owner->words;
+  }
+
+  std::shared_ptr<Page> m_owners[PAGE_COUNT];
+  uint16_t *m_read[PAGE_COUNT] = {};
+  uint16_t *m_write[PAGE_COUNT] = {};
+  uint32_t m_dirty = 0;
+};
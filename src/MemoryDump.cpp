@@ -0,0 +1,312 @@
+#include <MemoryDump.h>
+#include <Opcode.h>
+#include <Trace.h>
+#include <bit>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DUMP_SSE2
+#endif
+
+// A dump is the magic number, the format, the registers and the instruction
+// count, then the memory. A raw one has every word; a compressed one a mask
+// of the pages that are not all zeros, and per page in it alternating counts
+// of zeros and of the words that follow them, both LEB128, until the page is
+// full.
+static constexpr char MAGIC[8] = "LC3DUMP";
+
+// Words compared at once.
+#if defined(__AVX2__)
+static constexpr size_t VECTOR_WORDS = 16;
+#elif defined(DUMP_SSE2)
+static constexpr size_t VECTOR_WORDS = 8;
+#else
+static constexpr size_t VECTOR_WORDS = 4;
+#endif
+static_assert(Memory::PAGE_SIZE % VECTOR_WORDS == 0);
+
+// Two bits for every word of the VECTOR_WORDS from `a` and `b` on that
+// differ, the lowest for the first word.
+static uint32_t differing_words(const uint16_t *a, const uint16_t *b) {
+#if defined(__AVX2__)
+  auto equal = _mm256_cmpeq_epi16(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a)),
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b)));
+  return ~static_cast<uint32_t>(_mm256_movemask_epi8(equal));
+#elif defined(DUMP_SSE2)
+  auto equal =
+      _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a)),
+                      _mm_loadu_si128(reinterpret_cast<const __m128i *>(b)));
+  return ~static_cast<uint32_t>(_mm_movemask_epi8(equal)) & 0xffff;
+#else
+  uint32_t mask = 0;
+  for (size_t i = 0; i < VECTOR_WORDS; i++) {
+    mask |= uint32_t(a[i] != b[i] ? 3 : 0) << (2 * i);
+  }
+  return mask;
+#endif
+}
+
+// Calls `changed(offset)` for every word at which the pages `a` and `b`
+// differ, in order, until it returns false.
+template <typename Changed>
+static void for_each_change(const uint16_t *a, const uint16_t *b,
+                            Changed &&changed) {
+  if (a == b) {
+    return;
+  }
+  for (size_t i = 0; i < Memory::PAGE_SIZE; i += VECTOR_WORDS) {
+    for (auto mask = differing_words(a + i, b + i); mask != 0;
+         mask &= mask - 1, mask &= mask - 1) {
+      if (!changed(i + std::countr_zero(mask) / 2)) {
+        return;
+      }
+    }
+  }
+}
+
+static bool pages_differ(const uint16_t *a, const uint16_t *b) {
+  bool differ = false;
+  for_each_change(a, b, [&](size_t) {
+    differ = true;
+    return false;
+  });
+  return differ;
+}
+
+static const uint16_t *zero_page() {
+  static const uint16_t zeros[Memory::PAGE_SIZE] = {};
+  return zeros;
+}
+
+MachineState state_of(VirtualMachine &vm) {
+  MachineState state;
+  for (size_t i = 0; i < to_underlying(Register::COUNT); i++) {
+    state.registers[i] = vm.get_register(static_cast<Register>(i));
+  }
+  state.instructions = vm.instructions();
+  for (size_t i = 0; i < Memory::PAGE_COUNT; i++) {
+    state.pages[i] = vm.page(i);
+  }
+  return state;
+}
+
+static void put_word(std::vector<char> &bytes, uint16_t word) {
+  bytes.push_back(static_cast<char>(word & 0xff));
+  bytes.push_back(static_cast<char>(word >> 8));
+}
+
+static void put_count(std::vector<char> &bytes, size_t count) {
+  do {
+    uint8_t byte = count & 0x7f;
+    count >>= 7;
+    bytes.push_back(static_cast<char>(byte | (count != 0 ? 0x80 : 0)));
+  } while (count != 0);
+}
+
+void write_dump(std::ostream &dump, const MachineState &state,
+                DumpFormat format) {
+  std::vector<char> bytes(MAGIC, MAGIC + sizeof(MAGIC));
+  bytes.push_back(static_cast<char>(format));
+  for (auto value : state.registers) {
+    put_word(bytes, value);
+  }
+  for (size_t i = 0; i < 8; i++) {
+    bytes.push_back(static_cast<char>(state.instructions >> (8 * i)));
+  }
+
+  if (format == DumpFormat::Raw) {
+    bytes.reserve(bytes.size() + Memory::SIZE * sizeof(uint16_t));
+    for (auto page : state.pages) {
+      for (size_t i = 0; i < Memory::PAGE_SIZE; i++) {
+        put_word(bytes, page[i]);
+      }
+    }
+  } else {
+    uint32_t used = 0;
+    for (size_t i = 0; i < Memory::PAGE_COUNT; i++) {
+      if (pages_differ(state.pages[i], zero_page())) {
+        used |= uint32_t(1) << i;
+      }
+    }
+    for (size_t i = 0; i < 4; i++) {
+      bytes.push_back(static_cast<char>(used >> (8 * i)));
+    }
+    for (size_t i = 0; i < Memory::PAGE_COUNT; i++) {
+      if ((used >> i & 1) == 0) {
+        continue;
+      }
+      auto page = state.pages[i];
+      size_t at = 0;
+      while (at < Memory::PAGE_SIZE) {
+        auto zeros = at;
+        while (zeros < Memory::PAGE_SIZE && page[zeros] == 0) {
+          zeros++;
+        }
+        auto words = zeros;
+        while (words < Memory::PAGE_SIZE && page[words] != 0) {
+          words++;
+        }
+        put_count(bytes, zeros - at);
+        put_count(bytes, words - zeros);
+        for (; zeros < words; zeros++) {
+          put_word(bytes, page[zeros]);
+        }
+        at = words;
+      }
+    }
+  }
+  dump.write(bytes.data(), bytes.size());
+}
+
+// Reads a dump's fields in order, throwing InvalidDump at its end.
+class DumpReader {
+public:
+  DumpReader(const std::vector<uint8_t> &bytes, size_t at)
+      : m_bytes(bytes), m_at(at) {}
+
+  uint8_t byte() {
+    if (m_at == m_bytes.size()) {
+      throw InvalidDump();
+    }
+    return m_bytes[m_at++];
+  }
+  uint16_t word() {
+    uint16_t low = byte();
+    return low | byte() << 8;
+  }
+  uint64_t number(size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+      value |= uint64_t(byte()) << (8 * i);
+    }
+    return value;
+  }
+  size_t count() {
+    size_t value = 0;
+    for (int shift = 0;; shift += 7) {
+      auto part = byte();
+      value |= size_t(part & 0x7f) << shift;
+      if ((part & 0x80) == 0) {
+        return value;
+      }
+      if (shift > 14) {
+        throw InvalidDump();
+      }
+    }
+  }
+  bool finished() const { return m_at == m_bytes.size(); }
+
+private:
+  const std::vector<uint8_t> &m_bytes;
+  size_t m_at;
+};
+
+DumpFile::DumpFile(const char *path)
+    : m_words(std::make_unique<uint16_t[]>(Memory::SIZE)) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw CannotOpenDump();
+  }
+  std::vector<uint8_t> bytes{std::istreambuf_iterator<char>(file),
+                             std::istreambuf_iterator<char>()};
+  if (bytes.size() < sizeof(MAGIC) ||
+      std::memcmp(bytes.data(), MAGIC, sizeof(MAGIC)) != 0) {
+    throw InvalidDump();
+  }
+
+  DumpReader reader(bytes, sizeof(MAGIC));
+  auto format = reader.byte();
+  if (format > static_cast<uint8_t>(DumpFormat::Compressed)) {
+    throw InvalidDump();
+  }
+  m_format = static_cast<DumpFormat>(format);
+  for (auto &value : m_state.registers) {
+    value = reader.word();
+  }
+  m_state.instructions = reader.number(8);
+
+  if (m_format == DumpFormat::Raw) {
+    for (size_t i = 0; i < Memory::SIZE; i++) {
+      m_words[i] = reader.word();
+    }
+  } else {
+    auto used = static_cast<uint32_t>(reader.number(4));
+    for (size_t i = 0; i < Memory::PAGE_COUNT; i++) {
+      if ((used >> i & 1) == 0) {
+        continue;
+      }
+      auto page = &m_words[i * Memory::PAGE_SIZE];
+      size_t at = 0;
+      while (at < Memory::PAGE_SIZE) {
+        at += reader.count();
+        auto words = reader.count();
+        if (at + words > Memory::PAGE_SIZE) {
+          throw InvalidDump();
+        }
+        for (; words > 0; words--) {
+          page[at++] = reader.word();
+        }
+      }
+    }
+  }
+  if (!reader.finished()) {
+    throw InvalidDump();
+  }
+  for (size_t i = 0; i < Memory::PAGE_COUNT; i++) {
+    m_state.pages[i] = &m_words[i * Memory::PAGE_SIZE];
+  }
+}
+
+uint32_t changed_pages(const MachineState &a, const MachineState &b) {
+  uint32_t changed = 0;
+  for (size_t i = 0; i < Memory::PAGE_COUNT; i++) {
+    if (pages_differ(a.pages[i], b.pages[i])) {
+      changed |= uint32_t(1) << i;
+    }
+  }
+  return changed;
+}
+
+void write_diff(std::ostream &diff, const MachineState &before,
+                const MachineState &after) {
+  for (size_t i = 0; i < to_underlying(Register::COUNT); i++) {
+    if (before.registers[i] != after.registers[i]) {
+      diff << register_name(static_cast<Register>(i)) << ": "
+           << hex(before.registers[i]) << " -> " << hex(after.registers[i])
+           << "\n";
+    }
+  }
+  if (before.instructions != after.instructions) {
+    diff << "instructions: " << before.instructions << " -> "
+         << after.instructions << "\n";
+  }
+  for (size_t i = 0; i < Memory::PAGE_COUNT; i++) {
+    auto old_words = before.pages[i];
+    auto new_words = after.pages[i];
+    for_each_change(old_words, new_words, [&](size_t offset) {
+      diff << hex(i * Memory::PAGE_SIZE + offset) << ": "
+           << hex(old_words[offset]) << " -> " << hex(new_words[offset])
+           << "\n";
+      return true;
+    });
+  }
+}
+
+void write_nonzero_words(std::ostream &out, const MachineState &state) {
+  for (size_t i = 0; i < Memory::PAGE_COUNT; i++) {
+    auto words = state.pages[i];
+    for_each_change(zero_page(), words, [&](size_t offset) {
+      auto value = words[offset];
+      out << hex(i * Memory::PAGE_SIZE + offset) << ": " << value
+          << ", neg: " << static_cast<int16_t>(value) << " ("
+          << opcode_name(static_cast<OpCode>(value >> 12)) << ")\n";
+      return true;
+    });
+  }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <VirtualMachine.h>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+enum class DumpFormat : uint8_t {
+  Raw,       /* every word, 128 KiB however little is in use */
+  Compressed /* the pages in use, with their runs of zeros counted */
+};
+
+class InvalidDumpFormat {};
+
+inline DumpFormat dump_format_from_name(const char *name) {
+  if (std::strcmp(name, "raw") == 0) {
+    return DumpFormat::Raw;
+  }
+  if (std::strcmp(name, "compressed") == 0) {
+    return DumpFormat::Compressed;
+  }
+  throw InvalidDumpFormat();
+}
+
+inline const char *dump_format_name(DumpFormat format) {
+  switch (format) {
+  case DumpFormat::Raw:
+    return "DumpFormat::Raw";
+  case DumpFormat::Compressed:
+    return "DumpFormat::Compressed";
+  }
+  return "Unrecognized";
+}
+
+class CannotOpenDump {};
+class InvalidDump {};
+
+// Everything a dump holds: the registers, the instruction count and the
+// pages of memory, which are borrowed from a machine or a DumpFile.
+struct MachineState {
+  uint16_t registers[to_underlying(Register::COUNT)] = {};
+  uint64_t instructions = 0;
+  const uint16_t *pages[Memory::PAGE_COUNT] = {};
+};
+
+// `vm`'s state. The pages are the machine's own, so the state is only good
+// until the machine next runs or is written to.
+MachineState state_of(VirtualMachine &vm);
+
+// Writes `state` to `dump`. All of it is little-endian, whatever the host.
+void write_dump(std::ostream &dump, const MachineState &state, DumpFormat);
+
+// A dump file, read back into memory.
+class DumpFile {
+public:
+  // Throws CannotOpenDump if the file cannot be read, or InvalidDump if it
+  // is not a dump or is cut short.
+  explicit DumpFile(const char *path);
+
+  DumpFormat format() const { return m_format; }
+  // Good for as long as the DumpFile is.
+  const MachineState &state() const { return m_state; }
+
+private:
+  DumpFormat m_format = DumpFormat::Raw;
+  std::unique_ptr<uint16_t[]> m_words;
+  MachineState m_state;
+};
+
+// Bit i for every page i whose words differ between `a` and `b`. Pages that
+// are the same memory, such as those a forked machine has not written to
+// yet, are not even looked at; the rest are compared a vector at a time.
+uint32_t changed_pages(const MachineState &a, const MachineState &b);
+
+// One line per register, and per word of memory, that differs between
+// `before` and `after`, with both values; nothing at all if they are the
+// same.
+void write_diff(std::ostream &diff, const MachineState &before,
+                const MachineState &after);
+
+// One line per word of `state` that is not zero, with its value and opcode.
+void write_nonzero_words(std::ostream &out, const MachineState &state);
@@ -1,3 +1,5 @@
+#pragma once
+
 enum MemoryMappedRegister {
   KBSR = 0xFE00, /* keyboard status */
   KBDR = 0xFE02  /* keyboard data */
@@ -3,10 +3,13 @@
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h> // _exit on Windows
 
-/* windows only */
+#ifdef _WIN32
 #include <Windows.h>
 #include <conio.h> // _kbhit
+#include <io.h>    // _write
+#include <psapi.h> // GetProcessMemoryInfo
 
 inline HANDLE hStdin = INVALID_HANDLE_VALUE;
 inline DWORD fdwMode, fdwOldMode;
@@ -23,6 +26,339 @@ inline void disable_input_buffering() {
 
 inline void restore_input_buffering() { SetConsoleMode(hStdin, fdwOldMode); }
 
+// SIGINT: puts the console back and exits at once.
+inline void handle_interrupt(int) {
+  SetConsoleMode(hStdin, fdwOldMode);
+  (void)_write(1, "\n", 1);
+  _exit(-2);
+}
+
 inline uint16_t check_key() {
   return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
 }
+
+// Read-write-execute memory for the JIT's code cache.
+inline void *allocate_executable(size_t size) {
+  return VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE,
+                      PAGE_EXECUTE_READWRITE);
+}
+
+inline void free_executable(void *memory, size_t) {
+  VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+// The most memory this process has had resident at once, in KiB.
+inline size_t peak_resident_kib() {
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                            sizeof(counters))) {
+    return 0;
+  }
+  return counters.PeakWorkingSetSize / 1024;
+}
+
+// Windows keeps no peak that can be started over.
+inline bool reset_peak_resident() { return false; }
+
+// A read-only view of a whole file.
+struct MappedFile {
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = nullptr;
+};
+
+inline void unmap_file(MappedFile &mapped) {
+  if (mapped.data != nullptr) {
+    UnmapViewOfFile(mapped.data);
+  }
+  if (mapped.mapping != nullptr) {
+    CloseHandle(mapped.mapping);
+  }
+  if (mapped.file != INVALID_HANDLE_VALUE) {
+    CloseHandle(mapped.file);
+  }
+  mapped = {};
+}
+
+inline bool map_file(const char *path, MappedFile &mapped) {
+  mapped.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  LARGE_INTEGER size;
+  if (mapped.file == INVALID_HANDLE_VALUE ||
+      !GetFileSizeEx(mapped.file, &size)) {
+    unmap_file(mapped);
+    return false;
+  }
+  mapped.size = static_cast<size_t>(size.QuadPart);
+  // An empty file cannot be mapped, and has nothing to read anyway.
+  if (mapped.size == 0) {
+    return true;
+  }
+  mapped.mapping =
+      CreateFileMappingA(mapped.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapped.mapping != nullptr) {
+    mapped.data = static_cast<const uint8_t *>(
+        MapViewOfFile(mapped.mapping, FILE_MAP_READ, 0, 0, 0));
+  }
+  if (mapped.data == nullptr) {
+    unmap_file(mapped);
+    return false;
+  }
+  return true;
+}
+
+#else
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <poll.h>
+#include <streambuf>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+
+// Keys typed at the terminal. A reader thread sleeps in poll() on stdin and
+// queues whatever arrives, so asking whether a key is waiting is a load of
+// the queue's length and never blocks. std::cin reads from here while input
+// buffering is disabled.
+class KeyboardQueue : public std::streambuf {
+public:
+  void start() {
+    if (m_reader.joinable() || pipe(m_wake) != 0) {
+      return;
+    }
+    m_closed = false;
+    m_closed_flag.store(false, std::memory_order_release);
+    // The reader inherits a mask without SIGINT, so the handler always runs
+    // on another thread.
+    sigset_t interrupt, previous;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interrupt, &previous);
+    m_reader = std::thread([this] { read_keys(); });
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+  }
+
+  void stop() {
+    if (!m_reader.joinable()) {
+      return;
+    }
+    char wake = 0;
+    (void)!write(m_wake[1], &wake, 1);
+    m_reader.join();
+    close(m_wake[0]);
+    close(m_wake[1]);
+  }
+
+  ~KeyboardQueue() { stop(); }
+
+protected:
+  std::streamsize showmanyc() override {
+    auto count = m_count.load(std::memory_order_acquire);
+    if (count > 0) {
+      return static_cast<std::streamsize>(count);
+    }
+    return m_closed_flag.load(std::memory_order_acquire) ? -1 : 0;
+  }
+
+  // Blocks until a key arrives, then takes every queued key at once.
+  int_type underflow() override {
+    std::unique_lock lock(m_mutex);
+    m_ready.wait(lock, [this] { return !m_keys.empty() || m_closed; });
+    if (m_keys.empty()) {
+      return traits_type::eof();
+    }
+    size_t count = std::min(m_keys.size(), sizeof(m_buffer));
+    std::copy_n(m_keys.begin(), count, m_buffer);
+    m_keys.erase(m_keys.begin(), m_keys.begin() + count);
+    m_count.fetch_sub(count, std::memory_order_release);
+    setg(m_buffer, m_buffer, m_buffer + count);
+    return traits_type::to_int_type(m_buffer[0]);
+  }
+
+private:
+  void read_keys() {
+    pollfd fds[] = {{STDIN_FILENO, POLLIN, 0}, {m_wake[0], POLLIN, 0}};
+    char keys[256];
+    ssize_t count = 0;
+    while (true) {
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      if (fds[1].revents != 0) {
+        break;
+      }
+      count = read(STDIN_FILENO, keys, sizeof(keys));
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count <= 0) {
+        break;
+      }
+      std::lock_guard lock(m_mutex);
+      m_keys.insert(m_keys.end(), keys, keys + count);
+      m_count.fetch_add(count, std::memory_order_release);
+      m_ready.notify_all();
+    }
+    // Whatever stopped us, nothing more is coming.
+    std::lock_guard lock(m_mutex);
+    m_closed = true;
+    m_closed_flag.store(true, std::memory_order_release);
+    m_ready.notify_all();
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::deque<char> m_keys;
+  bool m_closed = false;
+  // Mirror m_keys.size() and m_closed for readers that take no lock.
+  std::atomic<size_t> m_count = 0;
+  std::atomic<bool> m_closed_flag = false;
+  char m_buffer[256];
+  int m_wake[2] = {-1, -1};
+  std::thread m_reader;
+};
+
+inline KeyboardQueue keyboard;
+inline std::streambuf *stdin_buffer = nullptr;
+inline termios original_tio;
+// Read by handle_interrupt(), so lock-free.
+inline std::atomic<bool> tio_changed = false;
+
+inline void disable_input_buffering() {
+  if (tcgetattr(STDIN_FILENO, &original_tio) == 0) {
+    termios raw = original_tio;
+    raw.c_lflag &= ~ICANON & ~ECHO; /* no line buffering, no input echo */
+    tio_changed.store(tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0);
+  }
+  keyboard.start();
+  stdin_buffer = std::cin.rdbuf(&keyboard);
+}
+
+inline void restore_input_buffering() {
+  if (tio_changed.exchange(false)) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+  }
+  if (stdin_buffer != nullptr) {
+    std::cin.rdbuf(stdin_buffer);
+    stdin_buffer = nullptr;
+  }
+  keyboard.stop();
+}
+
+inline uint16_t check_key() { return keyboard.in_avail() > 0; }
+
+// SIGINT: puts the terminal back and exits at once. Only async-signal-safe
+// calls, so the reader thread and the streams are left as they are.
+inline void handle_interrupt(int) {
+  if (tio_changed.load()) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+  }
+  (void)!write(STDOUT_FILENO, "\n", 1);
+  _exit(-2);
+}
+
+// Read-write-execute memory for the JIT's code cache.
+inline void *allocate_executable(size_t size) {
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return memory == MAP_FAILED ? nullptr : memory;
+}
+
+inline void free_executable(void *memory, size_t size) {
+  munmap(memory, size);
+}
+
+// The most memory this process has had resident at once, in KiB, or since
+// the last reset_peak_resident().
+inline size_t peak_resident_kib() {
+#ifdef __linux__
+  // ru_maxrss never comes down; VmHWM is what clear_refs resets.
+  if (FILE *status = fopen("/proc/self/status", "r")) {
+    char line[128];
+    size_t kib = 0;
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), status) != nullptr) {
+      found = sscanf(line, "VmHWM: %zu kB", &kib) == 1;
+    }
+    fclose(status);
+    if (found) {
+      return kib;
+    }
+  }
+#endif
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return static_cast<size_t>(usage.ru_maxrss);
+}
+
+// Starts the peak over from what is resident now, so that the next
+// peak_resident_kib() covers only what ran in between. False where the
+// kernel keeps no peak that can be started over.
+inline bool reset_peak_resident() {
+#ifdef __linux__
+  int file = open("/proc/self/clear_refs", O_WRONLY);
+  if (file < 0) {
+    return false;
+  }
+  bool reset = write(file, "5", 1) == 1;
+  close(file);
+  return reset;
+#else
+  return false;
+#endif
+}
+
+// A read-only view of a whole file.
+struct MappedFile {
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+};
+
+inline void unmap_file(MappedFile &mapped) {
+  if (mapped.data != nullptr) {
+    munmap(const_cast<uint8_t *>(mapped.data), mapped.size);
+  }
+  mapped = {};
+}
+
+inline bool map_file(const char *path, MappedFile &mapped) {
+  int file = open(path, O_RDONLY);
+  struct stat status;
+  if (file < 0 || fstat(file, &status) != 0) {
+    if (file >= 0) {
+      close(file);
+    }
+    return false;
+  }
+  mapped.size = static_cast<size_t>(status.st_size);
+  // An empty file cannot be mapped, and has nothing to read anyway.
+  if (mapped.size == 0) {
+    close(file);
+    return true;
+  }
+  void *data = mmap(nullptr, mapped.size, PROT_READ, MAP_PRIVATE, file, 0);
+  // The mapping keeps the file alive on its own.
+  close(file);
+  if (data == MAP_FAILED) {
+    mapped = {};
+    return false;
+  }
+  mapped.data = static_cast<const uint8_t *>(data);
+  return true;
+}
+#endif
@@ -0,0 +1,93 @@
+#include <Profile.h>
+#include <Trace.h>
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+
+// Every address that ran at least once, most run first.
+static std::vector<uint16_t> hotspots(const Profile &profile) {
+  std::vector<uint16_t> addresses;
+  for (size_t pc = 0; pc < Memory::SIZE; pc++) {
+    if (profile.hits(pc) > 0) {
+      addresses.push_back(pc);
+    }
+  }
+  std::stable_sort(addresses.begin(), addresses.end(),
+                   [&profile](uint16_t a, uint16_t b) {
+                     return profile.hits(a) > profile.hits(b);
+                   });
+  return addresses;
+}
+
+static OpCode opcode_at(const Memory &memory, uint16_t pc) {
+  return static_cast<OpCode>(memory.read(pc) >> 12);
+}
+
+void Profile::write_report(std::ostream &report, const Memory &memory,
+                           size_t limit) const {
+  uint64_t total = 0;
+  for (auto hits : m_opcodes) {
+    total += hits;
+  }
+  auto share = [total](uint64_t hits) {
+    return total == 0 ? 0.0 : 100.0 * hits / total;
+  };
+  auto flags = report.flags();
+  report << std::fixed << std::setprecision(2);
+
+  report << "=======Hotspots=======\n";
+  auto addresses = hotspots(*this);
+  addresses.resize(std::min(addresses.size(), limit));
+  for (auto pc : addresses) {
+    report << hex(pc) << ": " << m_hits[pc] << " (" << share(m_hits[pc])
+           << "%) " << opcode_name(opcode_at(memory, pc)) << "\n";
+  }
+
+  report << "=======Opcodes========\n";
+  for (size_t i = 0; i < to_underlying(OpCode::COUNT); i++) {
+    if (m_opcodes[i] > 0) {
+      report << opcode_name(static_cast<OpCode>(i)) << ": " << m_opcodes[i]
+             << " (" << share(m_opcodes[i]) << "%)\n";
+    }
+  }
+
+  report << "=======Branches=======\n";
+  for (size_t pc = 0; pc < Memory::SIZE; pc++) {
+    if (m_taken[pc] + m_not_taken[pc] > 0) {
+      report << hex(pc) << ": taken " << m_taken[pc] << ", not taken "
+             << m_not_taken[pc] << "\n";
+    }
+  }
+  report << "======================\n";
+  report.flags(flags);
+}
+
+void Profile::write_json(std::ostream &json, const Memory &memory) const {
+  json << "{\n  \"addresses\": [";
+  const char *separator = "\n";
+  for (auto pc : hotspots(*this)) {
+    json << separator << "    {\"pc\": " << pc << ", \"hits\": " << m_hits[pc]
+         << ", \"opcode\": \"" << opcode_name(opcode_at(memory, pc)) << "\"}";
+    separator = ",\n";
+  }
+
+  json << "\n  ],\n  \"opcodes\": {";
+  separator = "\n";
+  for (size_t i = 0; i < to_underlying(OpCode::COUNT); i++) {
+    json << separator << "    \"" << opcode_name(static_cast<OpCode>(i))
+         << "\": " << m_opcodes[i];
+    separator = ",\n";
+  }
+
+  json << "\n  },\n  \"branches\": [";
+  separator = "\n";
+  for (size_t pc = 0; pc < Memory::SIZE; pc++) {
+    if (m_taken[pc] + m_not_taken[pc] > 0) {
+      json << separator << "    {\"pc\": " << pc
+           << ", \"taken\": " << m_taken[pc]
+           << ", \"not_taken\": " << m_not_taken[pc] << "}";
+      separator = ",\n";
+    }
+  }
+  json << "\n  ]\n}\n";
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Memory.h>
+#include <Opcode.h>
+#include <Utils.h>
+#include <cstdint>
+#include <iostream>
+
+// Where a guest program spends its time: how often the instruction at each
+// address ran, how often each opcode ran and which way each branch went.
+// Only engines instantiated with TraceLevel::Profile or above fill one in,
+// so the untraced engines pay nothing for it.
+class Profile {
+public:
+  // Counts one run of `word`, the instruction at `pc`.
+  void count(uint16_t pc, uint16_t word) {
+    m_hits[pc]++;
+    m_opcodes[word >> 12]++;
+  }
+  void branch(uint16_t pc, bool taken) {
+    (taken ? m_taken : m_not_taken)[pc]++;
+  }
+
+  uint64_t hits(uint16_t pc) const { return m_hits[pc]; }
+  uint64_t hits(OpCode opcode) const {
+    return m_opcodes[to_underlying(opcode)];
+  }
+  uint64_t taken(uint16_t pc) const { return m_taken[pc]; }
+  uint64_t not_taken(uint16_t pc) const { return m_not_taken[pc]; }
+
+  // The `limit` most run addresses, most first, followed by the opcode counts
+  // and every branch that ran. `memory` supplies the instruction at each
+  // address.
+  void write_report(std::ostream &report, const Memory &memory,
+                    size_t limit = 20) const;
+  // The same, for every address that ran, as one JSON object.
+  void write_json(std::ostream &json, const Memory &memory) const;
+
+private:
+  uint64_t m_hits[Memory::SIZE] = {};
+  uint64_t m_opcodes[to_underlying(OpCode::COUNT)] = {};
+  uint64_t m_taken[Memory::SIZE] = {};
+  uint64_t m_not_taken[Memory::SIZE] = {};
+};
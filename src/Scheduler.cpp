@@ -0,0 +1,84 @@
+#include <Scheduler.h>
+#include <Trap.h>
+
+Scheduler::Scheduler(size_t threads, uint64_t slice, Engine engine)
+    : m_slice(std::max<uint64_t>(slice, 1)), m_engine(engine) {
+  for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+    m_workers.emplace_back([this] { work(); });
+  }
+}
+
+Scheduler::~Scheduler() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_stop = true;
+  }
+  m_runnable.notify_all();
+  m_workers.clear();
+}
+
+Scheduler::Id Scheduler::spawn(std::unique_ptr<VirtualMachine> vm,
+                               OnStop on_stop) {
+  Id id;
+  {
+    std::lock_guard lock(m_mutex);
+    id = m_tasks.size();
+    m_tasks.push_back({std::move(vm), std::move(on_stop)});
+    m_queue.push_back(id);
+  }
+  m_runnable.notify_one();
+  return id;
+}
+
+void Scheduler::resume(Id id) {
+  {
+    std::lock_guard lock(m_mutex);
+    m_queue.push_back(id);
+  }
+  m_runnable.notify_one();
+}
+
+VirtualMachine &Scheduler::machine(Id id) {
+  std::lock_guard lock(m_mutex);
+  return *m_tasks[id].vm;
+}
+
+void Scheduler::wait() {
+  std::unique_lock lock(m_mutex);
+  m_idle.wait(lock, [this] { return m_queue.empty() && m_running == 0; });
+}
+
+void Scheduler::work() {
+  std::unique_lock lock(m_mutex);
+  for (;;) {
+    m_runnable.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+    if (m_stop) {
+      return;
+    }
+    auto id = m_queue.front();
+    m_queue.pop_front();
+    auto &task = m_tasks[id];
+    m_running++;
+    lock.unlock();
+
+    ExitReason reason;
+    try {
+      reason = task.vm->run(m_slice, m_engine);
+    } catch (InvalidTrap &) {
+      reason = ExitReason::BadOpcode;
+    }
+    if (reason != ExitReason::BudgetExhausted && task.on_stop) {
+      task.on_stop(id, *task.vm, reason);
+    }
+
+    lock.lock();
+    m_running--;
+    if (reason == ExitReason::BudgetExhausted) {
+      // Any idle worker would find the queue empty but for this machine, so
+      // this worker picks it up again itself.
+      m_queue.push_back(id);
+    } else if (m_queue.empty() && m_running == 0) {
+      m_idle.notify_all();
+    }
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <Engine.h>
+#include <ExitReason.h>
+#include <VirtualMachine.h>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Time-slices any number of machines over a fixed set of worker threads.
+// Runnable machines wait in one first-in first-out queue; a worker takes the
+// one at the front, executes it for at most `slice` instructions and puts it
+// back at the end if it used them all up. A machine that loops forever thus
+// costs the others a slice per round instead of a thread, and none of them
+// waits more than (runnable machines / threads) slices for its next turn.
+class Scheduler {
+public:
+  using Id = size_t;
+  // Called on the worker thread when a machine stops for any reason but
+  // ExitReason::BudgetExhausted. A trap with no service routine stops it
+  // with ExitReason::BadOpcode.
+  using OnStop = std::function<void(Id, VirtualMachine &, ExitReason)>;
+
+  static constexpr uint64_t DEFAULT_SLICE = 1 << 16;
+
+  explicit Scheduler(size_t threads = std::thread::hardware_concurrency(),
+                     uint64_t slice = DEFAULT_SLICE,
+                     Engine engine = Engine::Switch);
+  // Waits for the slices in progress. Machines still queued never run
+  // again.
+  ~Scheduler();
+
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+
+  // Takes `vm` over and queues it to run from its PC.
+  Id spawn(std::unique_ptr<VirtualMachine> vm, OnStop on_stop = nullptr);
+  // Queues a stopped machine again, such as one waiting for input that
+  // has arrived since.
+  void resume(Id);
+  // The machine `id` runs on. Only touch it while it is stopped.
+  VirtualMachine &machine(Id id);
+
+  // Blocks until every machine has stopped.
+  void wait();
+
+private:
+  struct Task {
+    std::unique_ptr<VirtualMachine> vm;
+    OnStop on_stop;
+  };
+
+  void work();
+
+  uint64_t m_slice;
+  Engine m_engine;
+
+  std::mutex m_mutex;
+  // Wakes workers when a machine is queued or the scheduler shuts down.
+  std::condition_variable m_runnable;
+  // Signalled when the last running machine stops.
+  std::condition_variable m_idle;
+  // A deque, so that spawning never moves the tasks workers are running.
+  std::deque<Task> m_tasks;
+  std::deque<Id> m_queue;
+  size_t m_running = 0;
+  bool m_stop = false;
+
+  std::vector<std::jthread> m_workers;
+};
@@ -0,0 +1,134 @@
+#include <Session.h>
+
+void Executor::post(std::coroutine_handle<> coroutine) {
+  {
+    std::lock_guard lock(m_mutex);
+    m_ready.push_back(coroutine);
+  }
+  m_posted.notify_one();
+}
+
+void Executor::run() {
+  while (auto coroutine = take(true)) {
+    coroutine.resume();
+  }
+}
+
+void Executor::run_ready() {
+  while (auto coroutine = take(false)) {
+    coroutine.resume();
+  }
+}
+
+void Executor::stop() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_stop = true;
+  }
+  m_posted.notify_all();
+}
+
+std::coroutine_handle<> Executor::take(bool wait) {
+  std::unique_lock lock(m_mutex);
+  if (wait) {
+    m_posted.wait(lock, [this] { return m_stop || !m_ready.empty(); });
+  }
+  if (m_stop || m_ready.empty()) {
+    return nullptr;
+  }
+  auto coroutine = m_ready.front();
+  m_ready.pop_front();
+  return coroutine;
+}
+
+Session::Session(Executor &executor, std::unique_ptr<VirtualMachine> vm,
+                 WriteOutput write, OnDone on_done, Engine engine,
+                 uint64_t slice)
+    : m_executor(executor), m_vm(std::move(vm)),
+      m_on_done(std::move(on_done)), m_engine(engine),
+      m_slice(std::max<uint64_t>(slice, 1)), m_task(drive()) {
+  m_vm->set_io([this] { return read(); }, std::move(write));
+  m_executor.post(m_task.handle);
+}
+
+Session::~Session() { m_task.handle.destroy(); }
+
+void Session::feed(std::string_view input) {
+  std::coroutine_handle<> waiting;
+  {
+    std::lock_guard lock(m_mutex);
+    m_input.append(input);
+    std::swap(waiting, m_waiting);
+  }
+  if (waiting) {
+    m_executor.post(waiting);
+  }
+}
+
+void Session::close() {
+  std::coroutine_handle<> waiting;
+  {
+    std::lock_guard lock(m_mutex);
+    m_closed = true;
+    std::swap(waiting, m_waiting);
+  }
+  if (waiting) {
+    m_executor.post(waiting);
+  }
+}
+
+std::optional<uint8_t> Session::read() {
+  std::lock_guard lock(m_mutex);
+  if (m_input_position == m_input.size()) {
+    return std::nullopt;
+  }
+  auto ch = static_cast<uint8_t>(m_input[m_input_position++]);
+  // Drop what was read once it is all read, so a long session does not
+  // keep its whole input.
+  if (m_input_position == m_input.size()) {
+    m_input.clear();
+    m_input_position = 0;
+  }
+  return ch;
+}
+
+bool Session::InputArrives::await_suspend(std::coroutine_handle<> coroutine) {
+  std::lock_guard lock(session.m_mutex);
+  if (session.m_input_position != session.m_input.size() ||
+      session.m_closed) {
+    return false;
+  }
+  session.m_waiting = coroutine;
+  return true;
+}
+
+Session::Task Session::drive() {
+  for (;;) {
+    ExitReason reason;
+    try {
+      reason = m_vm->run(m_slice, m_engine);
+    } catch (InvalidTrap &) {
+      reason = ExitReason::BadOpcode;
+    }
+    m_exit_reason = reason;
+    if (reason == ExitReason::BudgetExhausted) {
+      co_await Yield{m_executor};
+      continue;
+    }
+    if (reason == ExitReason::WaitingForInput) {
+      bool closed;
+      {
+        std::lock_guard lock(m_mutex);
+        closed = m_closed && m_input_position == m_input.size();
+      }
+      if (!closed) {
+        co_await InputArrives{*this};
+        continue;
+      }
+    }
+    break;
+  }
+  if (m_on_done) {
+    m_on_done(*this);
+  }
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <CallbackIo.h>
+#include <Engine.h>
+#include <ExitReason.h>
+#include <VirtualMachine.h>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// Runs suspended coroutines, on whichever threads call run() or
+// run_ready(). Nothing is tied to a thread: a coroutine carries on from
+// wherever it was resumed.
+class Executor {
+public:
+  // Queues `coroutine` to be resumed. Safe from any thread.
+  void post(std::coroutine_handle<> coroutine);
+
+  // Resumes queued coroutines until stop(), waiting for more whenever the
+  // queue runs dry.
+  void run();
+  // Resumes queued coroutines until the queue runs dry.
+  void run_ready();
+  // Makes every run() return once it finishes the coroutine in hand.
+  void stop();
+
+private:
+  // The next coroutine, or a null handle once there is none and `wait`
+  // is false or the executor stopped.
+  std::coroutine_handle<> take(bool wait);
+
+  std::mutex m_mutex;
+  std::condition_variable m_posted;
+  std::deque<std::coroutine_handle<>> m_ready;
+  bool m_stop = false;
+};
+
+// One interactive machine driven by a coroutine on an Executor. The
+// coroutine executes the machine a slice at a time, yielding the thread
+// between slices; when a GETC or IN finds no input it suspends until feed()
+// brings some, so a waiting session costs no thread at all. Input can come
+// from anywhere: a pipe, a socket, or a replay log set on the machine, in
+// which case it never waits.
+class Session {
+public:
+  // Called on the executor's thread once the machine stopped for good, just
+  // before done() turns true. It must not destroy the session, whose
+  // coroutine is still returning.
+  using OnDone = std::function<void(Session &)>;
+
+  static constexpr uint64_t DEFAULT_SLICE = 1 << 16;
+
+  // Takes `vm` over, routes its output to `write` and queues it to run on
+  // `executor`.
+  Session(Executor &executor, std::unique_ptr<VirtualMachine> vm,
+          WriteOutput write, OnDone on_done = nullptr,
+          Engine engine = Engine::Switch, uint64_t slice = DEFAULT_SLICE);
+  // Only once done(), from any thread, or once the executor will never
+  // resume it again.
+  ~Session();
+
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  // Hands the machine more input and wakes it if it was waiting for some.
+  // Safe from any thread.
+  void feed(std::string_view input);
+  // No more input will come. A machine that waits for some anyway stops
+  // with ExitReason::WaitingForInput.
+  void close();
+
+  // Turns true only once the coroutine is suspended for the last time, so
+  // nothing runs on the session after it.
+  bool done() const { return m_done; }
+  // Why the machine stopped, once done(). A trap with no service routine
+  // stops it with ExitReason::BadOpcode.
+  ExitReason exit_reason() const { return m_exit_reason; }
+  VirtualMachine &machine() { return *m_vm; }
+
+private:
+  // Marks the session done once its coroutine has suspended for good, the
+  // last thing the executor's thread does with it.
+  struct Finished {
+    Session &session;
+    bool await_ready() noexcept { return false; }
+    void await_suspend(std::coroutine_handle<>) noexcept {
+      session.m_done = true;
+    }
+    void await_resume() noexcept {}
+  };
+
+  // The coroutine behind a session: it starts suspended, and its frame
+  // lives until the Session destroys it.
+  struct Task {
+    struct promise_type {
+      // drive() is a member, so its promise gets the session.
+      explicit promise_type(Session &session) : session(session) {}
+
+      Task get_return_object() {
+        return {std::coroutine_handle<promise_type>::from_promise(*this)};
+      }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      Finished final_suspend() noexcept { return {session}; }
+      void return_void() {}
+      void unhandled_exception() { throw; }
+
+      Session &session;
+    };
+    std::coroutine_handle<promise_type> handle;
+  };
+
+  // Puts the coroutine back at the end of the executor's queue.
+  struct Yield {
+    Executor &executor;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> coroutine) {
+      executor.post(coroutine);
+    }
+    void await_resume() {}
+  };
+
+  // Suspends until there is input to take or none will ever come.
+  struct InputArrives {
+    Session &session;
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> coroutine);
+    void await_resume() {}
+  };
+
+  Task drive();
+  std::optional<uint8_t> read();
+
+  Executor &m_executor;
+  std::unique_ptr<VirtualMachine> m_vm;
+  OnDone m_on_done;
+  Engine m_engine;
+  uint64_t m_slice;
+  std::atomic<bool> m_done = false;
+  ExitReason m_exit_reason = ExitReason::EndOfMemory;
+
+  std::mutex m_mutex;
+  std::string m_input;
+  size_t m_input_position = 0;
+  bool m_closed = false;
+  // The coroutine, while it waits for input.
+  std::coroutine_handle<> m_waiting;
+
+  Task m_task;
+};
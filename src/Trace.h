@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+// How much the engines report about every instruction they run. The level is
+// a template parameter of the engines, so with TraceLevel::None every trace
+// statement is compiled out of the hot loop.
+enum class TraceLevel {
+  None,    /* nothing at all */
+  Binary,  /* nothing printed, but every instruction and memory access
+              written to the machine's TraceRecorder, if it has one */
+  Profile, /* nothing printed, but every instruction and branch counted */
+  Opcode,  /* one line per instruction with its address and handler */
+  Full     /* every decoded field, memory access and trap */
+};
+
+class InvalidTraceLevel {};
+
+inline TraceLevel trace_level_from_name(const char *name) {
+  if (std::strcmp(name, "none") == 0) {
+    return TraceLevel::None;
+  }
+  if (std::strcmp(name, "binary") == 0) {
+    return TraceLevel::Binary;
+  }
+  if (std::strcmp(name, "profile") == 0) {
+    return TraceLevel::Profile;
+  }
+  if (std::strcmp(name, "opcode") == 0) {
+    return TraceLevel::Opcode;
+  }
+  if (std::strcmp(name, "full") == 0) {
+    return TraceLevel::Full;
+  }
+  throw InvalidTraceLevel();
+}
+
+inline const char *trace_level_name(TraceLevel level) {
+  switch (level) {
+  case TraceLevel::None:
+    return "TraceLevel::None";
+  case TraceLevel::Binary:
+    return "TraceLevel::Binary";
+  case TraceLevel::Profile:
+    return "TraceLevel::Profile";
+  case TraceLevel::Opcode:
+    return "TraceLevel::Opcode";
+  case TraceLevel::Full:
+    return "TraceLevel::Full";
+  }
+  return "Unrecognized";
+}
+
+// Writes every argument to std::cout, but only in engines instantiated with a
+// level of at least `Min`.
+template <TraceLevel Level, TraceLevel Min = TraceLevel::Full,
+          typename... Args>
+inline void trace(const Args &...args) {
+  if constexpr (Level >= Min) {
+    (std::cout << ... << args);
+  }
+}
+
+// A 16-bit value that streams as 0x-prefixed hexadecimal, without leaving the
+// stream in hex mode.
+struct Hex {
+  uint16_t value;
+};
+
+inline Hex hex(uint16_t value) { return {value}; }
+
+inline std::ostream &operator<<(std::ostream &os, Hex hex) {
+  auto flags = os.flags();
+  os << "0x" << std::hex << hex.value;
+  os.flags(flags);
+  return os;
+}
@@ -0,0 +1,150 @@
+#include <TraceLog.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static constexpr char MAGIC[8] = {'L', 'C', '3', 'T', 'R', 'A', 'C', 'E'};
+// Records come and go in chunks this big.
+static constexpr size_t CHUNK = 1 << 16;
+// Room for a few hundred chunks, so that a slow disk only holds the machine
+// up once it is that far behind. A power of two, so positions wrap with a
+// mask.
+static constexpr size_t RING = 256 * CHUNK;
+
+TraceRecorder::TraceRecorder(const char *path)
+    : m_file(std::fopen(path, "wb")) {
+  if (!m_file || std::fwrite(MAGIC, 1, sizeof(MAGIC), m_file.get()) !=
+                     sizeof(MAGIC)) {
+    throw CannotOpenTraceLog();
+  }
+  m_ring = std::make_unique<uint8_t[]>(RING);
+  m_writer = std::thread([this] { drain(); });
+}
+
+TraceRecorder::~TraceRecorder() {
+  push(m_buffer, m_used);
+  // The writer thread empties the ring before it returns, and the file
+  // closes after that.
+  m_stop.store(true, std::memory_order_release);
+  m_writer.join();
+}
+
+void TraceRecorder::flush() {
+  push(m_buffer, m_retract_to);
+  std::memmove(m_buffer, m_buffer + m_retract_to, m_used - m_retract_to);
+  m_used -= m_retract_to;
+  m_retract_to = 0;
+}
+
+void TraceRecorder::push(const uint8_t *data, size_t count) {
+  while (count > 0) {
+    auto head = m_head.load(std::memory_order_relaxed);
+    auto used = head - m_tail.load(std::memory_order_acquire);
+    if (used == RING) {
+      // The disk fell behind.
+      std::this_thread::yield();
+      continue;
+    }
+    auto chunk = std::min(count, RING - used);
+    auto offset = head & (RING - 1);
+    auto first = std::min(chunk, RING - offset);
+    std::memcpy(&m_ring[offset], data, first);
+    std::memcpy(&m_ring[0], data + first, chunk - first);
+    m_head.store(head + chunk, std::memory_order_release);
+    data += chunk;
+    count -= chunk;
+  }
+}
+
+void TraceRecorder::drain() {
+  auto tail = m_tail.load(std::memory_order_relaxed);
+  for (;;) {
+    // m_stop first: once it is set, m_head holds everything there is.
+    bool stopping = m_stop.load(std::memory_order_acquire);
+    auto head = m_head.load(std::memory_order_acquire);
+    if (head == tail) {
+      if (stopping) {
+        return;
+      }
+      // Tracing flat out fills a few chunks a millisecond, far short of
+      // the ring, so napping this long never holds the machine up.
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+    while (tail != head) {
+      auto offset = tail & (RING - 1);
+      auto chunk = std::min(head - tail, RING - offset);
+      std::fwrite(&m_ring[offset], 1, chunk, m_file.get());
+      tail += chunk;
+      m_tail.store(tail, std::memory_order_release);
+    }
+  }
+}
+
+TraceReader::TraceReader(const char *path)
+    : m_file(std::fopen(path, "rb")),
+      m_buffer(std::make_unique<uint8_t[]>(CHUNK)) {
+  if (!m_file) {
+    throw CannotOpenTraceLog();
+  }
+  char magic[sizeof(MAGIC)];
+  if (std::fread(magic, 1, sizeof(magic), m_file.get()) != sizeof(magic) ||
+      std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+    throw InvalidTraceLog();
+  }
+}
+
+std::optional<uint8_t> TraceReader::byte() {
+  if (m_at == m_size) {
+    m_size = std::fread(m_buffer.get(), 1, CHUNK, m_file.get());
+    m_at = 0;
+    if (m_size == 0) {
+      return std::nullopt;
+    }
+  }
+  return m_buffer[m_at++];
+}
+
+uint8_t TraceReader::expect() {
+  auto next = byte();
+  if (!next) {
+    throw InvalidTraceLog();
+  }
+  return *next;
+}
+
+std::optional<TraceRecord> TraceReader::next() {
+  auto tag = byte();
+  if (!tag) {
+    return std::nullopt;
+  }
+  auto event = static_cast<TraceEvent>(*tag & 3);
+  if (event > TraceEvent::Write) {
+    throw InvalidTraceLog();
+  }
+
+  uint32_t zigzag = *tag >> 2;
+  if (zigzag == TRACE_DELTA_FOLLOWS) {
+    zigzag = 0;
+    for (int shift = 0;; shift += 7) {
+      auto part = expect();
+      zigzag |= uint32_t(part & 0x7f) << shift;
+      if ((part & 0x80) == 0) {
+        break;
+      }
+      if (shift == 14) {
+        throw InvalidTraceLog();
+      }
+    }
+  }
+  auto delta = static_cast<uint16_t>((zigzag >> 1) ^ -(zigzag & 1));
+  uint16_t value = expect();
+  value |= expect() << 8;
+
+  if (event == TraceEvent::Instruction) {
+    m_pc += 1 + delta;
+    return TraceRecord{event, m_pc, value};
+  }
+  m_address += delta;
+  return TraceRecord{event, m_address, value};
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <thread>
+
+// What a record of an execution trace stands for.
+enum class TraceEvent : uint8_t {
+  Instruction, /* the machine dispatched the instruction at an address */
+  Read,        /* the last instruction loaded a word */
+  Write        /* the last instruction stored a word */
+};
+
+inline const char *trace_event_name(TraceEvent event) {
+  switch (event) {
+  case TraceEvent::Instruction:
+    return "TraceEvent::Instruction";
+  case TraceEvent::Read:
+    return "TraceEvent::Read";
+  case TraceEvent::Write:
+    return "TraceEvent::Write";
+  }
+  return "Unrecognized";
+}
+
+// For TraceEvent::Instruction the PC and the instruction word there, for the
+// others the address and the word loaded or stored.
+struct TraceRecord {
+  TraceEvent event;
+  uint16_t address;
+  uint16_t value;
+};
+
+// A tag's delta bits read this when the delta follows it as LEB128.
+inline constexpr uint8_t TRACE_DELTA_FOLLOWS = 63;
+
+class CannotOpenTraceLog {};
+class InvalidTraceLog {};
+
+struct FileCloser {
+  void operator()(FILE *file) const { std::fclose(file); }
+};
+
+// Writes an execution trace to a file, a few bytes per record, for runs too
+// long to trace as text. Records are encoded into a small buffer, which goes
+// into a ring whenever it fills up. A background thread writes the ring out,
+// so the machine never waits for the disk unless the disk falls behind. The
+// ring has one producer and one consumer and takes no lock: each side moves
+// only its own atomic position, and the writer thread naps while the ring is
+// empty rather than waiting to be woken.
+//
+// The file holds a magic number, then per record a tag byte and the value as
+// two little-endian bytes. The low two bits of the tag are the event. The
+// rest hold the address as a zigzag-encoded 16-bit delta: from the previous
+// instruction's PC plus one for instructions, so that straight-line code
+// takes 3 bytes per instruction, and from the previous access's address for
+// the others. A delta too large for the six bits reads 63, and follows the
+// tag as LEB128.
+//
+// One thread records at a time.
+class TraceRecorder {
+public:
+  // Throws CannotOpenTraceLog.
+  explicit TraceRecorder(const char *path);
+  ~TraceRecorder();
+
+  TraceRecorder(const TraceRecorder &) = delete;
+  TraceRecorder &operator=(const TraceRecorder &) = delete;
+
+  void instruction(uint16_t pc, uint16_t word) {
+    make_room();
+    m_retract_to = m_used;
+    m_retract_pc = m_pc;
+    m_retract_address = m_address;
+    put(TraceEvent::Instruction, pc - static_cast<uint16_t>(m_pc + 1), word);
+    m_pc = pc;
+  }
+  void access(TraceEvent event, uint16_t address, uint16_t value) {
+    make_room();
+    put(event, address - m_address, value);
+    m_address = address;
+  }
+  // Takes back the last instruction and whatever it accessed, for an
+  // instruction the machine backed out of.
+  void retract() {
+    m_used = m_retract_to;
+    m_pc = m_retract_pc;
+    m_address = m_retract_address;
+  }
+
+private:
+  // A tag, a three-byte delta and the value.
+  static constexpr size_t MAX_RECORD = 6;
+
+  void put(TraceEvent event, uint16_t delta, uint16_t value) {
+    uint16_t zigzag = static_cast<uint16_t>(delta << 1) ^
+                      static_cast<uint16_t>(-(delta >> 15));
+    auto tag = static_cast<uint8_t>(event);
+    if (zigzag < TRACE_DELTA_FOLLOWS) {
+      m_buffer[m_used++] = tag | zigzag << 2;
+    } else {
+      m_buffer[m_used++] = tag | TRACE_DELTA_FOLLOWS << 2;
+      for (; zigzag >= 0x80; zigzag >>= 7) {
+        m_buffer[m_used++] = (zigzag & 0x7f) | 0x80;
+      }
+      m_buffer[m_used++] = zigzag;
+    }
+    m_buffer[m_used++] = value & 0xff;
+    m_buffer[m_used++] = value >> 8;
+  }
+  void make_room() {
+    if (m_used > sizeof(m_buffer) - MAX_RECORD) [[unlikely]] {
+      flush();
+    }
+  }
+  // Hands everything but the last instruction's records to the writer
+  // thread, so that retract() still works.
+  void flush();
+  // Copies `count` bytes into the ring, waiting while it is full.
+  void push(const uint8_t *data, size_t count);
+  // The writer thread: writes the ring out until m_stop.
+  void drain();
+
+  std::unique_ptr<FILE, FileCloser> m_file;
+  std::unique_ptr<uint8_t[]> m_ring;
+  // Free-running positions: the machine only moves m_head, the writer
+  // thread only m_tail.
+  std::atomic<size_t> m_head = 0;
+  std::atomic<size_t> m_tail = 0;
+  std::atomic<bool> m_stop = false;
+  std::thread m_writer;
+
+  uint8_t m_buffer[1 << 16];
+  size_t m_used = 0;
+  // The first instruction record says how far it is from 0.
+  uint16_t m_pc = 0xffff;
+  uint16_t m_address = 0;
+  size_t m_retract_to = 0;
+  uint16_t m_retract_pc = 0xffff;
+  uint16_t m_retract_address = 0;
+};
+
+// Reads the records of a trace back in order, without holding the file in
+// memory.
+class TraceReader {
+public:
+  // Throws CannotOpenTraceLog, or InvalidTraceLog for a foreign file.
+  explicit TraceReader(const char *path);
+
+  // The next record, or nothing at the end of the file. Throws
+  // InvalidTraceLog for a truncated or corrupt record.
+  std::optional<TraceRecord> next();
+
+private:
+  // The next byte of the file, or nothing at its end.
+  std::optional<uint8_t> byte();
+  // The next byte, which a record needs.
+  uint8_t expect();
+
+  std::unique_ptr<FILE, FileCloser> m_file;
+  std::unique_ptr<uint8_t[]> m_buffer;
+  size_t m_at = 0;
+  size_t m_size = 0;
+  uint16_t m_pc = 0xffff;
+  uint16_t m_address = 0;
+};
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <ExitReason.h>
 #include <Utils.h>
+#include <array>
+#include <functional>
 #include <numeric>
+#include <optional>
+
+class VirtualMachine;
 
 enum class Trap {
   GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
@@ -14,6 +20,31 @@ enum class Trap {
 
 class InvalidTrap {};
 
+// TRAP takes an 8-bit vector.
+constexpr size_t TRAP_VECTORS = 256;
+
+// How the machine serves a trap vector.
+enum class TrapKind : uint8_t {
+  Invalid, /* TRAP throws InvalidTrap */
+  Builtin, /* the machine's own routine for one of the Traps above */
+  Native,  /* a TrapHandler set by the program embedding the machine */
+  Guest    /* the routine at the address in memory[vector], as on the LC-3 */
+};
+
+// A trap service routine that runs on the host instead of in guest code. It
+// returns why the machine should stop, if it should.
+using TrapHandler = std::function<std::optional<ExitReason>(VirtualMachine &)>;
+
+// Every vector Invalid but the standard Traps, which are Builtin.
+inline constexpr std::array<TrapKind, TRAP_VECTORS> builtin_trap_kinds() {
+  std::array<TrapKind, TRAP_VECTORS> kinds{};
+  for (auto vector = to_underlying(Trap::GETC);
+       vector <= to_underlying(Trap::HALT); vector++) {
+    kinds[vector] = TrapKind::Builtin;
+  }
+  return kinds;
+}
+
 inline Trap trap_from_underlying(uint16_t value) {
   if (value > to_underlying(Trap::HALT) || value < to_underlying(Trap::GETC)) {
     throw InvalidTrap();
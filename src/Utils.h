@@ -1,15 +1,24 @@
 #pragma once
+#include <cstdint>
 #include <iostream>
 
 template <typename EnumLike> constexpr size_t to_underlying(EnumLike v) {
   return static_cast<size_t>(v);
 }
 
+// Sign-extends the lowest `bit_count` bits of `x` to 16 bits.
+constexpr uint16_t sign_extend(uint16_t x, int bit_count) {
+  // If x has a 1 in the bit_count's position, then its negative
+  if ((x >> (bit_count - 1)) & 1) {
+    // Pad with 1 if it's negative
+    x |= (0xffff << bit_count);
+  }
+  return x;
+}
+
 template <typename... Args> std::ostream &print_hexadecimal(Args... args) {
   auto flags = std::cout.flags();
-#ifdef VM_DEBUG
-  std::cout << std::hex << (args << ...);
+  ((std::cout << std::hex) << ... << args);
   std::cout.flags(flags);
-#endif
   return std::cout;
-}
\ No newline at end of file
+}
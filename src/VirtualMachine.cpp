@@ -1,625 +1,1311 @@
-#define VM_DEBUG
-
+#include <MemoryDump.h>
 #include <MemoryMappedRegister.h>
 #include <Platform.h>
 
+#include <Trace.h>
 #include <Trap.h>
 #include <Utils.h>
 #include <VirtualMachine.h>
+#include <cctype>
 #include <iostream>
+#include <new>
 
 VirtualMachine::VirtualMachine() {
   set_condition_flag(ConditionFlag::ZRO);
   set_register(Register::PC, PC_START);
 }
 
-#ifdef VM_DEBUG
-#define dbg(VALUE) std::cout << VALUE
-#else
-#define dbg(VALUE)
-#endif
-
 VirtualMachine::~VirtualMachine() = default;
 
-void VirtualMachine::execute() {
-  bool running = true;
-  while (running) {
-    // 1. Load one instruction from memory at the address of the PC
-    // register.
-    auto instruction = current_instruction();
-    auto incremented_pc = get_register(Register::PC) + 1;
+std::unique_ptr<DecodedInstruction[], VirtualMachine::FreeDeleter>
+VirtualMachine::allocate_decoded() {
+  auto decoded = static_cast<DecodedInstruction *>(
+      std::calloc(MEMORY_MAX, sizeof(DecodedInstruction)));
+  if (decoded == nullptr) {
+    throw std::bad_alloc();
+  }
+  return std::unique_ptr<DecodedInstruction[], FreeDeleter>(decoded);
+}
 
-    if (incremented_pc >= VirtualMachine::MEMORY_MAX) {
-      break;
-    }
+std::unique_ptr<VirtualMachine> VirtualMachine::fork() {
+  auto child = std::make_unique<VirtualMachine>();
+  m_memory.fork_into(child->m_memory);
+  std::copy_n(m_registers, std::size(m_registers), child->m_registers);
+  child->m_result = m_result;
+  child->m_exit_reason = m_exit_reason;
+  child->m_instructions = m_instructions;
+  child->m_input = m_input;
+  child->m_output = m_output;
+  child->m_console = m_console;
+  child->m_may_run_dry = m_may_run_dry;
+  child->m_trap_kinds = m_trap_kinds;
+  child->m_trap_handlers = m_trap_handlers;
+  // The child's table is fresh, so fetch() marks its breakpoints again and,
+  // with pages watched, nothing fuses across a watched access.
+  child->m_breakpoints = m_breakpoints;
+  child->m_watchpoints = m_watchpoints;
+  child->m_watched_pages = m_watched_pages;
+  child->m_watch_hit = m_watch_hit;
+  return child;
+}
 
-    // 2. Increment the PC register.
-    set_register(Register::PC, incremented_pc);
+void VirtualMachine::set_trap_handler(uint8_t vector, TrapHandler handler) {
+  if (m_trap_handlers.empty()) {
+    m_trap_handlers.resize(TRAP_VECTORS);
+  }
+  m_trap_handlers[vector] = std::move(handler);
+  m_trap_kinds[vector] = TrapKind::Native;
+}
 
-    // 3. Look at the opcode to determine which type of
-    // instruction it should perform.
-    // 4. Perform the instruction using the parameters in the
-    // instruction.
-    if (perform(instruction) == ShouldBreak::Yes) {
-      running = false;
-    }
+void VirtualMachine::set_io(ReadInput read, WriteOutput write) {
+  auto callbacks =
+      std::make_unique<CallbackStreams>(std::move(read), std::move(write));
+  set_io(callbacks->input(), callbacks->output());
+  m_callbacks = std::move(callbacks);
+  m_may_run_dry = true;
+}
+
+ExitReason VirtualMachine::execute(Engine engine, TraceLevel level,
+                                   uint64_t budget) {
+  m_limit = budget > UNLIMITED - m_instructions ? UNLIMITED
+                                                : m_instructions + budget;
+  m_resume_from = has_breakpoint(get_register(Register::PC))
+                      ? get_register(Register::PC)
+                      : NO_BREAKPOINT;
+  m_watch_pending = false;
+  if (level >= TraceLevel::Profile && !m_profile) {
+    m_profile = std::make_unique<Profile>();
+  }
+  switch (level) {
+  case TraceLevel::None:
+    execute_engine<TraceLevel::None>(engine);
+    break;
+  case TraceLevel::Binary:
+    execute_engine<TraceLevel::Binary>(engine);
+    break;
+  case TraceLevel::Profile:
+    execute_engine<TraceLevel::Profile>(engine);
+    break;
+#ifdef VM_TRACE
+  case TraceLevel::Opcode:
+    execute_engine<TraceLevel::Opcode>(engine);
+    break;
+  case TraceLevel::Full:
+    execute_engine<TraceLevel::Full>(engine);
+    break;
+#endif
+  default:
+    // Built without VM_TRACE: only the untraced engines exist.
+    throw InvalidTraceLevel();
+  }
+  // A watchpoint stops the machine by using up its budget.
+  if (m_watch_pending && m_exit_reason == ExitReason::BudgetExhausted) {
+    m_exit_reason = ExitReason::Watchpoint;
+  }
+  return m_exit_reason;
+}
 
-    // 5. Go back to step 1.
+void VirtualMachine::set_breakpoint(uint16_t address) {
+  if (m_breakpoints.empty()) {
+    m_breakpoints.resize(MEMORY_MAX);
+  }
+  m_breakpoints[address] = true;
+  invalidate_decoded(address);
+  // Translated blocks stop short of breakpoints, so the ones running past
+  // this one must go.
+  if (m_jit) {
+    m_jit->flush();
   }
 }
 
-VirtualMachine::ShouldBreak VirtualMachine::perform(Instruction instruction) {
-  auto opcode = instruction.opcode();
-  dbg((const void *)(get_register(Register::PC) - 1)
-      << " Opcode: " << to_underlying(opcode) << "\n");
-  switch (opcode) {
-  case OpCode::ADD: {
-    dbg("ADD instruction\n");
-    Register destination_register =
-        register_from_underlying((instruction.data() >> 9) & 0x07);
-
-    Register source_register1 =
-        register_from_underlying((instruction.data() >> 6) & 0007);
-
-    dbg("   Destination: " << register_name(destination_register) << "\n");
-    dbg("   Source 1: " << register_name(source_register1) << "\n");
-
-    // If bit [5] is 0, the second source operand is obtained from SR2. If bit
-    // [5] is 1, the second source operand is obtained by sign -
-    // extending the imm5 field to 16 bits.
-    auto bit = (instruction.data() >> 5) & 0x1;
-    dbg("   bit[5]: " << bit << "\n");
-
-    auto operand1 = get_register(source_register1);
-    auto operand2 = 0;
-
-    if (bit == 0) {
-      "   Register mode: \n";
-      Register source_register2 =
-          register_from_underlying((instruction.data()) & 07);
-      dbg("     Source 2: " << register_name(source_register2) << "\n");
-      operand2 = get_register(source_register2);
-    } else {
-      dbg("   Immediate mode: \n");
-      auto imm5 = sign_extend(instruction.data() & 0x1f, 5);
-      dbg("     Source 2: " << imm5 << "\n");
-      operand2 = imm5;
+void VirtualMachine::clear_breakpoint(uint16_t address) {
+  if (has_breakpoint(address)) {
+    m_breakpoints[address] = false;
+    invalidate_decoded(address);
+    if (m_jit) {
+      m_jit->flush();
     }
+  }
+}
+
+void VirtualMachine::add_watchpoint(Watchpoint watchpoint) {
+  if (watchpoint.first > watchpoint.last) {
+    std::swap(watchpoint.first, watchpoint.last);
+  }
+  m_watchpoints.push_back(watchpoint);
+  for (auto page = watchpoint.first >> Memory::PAGE_BITS;
+       page <= watchpoint.last >> Memory::PAGE_BITS; page++) {
+    m_watched_pages |= 1u << page;
+  }
+  // Drops every fused group, which could not stop halfway.
+  invalidate_code(0, MEMORY_MAX);
+}
 
-    uint16_t result = operand1 + operand2;
-    dbg("   Result: " << result << "\n");
+void VirtualMachine::clear_watchpoints() {
+  m_watchpoints.clear();
+  m_watched_pages = 0;
+}
 
-    // In both cases,
-    // the second source operand is added to the contents of SR1 and the
-    // result stored in DR. The condition codes are set, based on whether
-    // the result is negative, zero, or positive.
-    set_register(destination_register, result);
+void VirtualMachine::check_watchpoints(uint16_t address, WatchKind kind,
+                                       uint16_t value) {
+  for (auto &watchpoint : m_watchpoints) {
+    if (watchpoint.matches(address, kind)) {
+      uint16_t pc = get_register(Register::PC) - 1;
+      m_watch_hit = {address, kind, value, pc};
+      m_watch_pending = true;
+      // Dispatch stops before the next instruction.
+      m_limit = m_instructions;
+      return;
+    }
+  }
+}
 
-    break;
+template <TraceLevel Level> void VirtualMachine::execute_engine(Engine engine) {
+  try {
+    switch (engine) {
+    case Engine::Switch:
+      execute_switch<Level>();
+      break;
+    case Engine::Threaded:
+      execute_threaded<Level>();
+      break;
+    case Engine::Jit:
+      execute_jit<Level>();
+      break;
+    case Engine::Lockstep:
+      // Lanes only pay off across a batch; a lone machine runs threaded.
+      execute_threaded<Level>();
+      break;
+    }
+  } catch (ReplayDiverged &) {
+    // Only the interpreters read input, so no native code is interrupted.
+    m_exit_reason = ExitReason::ReplayDiverged;
   }
-  case OpCode::AND: {
-    dbg("AND instruction\n");
-    Register destination_register =
-        register_from_underlying((instruction.data() >> 9) & 0x07);
+  // Output is only flushed before reading input, so whatever the program
+  // printed last is still buffered.
+  m_output->flush();
+}
+
+template <TraceLevel Level> void VirtualMachine::execute_switch() {
+  while (step<Level>() == ShouldBreak::No) {
+    // Go back to step 1.
+  }
+}
 
-    Register source_register1 =
-        register_from_underlying((instruction.data() >> 6) & 0x07);
+template <TraceLevel Level> VirtualMachine::ShouldBreak VirtualMachine::step() {
+  // 1. Load one instruction from memory at the address of the PC
+  // register. It comes out of the predecode table, so the fields are
+  // already extracted.
+  auto instruction = fetch(get_register(Register::PC));
+  auto incremented_pc = get_register(Register::PC) + 1;
 
-    dbg("   Destination: " << register_name(destination_register) << "\n");
-    dbg("   Source 1: " << register_name(source_register1) << "\n");
+  if (incremented_pc >= VirtualMachine::MEMORY_MAX) {
+    m_exit_reason = ExitReason::EndOfMemory;
+    return ShouldBreak::Yes;
+  }
+  if (budget_spent(instruction, get_register(Register::PC))) {
+    return ShouldBreak::Yes;
+  }
+  m_instructions++;
+  observe<Level>(get_register(Register::PC));
 
-    auto bit = (instruction.data() >> 5) & 0x1;
-    dbg("   bit[5]: " << bit << "\n");
+  // 2. Increment the PC register.
+  set_register(Register::PC, incremented_pc, ShouldUpdateCondition::No);
 
-    auto operand1 = get_register(source_register1);
-    auto operand2 = 0;
+  // 3. Look at the handler to determine which type of
+  // instruction it should perform.
+  // 4. Perform the instruction using the parameters in the
+  // instruction.
+  return perform<Level>(instruction);
+}
 
-    // If bit [5] is 0, the second source operand is obtained from SR2.
-    if (bit == 0) {
-      dbg("   Register mode: \n");
-      Register source_register2 =
-          register_from_underlying((instruction.data()) & 07);
-      dbg("     Source 2: " << register_name(source_register2) << "\n");
-      operand2 = get_register(source_register2);
-    } else {
-      // If bit [5] is 1, the second source operand is obtained by
-      // sign-extending the imm5 field to 16 bits.
-      dbg("   Immediate mode: \n");
-      auto imm5 = sign_extend(instruction.data() & 0x1f, 5);
-      dbg("   Source 2: " << imm5 << "\n");
-      operand2 = imm5;
+template <TraceLevel Level> void VirtualMachine::execute_jit() {
+  // Translated blocks have no trace points or profile counters, and only
+  // x86-64 hosts can run them at all. Everything else gets the threaded
+  // interpreter.
+  if constexpr (Level != TraceLevel::None || !Jit::SUPPORTED) {
+    execute_threaded<Level>();
+  } else {
+    // Native loads and stores do not check watchpoints.
+    if (m_watched_pages != 0) {
+      execute_threaded<Level>();
+      return;
+    }
+    if (!m_jit) {
+      m_jit = std::make_unique<Jit>();
     }
 
-    // In either case, the second source operand and
-    // the contents of SR1 are bit- wise ANDed, and the result stored in DR.The
-    // condition codes are set, based on whether the binary value produced,
-    // taken as a 2’s complement integer, is negative, zero,
-    // or positive
-    auto result = operand1 & operand2;
-    set_register(destination_register, result);
+    for (;;) {
+      auto pc = get_register(Register::PC);
+      auto block = m_jit->lookup(pc);
+      if (block == nullptr && m_jit->is_hot(pc)) {
+        block = m_jit->compile(pc, m_memory, m_breakpoints);
+      }
 
-    break;
+      if (block != nullptr) {
+        switch (run_native(block)) {
+        case Jit::Exit::Jump:
+          break;
+        case Jit::Exit::Interpret:
+          if (step<Level>() == ShouldBreak::Yes) {
+            return;
+          }
+          break;
+        case Jit::Exit::CodeWrite:
+          // The store itself already happened in native code.
+          m_jit->flush();
+          break;
+        }
+        continue;
+      }
+
+      // Interpret up to the end of the basic block; entering it again is
+      // what makes it hot.
+      Handler handler;
+      do {
+        handler = fetch(get_register(Register::PC)).handler;
+        if (step<Level>() == ShouldBreak::Yes) {
+          return;
+        }
+      } while (!ends_basic_block(handler));
+    }
   }
-  case OpCode::BR: {
-    dbg("BR Instruction\n");
-    // The condition codes specified by the state of bits [11:9] are tested.
-    /// We could skip masking here since OpCode::BR === 0
-    auto condition_codes = (instruction.data() >> 9) & 07;
+}
 
-    dbg("   Condition codes: " << (const void *)condition_codes << "\n");
+Jit::Exit VirtualMachine::run_native(const void *block) {
+  JitContext context;
+  // Native code keeps the condition codes lazily too, in the same form.
+  context.result = m_result;
+  context.pages = m_memory.pages();
+  context.writable_pages = m_memory.writable_pages();
+  context.decoded = m_decoded.get();
+  m_jit->prepare(context);
+  std::copy_n(m_registers, 8, context.registers);
+  context.instructions = m_instructions;
+  context.limit = m_limit;
+
+  m_jit->enter(context, block);
+
+  std::copy_n(context.registers, 8, m_registers);
+  m_instructions = context.instructions;
+  set_register(Register::PC, context.pc, ShouldUpdateCondition::No);
+  m_result = context.result;
+  return static_cast<Jit::Exit>(context.exit);
+}
 
-    auto condition_flags = get_register(Register::COND);
+VirtualMachine::ShouldBreak VirtualMachine::perform(Instruction instruction) {
+  return perform<TraceLevel::None>(decode(instruction));
+}
 
-    dbg("   Condition flags: " << (const void *)condition_flags << "\n");
+template <TraceLevel Level, Handler H>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_add(DecodedInstruction instruction) {
+  trace<Level>("ADD instruction\n");
+  trace<Level>("   Destination: ", register_name(instruction.destination()),
+               "\n");
+  trace<Level>("   Source 1: ", register_name(instruction.source1()), "\n");
+
+  auto operand1 = get_register(instruction.source1());
+  uint16_t operand2 = 0;
+
+  // If bit [5] is 0, the second source operand is obtained from SR2. If bit
+  // [5] is 1, the second source operand is obtained by sign -
+  // extending the imm5 field to 16 bits.
+  if constexpr (H == Handler::ADD_REG) {
+    trace<Level>("   Register mode: \n");
+    trace<Level>("     Source 2: ", register_name(instruction.source2()), "\n");
+    operand2 = get_register(instruction.source2());
+  } else {
+    trace<Level>("   Immediate mode: \n");
+    trace<Level>("     Source 2: ", instruction.imm, "\n");
+    operand2 = instruction.imm;
+  }
 
-    // If bit [11] is set, N is tested; if bit [11] is clear, N is not
-    // tested. If bit [10] is set, Z is tested, etc. If any of the condition
-    // codes tested is set, the program branches to the location specified
-    // by adding the sign-extended PCoffset9 field to the incremented PC
-    if (condition_codes & condition_flags) {
-      auto pc_offset_9 = instruction.data() & 0x1ff;
-      auto extended = sign_extend(pc_offset_9, 9);
-      dbg("   Branching\n");
-      auto incremented_pc = get_register(Register::PC);
-      dbg("   to " << incremented_pc + extended);
+  uint16_t result = operand1 + operand2;
+  trace<Level>("   Result: ", result, "\n");
 
-      set_register(Register::PC, incremented_pc + extended,
-                   ShouldUpdateCondition::No);
-    }
+  // In both cases,
+  // the second source operand is added to the contents of SR1 and the
+  // result stored in DR. The condition codes are set, based on whether
+  // the result is negative, zero, or positive.
+  set_register(instruction.destination(), result);
 
-    break;
+  return ShouldBreak::No;
+}
+
+template <TraceLevel Level, Handler H>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_and(DecodedInstruction instruction) {
+  trace<Level>("AND instruction\n");
+  trace<Level>("   Destination: ", register_name(instruction.destination()),
+               "\n");
+  trace<Level>("   Source 1: ", register_name(instruction.source1()), "\n");
+
+  auto operand1 = get_register(instruction.source1());
+  uint16_t operand2 = 0;
+
+  // If bit [5] is 0, the second source operand is obtained from SR2.
+  if constexpr (H == Handler::AND_REG) {
+    trace<Level>("   Register mode: \n");
+    trace<Level>("     Source 2: ", register_name(instruction.source2()), "\n");
+    operand2 = get_register(instruction.source2());
+  } else {
+    // If bit [5] is 1, the second source operand is obtained by
+    // sign-extending the imm5 field to 16 bits.
+    trace<Level>("   Immediate mode: \n");
+    trace<Level>("   Source 2: ", instruction.imm, "\n");
+    operand2 = instruction.imm;
   }
-  case OpCode::JMP: {
-    dbg("JMP Instruction\n");
-    // The RET instruction is a special case of the JMP instruction. The PC
-    // is loaded with the contents of R7, which contains the linkage back to
-    // the instruction following the subroutine call instruction.
 
-    Register base_register =
-        register_from_underlying((instruction.data() >> 6) & 0x7);
+  // In either case, the second source operand and
+  // the contents of SR1 are bit- wise ANDed, and the result stored in DR.The
+  // condition codes are set, based on whether the binary value produced,
+  // taken as a 2’s complement integer, is negative, zero,
+  // or positive
+  auto result = operand1 & operand2;
+  set_register(instruction.destination(), result);
 
-    // The program unconditionally jumps to the location specified by the
-    // contents of the base register. Bits [8:6] identify the base register.
-    auto location = get_register(base_register);
-    dbg("   Jumping to: " << (const void *)location << "\n");
+  return ShouldBreak::No;
+}
 
-    set_register(Register::PC, location, ShouldUpdateCondition::No);
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_br(DecodedInstruction instruction) {
+  trace<Level>("BR Instruction\n");
+  // The condition codes specified by the state of bits [11:9] are tested.
+  auto condition_codes = instruction.dr;
 
-    break;
+  trace<Level>("   Condition codes: ", hex(condition_codes), "\n");
+
+  auto condition_flags = get_register(Register::COND);
+
+  trace<Level>("   Condition flags: ", hex(condition_flags), "\n");
+
+  // If bit [11] is set, N is tested; if bit [11] is clear, N is not
+  // tested. If bit [10] is set, Z is tested, etc. If any of the condition
+  // codes tested is set, the program branches to the location specified
+  // by adding the sign-extended PCoffset9 field to the incremented PC
+  bool taken = condition_codes & condition_flags;
+  if constexpr (Level >= TraceLevel::Profile) {
+    m_profile->branch(get_register(Register::PC) - 1, taken);
   }
-  case OpCode::JSR: {
-    dbg("JSR instruction\n");
+  if (taken) {
+    trace<Level>("   Branching\n");
+    auto incremented_pc = get_register(Register::PC);
+    trace<Level>("   to ", incremented_pc + instruction.imm);
 
-    // First, the incremented PC is saved in R7.
-    // This is the linkage back to the calling
-    // routine.
-    set_register(Register::R7, get_register(Register::PC),
+    set_register(Register::PC, incremented_pc + instruction.imm,
                  ShouldUpdateCondition::No);
+  }
 
-    auto bit = (instruction.data() >> 11) & 0b1;
-    auto address = 0;
-
-    // The address of the subroutine is obtained from the base register (if bit
-    // [11] is 0), or the address is computed by sign-extending bits [10:0] and
-    // adding this value to the incremented PC (if bit [11] is 1)
-    if (bit == 0) {
-      Register base_register =
-          register_from_underlying((instruction.data() >> 6) & 0x7);
-      address = get_register(base_register);
-      dbg("   Obtained address from base: " << register_name(base_register)
-                                            << "\n");
-    } else {
-      auto pc_offset_11 = instruction.data() & 0x7ff;
-      auto extended = sign_extend(pc_offset_11, 11);
-      dbg("   Obtained address from offset: " << pc_offset_11 << "\n");
-      address = get_register(Register::PC) + extended;
-    }
-    dbg("   Jumping to " << (const void *)address << "\n");
+  return ShouldBreak::No;
+}
 
-    // Then the PC is loaded with the address of the first instruction
-    // of the subroutine, causing an unconditional jump to that address.
-    set_register(Register::PC, address, ShouldUpdateCondition::No);
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_jmp(DecodedInstruction instruction) {
+  trace<Level>("JMP Instruction\n");
+  // The RET instruction is a special case of the JMP instruction. The PC
+  // is loaded with the contents of R7, which contains the linkage back to
+  // the instruction following the subroutine call instruction.
 
-    break;
+  // The program unconditionally jumps to the location specified by the
+  // contents of the base register. Bits [8:6] identify the base register.
+  auto location = get_register(instruction.source1());
+  trace<Level>("   Jumping to: ", hex(location), "\n");
+
+  set_register(Register::PC, location, ShouldUpdateCondition::No);
+
+  return ShouldBreak::No;
+}
+
+template <TraceLevel Level, Handler H>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_jsr(DecodedInstruction instruction) {
+  trace<Level>("JSR instruction\n");
+
+  // First, the incremented PC is saved in R7.
+  // This is the linkage back to the calling
+  // routine.
+  set_register(Register::R7, get_register(Register::PC),
+               ShouldUpdateCondition::No);
+
+  uint16_t address = 0;
+
+  // The address of the subroutine is obtained from the base register (if bit
+  // [11] is 0), or the address is computed by sign-extending bits [10:0] and
+  // adding this value to the incremented PC (if bit [11] is 1)
+  if constexpr (H == Handler::JSRR) {
+    address = get_register(instruction.source1());
+    trace<Level>("   Obtained address from base: ",
+                 register_name(instruction.source1()), "\n");
+  } else {
+    trace<Level>("   Obtained address from offset: ", instruction.imm, "\n");
+    address = get_register(Register::PC) + instruction.imm;
   }
-  case OpCode::LD: {
-    dbg("LD instruction\n");
-    Register destination_register =
-        register_from_underlying((instruction.data() >> 9) & 0x7);
+  trace<Level>("   Jumping to ", hex(address), "\n");
 
-    dbg("   Destination: " << register_name(destination_register) << "\n");
+  // Then the PC is loaded with the address of the first instruction
+  // of the subroutine, causing an unconditional jump to that address.
+  set_register(Register::PC, address, ShouldUpdateCondition::No);
 
-    // An address is computed by sign-extending bits [8:0] to 16 bits and adding
-    // this value to the incremented PC.
-    auto pc_offset_9 = instruction.data() & 0x1ff;
-    auto extended = sign_extend(pc_offset_9, 9);
-    auto address = get_register(Register::PC) + extended;
+  return ShouldBreak::No;
+}
 
-    // The contents of memory at this address are loaded into DR.
-    // The condition codes are set, based on whether the value loaded is
-    // negative, zero, or positive
-    set_register(destination_register, read_memory(address));
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_ld(DecodedInstruction instruction) {
+  trace<Level>("LD instruction\n");
+  trace<Level>("   Destination: ", register_name(instruction.destination()),
+               "\n");
 
-    break;
-  }
-  case OpCode::LDI: {
-    dbg("LDI instruction\n");
-    Register destination_register =
-        register_from_underlying((instruction.data() >> 9) & 0x07);
+  // An address is computed by sign-extending bits [8:0] to 16 bits and adding
+  // this value to the incremented PC.
+  uint16_t address = get_register(Register::PC) + instruction.imm;
 
-    dbg("   Destination: " << register_name(destination_register) << "\n");
+  // The contents of memory at this address are loaded into DR.
+  // The condition codes are set, based on whether the value loaded is
+  // negative, zero, or positive
+  set_register(instruction.destination(), load<Level>(address));
 
-    // An address is computed by sign-extending bits [8:0] to 16 bits and
-    // adding this value to the incremented PC.
-    auto pc_offset_9 = instruction.data() & 0x1ff;
-    auto extended = sign_extend(pc_offset_9, 9);
-    auto incremented_pc = get_register(Register::PC);
-    auto indirect_address = extended + incremented_pc;
+  return ShouldBreak::No;
+}
 
-    dbg("   Indirect address: " << (const void *)indirect_address << "\n");
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_ldi(DecodedInstruction instruction) {
+  trace<Level>("LDI instruction\n");
+  trace<Level>("   Destination: ", register_name(instruction.destination()),
+               "\n");
 
-    // What is stored in memory at this address is the
-    // address of the data to be loaded into DR.
-    auto final_address = read_memory(indirect_address);
+  // An address is computed by sign-extending bits [8:0] to 16 bits and
+  // adding this value to the incremented PC.
+  auto incremented_pc = get_register(Register::PC);
+  uint16_t indirect_address = instruction.imm + incremented_pc;
 
-    dbg("   Final address: " << final_address << "\n");
+  trace<Level>("   Indirect address: ", hex(indirect_address), "\n");
 
-    // The condition codes are set,
-    // based on whether the value loaded is negative, zero, or positive.
-    set_register(destination_register, read_memory(final_address));
+  // What is stored in memory at this address is the
+  // address of the data to be loaded into DR.
+  auto final_address = load<Level>(indirect_address);
 
-    dbg("   Result: " << get_register(destination_register) << "\n");
+  trace<Level>("   Final address: ", final_address, "\n");
 
-    break;
-  }
-  case OpCode::LDR: {
-    dbg("LDR Instruction\n");
-    Register destination_register =
-        register_from_underlying((instruction.data() >> 9) & 07);
+  // The condition codes are set,
+  // based on whether the value loaded is negative, zero, or positive.
+  set_register(instruction.destination(), load<Level>(final_address));
 
-    dbg("   Destination: " << register_name(destination_register) << "\n");
+  trace<Level>("   Result: ", get_register(instruction.destination()), "\n");
 
-    Register base_register =
-        register_from_underlying((instruction.data() >> 6) & 07);
+  return ShouldBreak::No;
+}
 
-    dbg("   Base register: " << register_name(base_register) << "\n");
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_ldr(DecodedInstruction instruction) {
+  trace<Level>("LDR Instruction\n");
+  trace<Level>("   Destination: ", register_name(instruction.destination()),
+               "\n");
+  trace<Level>("   Base register: ", register_name(instruction.source1()),
+               "\n");
 
-    // An address is computed by sign-extending bits [5:0] to 16 bits and
-    // adding this value to the contents of the register specified by bits
-    // [8:6].
-    auto offset_6 = instruction.data() & 077;
-    auto extended = sign_extend(offset_6, 6);
-    auto address = get_register(base_register) + extended;
+  // An address is computed by sign-extending bits [5:0] to 16 bits and
+  // adding this value to the contents of the register specified by bits
+  // [8:6].
+  uint16_t address = get_register(instruction.source1()) + instruction.imm;
 
-    dbg("   Computed address: " << (const void *)address << "\n");
+  trace<Level>("   Computed address: ", hex(address), "\n");
 
-    // The contents of memory at this address are loaded into DR.The
-    // condition codes are set, based on whether the value loaded is
-    // negative, zero, or positive.
-    set_register(destination_register, read_memory(address));
+  // The contents of memory at this address are loaded into DR.The
+  // condition codes are set, based on whether the value loaded is
+  // negative, zero, or positive.
+  set_register(instruction.destination(), load<Level>(address));
 
-    break;
-  }
-  case OpCode::LEA: {
-    dbg("LEA Instruction\n");
-    Register destination_register =
-        register_from_underlying((instruction.data() >> 9) & 07);
+  return ShouldBreak::No;
+}
 
-    dbg("   Destination: " << register_name(destination_register) << "\n");
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_lea(DecodedInstruction instruction) {
+  trace<Level>("LEA Instruction\n");
+  trace<Level>("   Destination: ", register_name(instruction.destination()),
+               "\n");
 
-    // An address is computed by sign-extending bits [8:0] to 16 bits and adding
-    // this value to the incremented PC.
-    auto pc_offset_9 = instruction.data() & 0x1ff;
-    auto extended = sign_extend(pc_offset_9, 9);
-    auto address = get_register(Register::PC) + extended;
+  // An address is computed by sign-extending bits [8:0] to 16 bits and adding
+  // this value to the incremented PC.
+  uint16_t address = get_register(Register::PC) + instruction.imm;
 
-    // This address is loaded into DR. The
-    // condition codes are set, based on whether the value loaded is negative,
-    // zero, or positive.
-    set_register(destination_register, address);
+  // This address is loaded into DR. The
+  // condition codes are set, based on whether the value loaded is negative,
+  // zero, or positive.
+  set_register(instruction.destination(), address);
 
-    break;
-  }
-  case OpCode::NOT: {
-    dbg("NOT Instruction\n");
-    Register destination_register =
-        register_from_underlying((instruction.data() >> 9) & 0x7);
+  return ShouldBreak::No;
+}
 
-    Register source_register =
-        register_from_underlying((instruction.data() >> 6) & 0x7);
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_not(DecodedInstruction instruction) {
+  trace<Level>("NOT Instruction\n");
+  trace<Level>("   Destination: ", register_name(instruction.destination()),
+               "\n");
+  trace<Level>("   Source: ", register_name(instruction.source1()), "\n");
 
-    dbg("   Destination: " << register_name(destination_register) << "\n");
-    dbg("   Source: " << register_name(source_register) << "\n");
+  // The bit-wise complement of the contents of SR is stored in DR.
+  auto complement = ~get_register(instruction.source1());
 
-    // The bit-wise complement of the contents of SR is stored in DR.
-    auto complement = ~get_register(source_register);
+  // The condition codes are set, based on whether the binary value produced,
+  // taken as a 2’s complement integer, is negative, zero, or positive.
+  set_register(instruction.destination(), complement);
 
-    // The condition codes are set, based on whether the binary value produced,
-    // taken as a 2’s complement integer, is negative, zero, or positive.
-    set_register(destination_register, complement);
+  return ShouldBreak::No;
+}
 
-    break;
-  }
-  case OpCode::RTI:
-    dbg("Unused opcode");
-    break;
-  case OpCode::STI: {
-    dbg("STI Instruction\n");
-    Register source_register =
-        register_from_underlying((instruction.data() >> 9) & 0x7);
-
-    dbg("   Source: " << register_name(source_register) << "\n");
-
-    // The contents of the register specified by SR are stored in the memory
-    // location whose address is obtained as follows: Bits [8:0] are
-    // sign-extended to 16 bits and added to the incremented PC.
-    // What is in memory at this address is the address of the location to
-    // which the data in SR is stored
-    // NOTE: We follow mem[mem[PC † + SEXT(PCoffset9)]] = SR;
-    auto pc_offset_9 = instruction.data() & 0x1ff;
-    auto extended = sign_extend(pc_offset_9, 9);
-    auto address = read_memory(get_register(Register::PC) + extended);
-    auto contents = get_register(source_register);
-
-    write_memory(address, contents);
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_sti(DecodedInstruction instruction) {
+  trace<Level>("STI Instruction\n");
+  trace<Level>("   Source: ", register_name(instruction.destination()), "\n");
 
-    break;
-  }
-  case OpCode::ST: {
-    dbg("ST Instruction\n");
+  // The contents of the register specified by SR are stored in the memory
+  // location whose address is obtained as follows: Bits [8:0] are
+  // sign-extended to 16 bits and added to the incremented PC.
+  // What is in memory at this address is the address of the location to
+  // which the data in SR is stored
+  // NOTE: We follow mem[mem[PC † + SEXT(PCoffset9)]] = SR;
+  auto address = load<Level>(get_register(Register::PC) + instruction.imm);
+  auto contents = get_register(instruction.destination());
 
-    Register source_register =
-        register_from_underlying((instruction.data() >> 9) & 0x7);
+  store<Level>(address, contents);
 
-    dbg("   Source: " << register_name(source_register) << "\n");
+  return ShouldBreak::No;
+}
 
-    // The contents of the register specified by SR are stored in the memory
-    // location whose address is computed by sign-extending bits [8:0] to 16
-    // bits and adding this value to the incremented PC.
-    auto pc_offset_9 = instruction.data() & 0x1ff;
-    auto extended = sign_extend(pc_offset_9, 9);
-    auto address = get_register(Register::PC) + extended;
-    auto contents = get_register(source_register);
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_st(DecodedInstruction instruction) {
+  trace<Level>("ST Instruction\n");
+  trace<Level>("   Source: ", register_name(instruction.destination()), "\n");
 
-    write_memory(address, contents);
+  // The contents of the register specified by SR are stored in the memory
+  // location whose address is computed by sign-extending bits [8:0] to 16
+  // bits and adding this value to the incremented PC.
+  uint16_t address = get_register(Register::PC) + instruction.imm;
+  auto contents = get_register(instruction.destination());
 
-    break;
-  }
-  case OpCode::STR: {
-    dbg("STR Instruction\n");
-    Register source_register =
-        register_from_underlying((instruction.data() >> 9) & 0x7);
+  store<Level>(address, contents);
 
-    dbg("   Source: " << register_name(source_register) << "\n");
+  return ShouldBreak::No;
+}
 
-    Register base_register =
-        register_from_underlying((instruction.data() >> 6) & 0x7);
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_str(DecodedInstruction instruction) {
+  trace<Level>("STR Instruction\n");
+  trace<Level>("   Source: ", register_name(instruction.destination()), "\n");
+  trace<Level>("   Base: ", register_name(instruction.source1()), "\n");
 
-    dbg("   Base: " << register_name(base_register) << "\n");
+  // The contents of the register specified by SR are stored in the memory
+  // location whose address is computed by sign-extending bits [5:0] to 16
+  // bits and adding this value to the contents of the register specified
+  // by bits [8:6]
+  uint16_t address = get_register(instruction.source1()) + instruction.imm;
 
-    // The contents of the register specified by SR are stored in the memory
-    // location whose address is computed by sign-extending bits [5:0] to 16
-    // bits and adding this value to the contents of the register specified
-    // by bits [8:6]
-    auto offset_6 = instruction.data() & 077;
-    auto extended = sign_extend(offset_6, 6);
-    auto address = get_register(base_register) + extended;
+  store<Level>(address, get_register(instruction.destination()));
 
-    write_memory(address, get_register(source_register));
+  return ShouldBreak::No;
+}
 
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_trap(DecodedInstruction instruction) {
+  trace<Level>("TRAP Instruction\n");
+
+  // NOTE: The decoder masks trap_vector_8 to only consider the lower
+  // 8 bits, so it is already zero extended to 16 bits.
+  uint16_t trap_vector_8 = instruction.imm;
+  switch (m_trap_kinds[trap_vector_8]) {
+  case TrapKind::Builtin:
     break;
+  case TrapKind::Native: {
+    trace<Level>("Native trap ", hex(trap_vector_8), "\n");
+    auto reason = m_trap_handlers[trap_vector_8](*this);
+    if (reason) {
+      m_exit_reason = *reason;
+      return ShouldBreak::Yes;
+    }
+    return ShouldBreak::No;
   }
-  case OpCode::TRAP: {
-    dbg("TRAP Instruction\n");
-
+  case TrapKind::Guest:
     // First R7 is loaded with the incremented PC.
     // (This enables a return to the
     // instruction physically following the TRAP instruction in the original
     // program after the service routine has completed execution.)
-    // set_register(Register::R7, get_register(Register::PC),
-    // ShouldUpdateCondition::No);
-
-    /// The starting address is contained in the memory
-    // location whose address is obtained by zero-extending
-    // trapvector8 to 16 bits
-    uint16_t trap_vector_8 = instruction.data() & 0xff;
-    // NOTE: Since we mask trap_vector_8 to only consider the lower
-    // 8 bits, we already have zero extended it to 16 bits.
-    uint16_t starting_address = read_memory(trap_vector_8);
-
-    Trap trap = trap_from_underlying(trap_vector_8);
-
+    set_register(Register::R7, get_register(Register::PC),
+                 ShouldUpdateCondition::No);
     // Then the PC is loaded with the starting address of the
-    // system call specified by trapvector8.
-    // set_register(Register::PC, starting_address,
-    // ShouldUpdateCondition::No);
-    switch (trap) {
-    case Trap::GETC: {
-      std::cout << "Trap::GETC\n";
-      // Read a single character from the keyboard. The character
-      // is not echoed onto the console. Its ASCII code is copied
-      // into R0. The high eight bits of R0 are cleared.
-      char ch;
-      std::cin >> ch;
-      uint16_t value = ch;
-
-      set_register(Register::R0, value);
+    // system call specified by trapvector8. The starting address is
+    // contained in the memory location whose address is obtained by
+    // zero-extending trapvector8 to 16 bits.
+    set_register(Register::PC, load<Level>(trap_vector_8),
+                 ShouldUpdateCondition::No);
+    return ShouldBreak::No;
+  case TrapKind::Invalid:
+    throw InvalidTrap();
+  }
 
-      break;
-    }
-    case Trap::OUT_: {
-      std::cout << "Trap::OUT\n";
-      // Write a character in R0[7:0] to the console display.
-      auto r0 = get_register(Register::R0);
-      char character = r0 & 0xff;
-      std::cout << "OUT: " << character << std::endl;
-      break;
-    }
-    case Trap::PUTS: {
-      std::cout << "Trap::PUTS\n";
-      // Write a string of ASCII characters to the console display.
-      // The characters are contained
-      // in consecutive memory locations, one character per memory
-      // location, starting with the address specified in R0.
-      // Writing terminates with the occurrence of x0000 in a
-      // memory location
-      auto address = get_register(Register::R0);
-      char16_t current_char;
-      while (current_char = read_memory(address), current_char != '\0') {
-        std::cout << static_cast<char>(current_char);
-        address++;
-      }
-      break;
+  switch (static_cast<Trap>(trap_vector_8)) {
+  case Trap::GETC: {
+    trace<Level>("Trap::GETC\n");
+    // Read a single character from the keyboard. The character
+    // is not echoed onto the console. Its ASCII code is copied
+    // into R0. The high eight bits of R0 are cleared.
+    // Whatever the program printed so far must be visible before it waits
+    // on the keyboard.
+    m_output->flush();
+    if (!trap_input_ready()) {
+      return wait_for_input<Level>();
     }
-    case Trap::IN_: {
-      std::cout << "Trap::IN\n";
-      // Print a prompt on the screen and read a single character
-      // from the keyboard. The character is echoed onto the
-      // console monitor, and its ASCII code is copied into R0. The
-      // high eight bits of R0 are cleared.
-      std::cout << "> ";
-      char ch;
-      std::cin >> ch;
-      std::cout << ch << std::flush;
-      uint16_t value = ch;
-      set_register(Register::R0, ch);
+    uint16_t value = take_key(InputEvent::GETC);
 
-      break;
-    }
-    case Trap::PUTSP: {
-      std::cout << "Trap::PUTSP\n";
-      // Write a string of ASCII characters to the console. The
-      // characters are contained in consecutive memory locations,
-      // two characters per memory location, starting with the
-      // address specified in R0.
-      auto address = get_register(Register::R0);
-      uint16_t current;
-      // Writing terminates with the occurrence of x0000 in a
-      // memory location
-      while (current = read_memory(address), current != 0) {
-        // The ASCII code contained in bits [7:0] of a memory
-        // location is written to the console first.
-        char ch = current & 0xff;
-
-        std::cout << ch << std::flush;
-
-        // Then the ASCII code contained in bits [15:8] of
-        // that memory location is written to the console.
-        // A character string
-        // consisting of an odd number of characters to be written
-        // will have x00 in bits [15:8] of the memory location
-        // containing the last character to be written.)
-        ch = (current >> 8);
-        if (ch == 0)
-          continue;
-        dbg(ch);
-      }
+    set_register(Register::R0, value);
 
-      break;
+    break;
+  }
+  case Trap::OUT_: {
+    trace<Level>("Trap::OUT\n");
+    // Write a character in R0[7:0] to the console display.
+    auto r0 = get_register(Register::R0);
+    char character = r0 & 0xff;
+    *m_output << character;
+    break;
+  }
+  case Trap::PUTS: {
+    trace<Level>("Trap::PUTS\n");
+    // Write a string of ASCII characters to the console display.
+    // The characters are contained
+    // in consecutive memory locations, one character per memory
+    // location, starting with the address specified in R0.
+    // Writing terminates with the occurrence of x0000 in a
+    // memory location
+    auto address = get_register(Register::R0);
+    char16_t current_char;
+    while (current_char = read_memory(address), current_char != '\0') {
+      *m_output << static_cast<char>(current_char);
+      address++;
     }
-    case Trap::HALT: {
-      std::cout << "Trap::HALT\n";
-      // Halt execution and print a message on the console.
-      std::cout << "Program halted." << std::endl;
-      std::exit(1);
-      break;
+    break;
+  }
+  case Trap::IN_: {
+    trace<Level>("Trap::IN\n");
+    // Print a prompt on the screen and read a single character
+    // from the keyboard. The character is echoed onto the
+    // console monitor, and its ASCII code is copied into R0. The
+    // high eight bits of R0 are cleared.
+    if (!trap_input_ready()) {
+      m_output->flush();
+      return wait_for_input<Level>();
     }
+    *m_output << "> " << std::flush;
+    auto ch = take_key(InputEvent::IN);
+    *m_output << static_cast<char>(ch);
+    set_register(Register::R0, ch);
+
+    break;
+  }
+  case Trap::PUTSP: {
+    trace<Level>("Trap::PUTSP\n");
+    // Write a string of ASCII characters to the console. The
+    // characters are contained in consecutive memory locations,
+    // two characters per memory location, starting with the
+    // address specified in R0.
+    auto address = get_register(Register::R0);
+    uint16_t current;
+    // Writing terminates with the occurrence of x0000 in a
+    // memory location
+    while (current = read_memory(address), current != 0) {
+      // The ASCII code contained in bits [7:0] of a memory
+      // location is written to the console first.
+      char ch = current & 0xff;
+
+      *m_output << ch;
+
+      // Then the ASCII code contained in bits [15:8] of
+      // that memory location is written to the console.
+      // A character string
+      // consisting of an odd number of characters to be written
+      // will have x00 in bits [15:8] of the memory location
+      // containing the last character to be written.)
+      ch = (current >> 8);
+      if (ch != 0) {
+        *m_output << ch;
+      }
+      address++;
     }
 
     break;
   }
-  default:
-    dbg("Bad Opcode" << "\n");
+  case Trap::HALT: {
+    trace<Level>("Trap::HALT\n");
+    // Halt execution and print a message on the console.
+    *m_output << "Program halted.\n";
+    m_exit_reason = ExitReason::Halted;
     return ShouldBreak::Yes;
   }
+  }
+
+  return ShouldBreak::No;
+}
 
-  // FIXME: Break correctly
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_rti(DecodedInstruction instruction) {
+  trace<Level>("Unused opcode");
   return ShouldBreak::No;
 }
 
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_break(DecodedInstruction instruction) {
+  uint16_t pc = get_register(Register::PC) - 1;
+  if (pc != m_resume_from) {
+    trace<Level>("Breakpoint at ", hex(pc), "\n");
+    back_out<Level>(pc);
+    m_exit_reason = ExitReason::Breakpoint;
+    return ShouldBreak::Yes;
+  }
+  // Only once: coming back round to it stops the machine again.
+  m_resume_from = NO_BREAKPOINT;
+  return perform<Level>(decode(Instruction(m_memory.read(pc))));
+}
+
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_res(DecodedInstruction instruction) {
+  trace<Level>("Bad Opcode", "\n");
+  m_exit_reason = ExitReason::BadOpcode;
+  return ShouldBreak::Yes;
+}
+
+template <TraceLevel Level, Handler H>
+VirtualMachine::ShouldBreak
+VirtualMachine::op_fused(DecodedInstruction instruction) {
+  // None of the fused instructions can stop the machine, so running them
+  // back to back is exactly what dispatching them one by one would do.
+  if constexpr (H == Handler::AND_ADD) {
+    op_and<Level, Handler::AND_IMM>(instruction);
+    op_add<Level, Handler::ADD_IMM>(next_in_group<Level>(Handler::ADD_IMM));
+  } else if constexpr (H == Handler::LDR_ADD_STR) {
+    op_ldr<Level>(instruction);
+    op_add<Level, Handler::ADD_IMM>(next_in_group<Level>(Handler::ADD_IMM));
+    op_str<Level>(next_in_group<Level>(Handler::STR));
+  } else {
+    if constexpr (H == Handler::ADD_REG_BR) {
+      op_add<Level, Handler::ADD_REG>(instruction);
+    } else if constexpr (H == Handler::ADD_IMM_BR) {
+      op_add<Level, Handler::ADD_IMM>(instruction);
+    } else {
+      static_assert(H == Handler::NOT_BR);
+      op_not<Level>(instruction);
+    }
+    op_br<Level>(next_in_group<Level>(Handler::BR));
+  }
+  return ShouldBreak::No;
+}
+
+template <TraceLevel Level>
+DecodedInstruction VirtualMachine::next_in_group(Handler handler) {
+  auto pc = get_register(Register::PC);
+  set_register(Register::PC, pc + 1, ShouldUpdateCondition::No);
+  m_instructions++;
+  observe<Level>(pc);
+  trace<Level, TraceLevel::Opcode>(hex(pc), " ", handler_name(handler), "\n");
+  // fuse_at() decoded the whole group, and changing any word of it would
+  // have dropped the fused record.
+  return m_decoded[pc];
+}
+
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak
+VirtualMachine::perform(DecodedInstruction instruction) {
+  trace<Level, TraceLevel::Opcode>(hex(get_register(Register::PC) - 1), " ",
+                                   handler_name(instruction.handler), "\n");
+  switch (instruction.handler) {
+  case Handler::BR:
+    return op_br<Level>(instruction);
+  case Handler::ADD_REG:
+    return op_add<Level, Handler::ADD_REG>(instruction);
+  case Handler::ADD_IMM:
+    return op_add<Level, Handler::ADD_IMM>(instruction);
+  case Handler::LD:
+    return op_ld<Level>(instruction);
+  case Handler::ST:
+    return op_st<Level>(instruction);
+  case Handler::JSR:
+    return op_jsr<Level, Handler::JSR>(instruction);
+  case Handler::JSRR:
+    return op_jsr<Level, Handler::JSRR>(instruction);
+  case Handler::AND_REG:
+    return op_and<Level, Handler::AND_REG>(instruction);
+  case Handler::AND_IMM:
+    return op_and<Level, Handler::AND_IMM>(instruction);
+  case Handler::LDR:
+    return op_ldr<Level>(instruction);
+  case Handler::STR:
+    return op_str<Level>(instruction);
+  case Handler::RTI:
+    return op_rti<Level>(instruction);
+  case Handler::NOT:
+    return op_not<Level>(instruction);
+  case Handler::LDI:
+    return op_ldi<Level>(instruction);
+  case Handler::STI:
+    return op_sti<Level>(instruction);
+  case Handler::JMP:
+    return op_jmp<Level>(instruction);
+  case Handler::LEA:
+    return op_lea<Level>(instruction);
+  case Handler::TRAP:
+    return op_trap<Level>(instruction);
+  case Handler::AND_ADD:
+    return op_fused<Level, Handler::AND_ADD>(instruction);
+  case Handler::ADD_REG_BR:
+    return op_fused<Level, Handler::ADD_REG_BR>(instruction);
+  case Handler::ADD_IMM_BR:
+    return op_fused<Level, Handler::ADD_IMM_BR>(instruction);
+  case Handler::NOT_BR:
+    return op_fused<Level, Handler::NOT_BR>(instruction);
+  case Handler::LDR_ADD_STR:
+    return op_fused<Level, Handler::LDR_ADD_STR>(instruction);
+  case Handler::BREAK:
+    return op_break<Level>(instruction);
+  case Handler::RES:
+  default:
+    return op_res<Level>(instruction);
+  }
+}
+
+template <TraceLevel Level> void VirtualMachine::execute_threaded() {
+#if defined(__GNUC__)
+  // Indexed by Handler. Every handler fetches the next instruction and jumps
+  // straight to its handler, so each one gets its own indirect branch for the
+  // predictor to learn instead of all of them sharing the one in perform().
+  static void *const handlers[] = {
+      &&handle_undecoded, &&handle_br, &&handle_add_reg, &&handle_add_imm,
+      &&handle_ld, &&handle_st, &&handle_jsr, &&handle_jsrr, &&handle_and_reg,
+      &&handle_and_imm, &&handle_ldr, &&handle_str, &&handle_rti, &&handle_not,
+      &&handle_ldi, &&handle_sti, &&handle_jmp, &&handle_res, &&handle_lea,
+      &&handle_trap, &&handle_and_add, &&handle_add_reg_br,
+      &&handle_add_imm_br, &&handle_not_br, &&handle_ldr_add_str,
+      &&handle_break,
+  };
+  static_assert(std::size(handlers) == to_underlying(Handler::COUNT));
+
+  DecodedInstruction instruction;
+
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    auto pc = get_register(Register::PC);                                      \
+    if (pc + 1 >= VirtualMachine::MEMORY_MAX) {                                \
+      m_exit_reason = ExitReason::EndOfMemory;                                 \
+      return;                                                                  \
+    }                                                                          \
+    instruction = fetch(pc);                                                   \
+    if (budget_spent(instruction, pc)) {                                       \
+      return;                                                                  \
+    }                                                                          \
+    set_register(Register::PC, pc + 1, ShouldUpdateCondition::No);             \
+    m_instructions++;                                                          \
+    observe<Level>(pc);                                                        \
+    trace<Level, TraceLevel::Opcode>(hex(pc), " ",                             \
+                                     handler_name(instruction.handler), "\n"); \
+    goto *handlers[to_underlying(instruction.handler)];                        \
+  } while (0)
+
+  DISPATCH();
+handle_br:
+  op_br<Level>(instruction);
+  DISPATCH();
+handle_add_reg:
+  op_add<Level, Handler::ADD_REG>(instruction);
+  DISPATCH();
+handle_add_imm:
+  op_add<Level, Handler::ADD_IMM>(instruction);
+  DISPATCH();
+handle_ld:
+  op_ld<Level>(instruction);
+  DISPATCH();
+handle_st:
+  op_st<Level>(instruction);
+  DISPATCH();
+handle_jsr:
+  op_jsr<Level, Handler::JSR>(instruction);
+  DISPATCH();
+handle_jsrr:
+  op_jsr<Level, Handler::JSRR>(instruction);
+  DISPATCH();
+handle_and_reg:
+  op_and<Level, Handler::AND_REG>(instruction);
+  DISPATCH();
+handle_and_imm:
+  op_and<Level, Handler::AND_IMM>(instruction);
+  DISPATCH();
+handle_ldr:
+  op_ldr<Level>(instruction);
+  DISPATCH();
+handle_str:
+  op_str<Level>(instruction);
+  DISPATCH();
+handle_rti:
+  op_rti<Level>(instruction);
+  DISPATCH();
+handle_not:
+  op_not<Level>(instruction);
+  DISPATCH();
+handle_ldi:
+  op_ldi<Level>(instruction);
+  DISPATCH();
+handle_sti:
+  op_sti<Level>(instruction);
+  DISPATCH();
+handle_jmp:
+  op_jmp<Level>(instruction);
+  DISPATCH();
+handle_lea:
+  op_lea<Level>(instruction);
+  DISPATCH();
+handle_trap:
+  if (op_trap<Level>(instruction) == ShouldBreak::Yes)
+    return;
+  DISPATCH();
+handle_and_add:
+  op_fused<Level, Handler::AND_ADD>(instruction);
+  DISPATCH();
+handle_add_reg_br:
+  op_fused<Level, Handler::ADD_REG_BR>(instruction);
+  DISPATCH();
+handle_add_imm_br:
+  op_fused<Level, Handler::ADD_IMM_BR>(instruction);
+  DISPATCH();
+handle_not_br:
+  op_fused<Level, Handler::NOT_BR>(instruction);
+  DISPATCH();
+handle_ldr_add_str:
+  op_fused<Level, Handler::LDR_ADD_STR>(instruction);
+  DISPATCH();
+handle_break:
+  if (op_break<Level>(instruction) == ShouldBreak::Yes)
+    return;
+  DISPATCH();
+handle_res:
+handle_undecoded:
+  op_res<Level>(instruction);
+  return;
+
+#undef DISPATCH
+#else
+  // Without computed goto (MSVC) fall back to call threading: the handler is
+  // still picked with one indexed load instead of the switch.
+  using Operation = ShouldBreak (VirtualMachine::*)(DecodedInstruction);
+  static constexpr Operation operations[] = {
+      &VirtualMachine::op_res<Level>,
+      &VirtualMachine::op_br<Level>,
+      &VirtualMachine::op_add<Level, Handler::ADD_REG>,
+      &VirtualMachine::op_add<Level, Handler::ADD_IMM>,
+      &VirtualMachine::op_ld<Level>,
+      &VirtualMachine::op_st<Level>,
+      &VirtualMachine::op_jsr<Level, Handler::JSR>,
+      &VirtualMachine::op_jsr<Level, Handler::JSRR>,
+      &VirtualMachine::op_and<Level, Handler::AND_REG>,
+      &VirtualMachine::op_and<Level, Handler::AND_IMM>,
+      &VirtualMachine::op_ldr<Level>,
+      &VirtualMachine::op_str<Level>,
+      &VirtualMachine::op_rti<Level>,
+      &VirtualMachine::op_not<Level>,
+      &VirtualMachine::op_ldi<Level>,
+      &VirtualMachine::op_sti<Level>,
+      &VirtualMachine::op_jmp<Level>,
+      &VirtualMachine::op_res<Level>,
+      &VirtualMachine::op_lea<Level>,
+      &VirtualMachine::op_trap<Level>,
+      &VirtualMachine::op_fused<Level, Handler::AND_ADD>,
+      &VirtualMachine::op_fused<Level, Handler::ADD_REG_BR>,
+      &VirtualMachine::op_fused<Level, Handler::ADD_IMM_BR>,
+      &VirtualMachine::op_fused<Level, Handler::NOT_BR>,
+      &VirtualMachine::op_fused<Level, Handler::LDR_ADD_STR>,
+      &VirtualMachine::op_break<Level>,
+  };
+  static_assert(std::size(operations) == to_underlying(Handler::COUNT));
+
+  for (;;) {
+    auto pc = get_register(Register::PC);
+    if (pc + 1 >= VirtualMachine::MEMORY_MAX) {
+      m_exit_reason = ExitReason::EndOfMemory;
+      return;
+    }
+    auto instruction = fetch(pc);
+    if (budget_spent(instruction, pc)) {
+      return;
+    }
+    set_register(Register::PC, pc + 1, ShouldUpdateCondition::No);
+    m_instructions++;
+    observe<Level>(pc);
+    trace<Level, TraceLevel::Opcode>(hex(pc), " ",
+                                     handler_name(instruction.handler), "\n");
+    auto operation = operations[to_underlying(instruction.handler)];
+    if ((this->*operation)(instruction) == ShouldBreak::Yes)
+      return;
+  }
+#endif
+}
+
 Instruction VirtualMachine::current_instruction() {
   auto opcode_value = read_memory(m_registers[to_underlying(Register::PC)]);
   return {opcode_value};
 }
 
+DecodedInstruction VirtualMachine::fetch(uint16_t address) {
+  auto &decoded = m_decoded[address];
+  if (decoded.handler == Handler::Undecoded) [[unlikely]] {
+    // Fetching is not a read a watchpoint should see, but the keyboard
+    // registers still behave as devices.
+    decoded = decode(Instruction(address == MemoryMappedRegister::KBSR
+                                     ? read_memory(address)
+                                     : m_memory.read(address)));
+    if (has_breakpoint(address)) {
+      decoded.handler = Handler::BREAK;
+    } else {
+      fuse_at(address);
+    }
+  }
+  return decoded;
+}
+
+void VirtualMachine::fuse_at(uint16_t address) {
+  if (m_watched_pages != 0) {
+    return;
+  }
+  DecodedInstruction group[MAX_FUSED_LENGTH] = {m_decoded[address]};
+  size_t length = 1;
+  // Groups stop short of the device registers, so decoding the rest of the
+  // group straight from memory has no side effects.
+  while (length < MAX_FUSED_LENGTH &&
+         address + length < MemoryMappedRegister::KBSR &&
+         !has_breakpoint(address + length)) {
+    group[length] = decode(Instruction(m_memory.read(address + length)));
+    length++;
+  }
+
+  auto handler = fuse(group, length);
+  if (handler == group[0].handler) {
+    return;
+  }
+  for (size_t i = 1; i < fused_length(handler); i++) {
+    auto &record = m_decoded[address + i];
+    if (record.handler == Handler::Undecoded) {
+      record = group[i];
+    }
+  }
+  m_decoded[address].handler = handler;
+}
+
+bool VirtualMachine::key_ready() {
+  if (m_replay != nullptr) {
+    return m_replay->ready(InputEvent::Key, m_instructions);
+  }
+  if (m_console) {
+    return check_key();
+  }
+  if (m_may_run_dry) {
+    // Input that ran dry may have more by now.
+    m_input->clear();
+  }
+  return m_input->peek() != std::istream::traits_type::eof();
+}
+
+bool VirtualMachine::trap_input_ready() {
+  if (m_replay != nullptr || !m_may_run_dry) {
+    return true;
+  }
+  // The traps read with >>, which skips whitespace, so only something else
+  // is a character for them.
+  m_input->clear();
+  auto next = m_input->peek();
+  while (next != std::istream::traits_type::eof() && std::isspace(next)) {
+    m_input->get();
+    next = m_input->peek();
+  }
+  return next != std::istream::traits_type::eof();
+}
+
+template <TraceLevel Level>
+VirtualMachine::ShouldBreak VirtualMachine::wait_for_input() {
+  back_out<Level>(get_register(Register::PC) - 1);
+  m_exit_reason = ExitReason::WaitingForInput;
+  return ShouldBreak::Yes;
+}
+
+uint8_t VirtualMachine::take_key(InputEvent event) {
+  uint8_t key;
+  if (m_replay != nullptr) {
+    key = m_replay->take(event, m_instructions);
+  } else if (event == InputEvent::Key) {
+    // The key itself, not a number parsed from the keys that follow.
+    key = m_input->get() & 0xff;
+  } else {
+    char ch = 0;
+    *m_input >> ch;
+    key = ch;
+  }
+  if (m_recorder != nullptr) {
+    m_recorder->record({m_instructions, event, key});
+  }
+  return key;
+}
+
 uint16_t VirtualMachine::read_memory(uint16_t address) {
   if (address == MemoryMappedRegister::KBSR) {
-    if (check_key()) {
-      m_memory[MemoryMappedRegister::KBSR] = (1 << 15);
-      std::cin >> m_memory[MemoryMappedRegister::KBDR];
+    if (key_ready()) {
+      m_memory.write(MemoryMappedRegister::KBSR, 1 << 15);
+      m_memory.write(MemoryMappedRegister::KBDR, take_key(InputEvent::Key));
     } else {
-      m_memory[MemoryMappedRegister::KBSR] = 0;
+      m_memory.write(MemoryMappedRegister::KBSR, 0);
     }
+    invalidate_decoded(MemoryMappedRegister::KBSR);
+    invalidate_decoded(MemoryMappedRegister::KBDR);
   }
 
-  auto result = m_memory[address];
-#if 0
-  dbg("Reading address 0x" << (const void *)address << " from memory\n");
-  dbg("   Result: " << result << "\n");
-#endif
+  auto result = m_memory.read(address);
+  if (m_watched_pages >> (address >> Memory::PAGE_BITS) & 1) [[unlikely]] {
+    check_watchpoints(address, WatchKind::Read, result);
+  }
   return result;
 }
 
 void VirtualMachine::write_memory(uint16_t address, uint16_t value) {
-  dbg("Storing value at address 0x" << (const void *)address << " in memory\n");
-  dbg("   Value: " << value << "\n");
-  m_memory[address] = value;
+  m_memory.write(address, value);
+  if (m_watched_pages >> (address >> Memory::PAGE_BITS) & 1) [[unlikely]] {
+    check_watchpoints(address, WatchKind::Write, value);
+  }
+  invalidate_decoded(address);
+  if (m_jit && m_jit->is_translated(address)) {
+    m_jit->flush();
+  }
+}
+
+void VirtualMachine::invalidate_code(uint16_t address, size_t count) {
+  // Fused groups that start just before `address` cover it too.
+  size_t first = address - std::min<size_t>(address, MAX_FUSED_LENGTH - 1);
+  size_t last = std::min(address + count, MEMORY_MAX);
+  std::fill(m_decoded.get() + first, m_decoded.get() + last,
+            DecodedInstruction{});
+  if (m_jit) {
+    m_jit->flush();
+  }
+}
+
+template <TraceLevel Level> uint16_t VirtualMachine::load(uint16_t address) {
+  auto value = read_memory(address);
+  trace<Level>("Loading value from address ", hex(address), "\n");
+  trace<Level>("   Value: ", value, "\n");
+  if constexpr (Level >= TraceLevel::Binary) {
+    if (m_trace != nullptr) {
+      m_trace->access(TraceEvent::Read, address, value);
+    }
+  }
+  return value;
+}
+
+template <TraceLevel Level>
+void VirtualMachine::store(uint16_t address, uint16_t value) {
+  trace<Level>("Storing value at address ", hex(address), " in memory\n");
+  trace<Level>("   Value: ", value, "\n");
+  if constexpr (Level >= TraceLevel::Binary) {
+    if (m_trace != nullptr) {
+      m_trace->access(TraceEvent::Write, address, value);
+    }
+  }
+  write_memory(address, value);
 }
 
 uint16_t VirtualMachine::get_register(Register reg) {
+  if (reg == Register::COND) [[unlikely]] {
+    return condition_flags();
+  }
   return m_registers[to_underlying(reg)];
 }
 
 void VirtualMachine::set_register(
     Register reg, uint16_t val, ShouldUpdateCondition should_update_condition) {
+  if (reg == Register::COND) [[unlikely]] {
+    set_condition_flag(static_cast<ConditionFlag>(val));
+    return;
+  }
   m_registers[to_underlying(reg)] = val;
   if (should_update_condition == ShouldUpdateCondition::Yes)
-    update_flags(reg);
+    m_result = val;
 }
 
 void VirtualMachine::update_flags(Register reg) {
-  auto value = get_register(reg);
-  if (value == 0) {
-    set_condition_flag(ConditionFlag::ZRO);
-  } else if ((value >> 15) == 1) {
-    set_condition_flag(ConditionFlag::NEG);
-  } else {
-    set_condition_flag(ConditionFlag::POS);
-  }
+  m_result = get_register(reg);
 }
 
 void VirtualMachine::set_condition_flag(ConditionFlag flag) {
-  m_registers[to_underlying(Register::COND)] = to_underlying(flag);
+  // Any value with the sign and zeroness the flag stands for.
+  switch (flag) {
+  case ConditionFlag::NEG:
+    m_result = 0x8000;
+    break;
+  case ConditionFlag::ZRO:
+    m_result = 0;
+    break;
+  case ConditionFlag::POS:
+  default:
+    m_result = 1;
+    break;
+  }
 }
 
 void VirtualMachine::dump_registers() {
   std::cout << "=====Registers============\n";
   for (size_t i = 0; i < to_underlying(Register::COUNT); i++) {
     auto reg = static_cast<Register>(i);
-    std::cout << register_name(reg) << " = " << m_registers[i] << " (hex: 0x"
-              << (const void *)m_registers[i] << ")" << "\n";
+    auto value = get_register(reg);
+    std::cout << register_name(reg) << " = " << value << " (hex: " << hex(value)
+              << ")" << "\n";
   }
   std::cout << "=========================\n";
 }
 
 void VirtualMachine::dump_memory() {
   std::cout << "=======Memory=========\n";
-  for (size_t i = 0; i < MEMORY_MAX; i++) {
-    auto result = m_memory[i];
-    if (result == 0)
-      continue;
-    std::cout << "0x" << (const void *)i << ": " << result
-              << ", neg: " << (int16_t)result << "(" << Instruction(m_memory[i])
-              << "), " << "\n";
-  }
+  write_nonzero_words(std::cout, state_of(*this));
   std::cout << "======================\n";
 }
 
-uint16_t VirtualMachine::sign_extend(uint16_t x, int bit_count) {
-  // If x has a 1 in the bit_count's position, then its negative
-  if ((x >> (bit_count - 1)) & 1) {
-    // Pad with 1 if it's negative
-    x |= (0xffff << bit_count);
+void VirtualMachine::dump_profile() {
+  if (m_profile) {
+    m_profile->write_report(std::cout, m_memory);
   }
-  return x;
-}
\ No newline at end of file
+}
+
+void VirtualMachine::write_profile(std::ostream &json) {
+  if (m_profile) {
+    m_profile->write_json(json, m_memory);
+  }
+}
+
+uint16_t VirtualMachine::sign_extend(uint16_t x, int bit_count) {
+  return ::sign_extend(x, bit_count);
+}
+
+template VirtualMachine::ShouldBreak
+VirtualMachine::perform<TraceLevel::None>(DecodedInstruction);
+template VirtualMachine::ShouldBreak
+VirtualMachine::perform<TraceLevel::Profile>(DecodedInstruction);
+#ifdef VM_TRACE
+template VirtualMachine::ShouldBreak
+VirtualMachine::perform<TraceLevel::Opcode>(DecodedInstruction);
+template VirtualMachine::ShouldBreak
+VirtualMachine::perform<TraceLevel::Full>(DecodedInstruction);
+#endif
@@ -1,22 +1,157 @@
 #pragma once
 
+#include <CallbackIo.h>
+#include <DecodedInstruction.h>
+#include <Engine.h>
+#include <ExitReason.h>
+#include <InputLog.h>
 #include <Instruction.h>
+#include <Jit.h>
+#include <Memory.h>
+#include <Profile.h>
 #include <Register.h>
+#include <Trace.h>
+#include <TraceLog.h>
+#include <Trap.h>
 #include <Utils.h>
+#include <Watchpoint.h>
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
 #include <numeric>
+#include <optional>
 
 class VirtualMachine {
 public:
   VirtualMachine();
   ~VirtualMachine();
 
-  void execute();
+  static constexpr uint64_t UNLIMITED = UINT64_MAX;
+
+  // Runs until the machine stops or has performed `budget` more
+  // instructions, and returns exit_reason(). After
+  // ExitReason::BudgetExhausted or ExitReason::WaitingForInput the machine
+  // is between two instructions, and executing again carries on from there.
+  // Throws InvalidTraceLevel for a traced level in a build without VM_TRACE.
+  // TraceLevel::Profile and above count into profile(), across calls.
+  // TraceLevel::Binary and above write to the record_trace() recorder.
+  ExitReason execute(Engine = Engine::Switch, TraceLevel = TraceLevel::None,
+                     uint64_t budget = UNLIMITED);
+  // execute() for at most `max_instructions`, untraced.
+  ExitReason run(uint64_t max_instructions, Engine engine = Engine::Switch) {
+    return execute(engine, TraceLevel::None, max_instructions);
+  }
+  ExitReason exit_reason() const { return m_exit_reason; }
+  // Instructions performed so far, by every engine.
+  uint64_t instructions() const { return m_instructions; }
+  // A restored checkpoint carries on counting from where it was taken.
+  void set_instructions(uint64_t count) { m_instructions = count; }
+  // For engines that run the machine's instructions themselves.
+  void set_exit_reason(ExitReason reason) { m_exit_reason = reason; }
+  // Null until the machine runs at TraceLevel::Profile or above.
+  const Profile *profile() const { return m_profile.get(); }
+
+  // Where the traps read and write characters. Anything but the console
+  // also stands in for the keyboard: KBSR reports a key for as long as
+  // `input` has characters left.
+  void set_io(std::istream &input, std::ostream &output) {
+    m_input = &input;
+    m_output = &output;
+    m_console = &input == &std::cin;
+    m_may_run_dry = false;
+    m_callbacks.reset();
+  }
+  // Takes input from `read` and gives output to `write` instead. A GETC or
+  // IN that `read` has nothing for stops the machine with
+  // ExitReason::WaitingForInput before the trap, to be retried by the next
+  // execute().
+  void set_io(ReadInput read, WriteOutput write);
+  // Logs every character of input the machine takes, with the instruction
+  // count it took it at. Null stops recording.
+  void record_input(InputRecorder *recorder) { m_recorder = recorder; }
+  // Takes every character of input from `replay` instead of the input
+  // stream, at the instruction counts it was recorded at, so a recorded run
+  // repeats exactly and never waits. Null goes back to the stream.
+  void replay_input(InputReplay *replay) { m_replay = replay; }
+  // Appends every instruction the machine performs at TraceLevel::Binary or
+  // above to `trace`, with the words it loads and stores. Null stops
+  // tracing.
+  void record_trace(TraceRecorder *trace) { m_trace = trace; }
+
+  // TRAP `vector` runs `handler` on the host from now on, instead of
+  // whatever it did before. Nothing is pushed or jumped to: the handler
+  // works on the machine directly, in one instruction.
+  void set_trap_handler(uint8_t vector, TrapHandler handler);
+  // TRAP `vector` jumps to the guest service routine whose address is at
+  // memory[vector], as on the LC-3, with the return address in R7.
+  void set_guest_trap(uint8_t vector) {
+    m_trap_kinds[vector] = TrapKind::Guest;
+  }
+  TrapKind trap_kind(uint8_t vector) const { return m_trap_kinds[vector]; }
+
+  // Stops the machine with ExitReason::Breakpoint before it performs the
+  // instruction at `address`. Executing again from there performs it.
+  // Breakpoints replace their word's predecoded record, so they cost
+  // nothing anywhere else.
+  void set_breakpoint(uint16_t address);
+  void clear_breakpoint(uint16_t address);
+  bool has_breakpoint(uint16_t address) const {
+    return !m_breakpoints.empty() && m_breakpoints[address];
+  }
+  // Stops the machine with ExitReason::Watchpoint right after the
+  // instruction that accesses a word of `watchpoint`; watch_hit() says how.
+  // Only pages with a watchpoint pay for the check, but while any is set
+  // nothing is fused and Engine::Jit interprets.
+  void add_watchpoint(Watchpoint watchpoint);
+  void clear_watchpoints();
+  const std::vector<Watchpoint> &watchpoints() const { return m_watchpoints; }
+  // The access that stopped the machine with ExitReason::Watchpoint last.
+  WatchHit watch_hit() const { return m_watch_hit; }
   Instruction current_instruction();
 
   enum class ShouldUpdateCondition { Yes, No };
 
-  uint16_t *base() { return m_memory; }
+  // Copies `count` words into memory at `origin` onwards, dropping every
+  // cached decode of them.
+  void load(uint16_t origin, const uint16_t *words, size_t count) {
+    m_memory.copy_from(origin, words, count);
+    invalidate_code(origin, count);
+  }
+  // Lets `fill` write the words straight into memory; see Memory::fill().
+  template <typename Fill>
+  void load(uint16_t origin, size_t count, Fill &&fill) {
+    m_memory.fill(origin, count, fill);
+    invalidate_code(origin, count);
+  }
 
+  // The words of memory page `index`, Memory::PAGE_SIZE of them.
+  const uint16_t *page(size_t index) const { return m_memory.pages()[index]; }
+
+  struct DirtyPages {
+    // Bit i for page i; see Memory::take_dirty_pages().
+    uint32_t pages;
+    // instructions() at the previous call.
+    uint64_t since;
+  };
+  // The pages written since the last call.
+  DirtyPages take_dirty_pages() {
+    DirtyPages dirty = {m_memory.take_dirty_pages(), m_clean_since};
+    m_clean_since = m_instructions;
+    return dirty;
+  }
+
+  // A machine in the same state as this one. Memory pages are shared until
+  // either machine writes to them, so this costs a page table rather than a
+  // copy of memory. The child starts without decoded or translated code,
+  // keeps the breakpoints and watchpoints and uses the same streams, but
+  // neither records nor replays input.
+  std::unique_ptr<VirtualMachine> fork();
+
+  // Register::COND reads as the flag for the last value written with
+  // ShouldUpdateCondition::Yes. Writing it takes a single ConditionFlag.
   uint16_t get_register(Register);
   void set_register(Register, uint16_t,
                     ShouldUpdateCondition = ShouldUpdateCondition::Yes);
@@ -24,6 +159,12 @@ public:
   enum class ShouldBreak { Yes, No };
 
   ShouldBreak perform(Instruction);
+  template <TraceLevel Level = TraceLevel::None>
+  ShouldBreak perform(DecodedInstruction);
+
+  // Returns the predecoded form of the word at `address`, decoding (and
+  // fusing) it on first use.
+  DecodedInstruction fetch(uint16_t address);
 
   uint16_t sign_extend(uint16_t, int bit_count);
 
@@ -35,15 +176,201 @@ public:
 
   void dump_registers();
   void dump_memory();
+  // The hotspot report of profile(), if there is one.
+  void dump_profile();
+  // profile() as JSON, if there is one.
+  void write_profile(std::ostream &json);
 
-  static constexpr size_t MEMORY_MAX = 1 << 16;
+  static constexpr size_t MEMORY_MAX = Memory::SIZE;
   static constexpr size_t PC_START = 0x3000;
 
-  void copy_memory_from(const uint16_t *mem) {
-    std::memcpy(m_memory, mem, MEMORY_MAX * sizeof(uint16_t));
-  }
+  void copy_memory_from(const uint16_t *mem) { load(0, mem, MEMORY_MAX); }
 
 private:
-  uint16_t m_memory[MEMORY_MAX] = {0};
+  template <TraceLevel Level> void execute_engine(Engine);
+  template <TraceLevel Level> void execute_switch();
+  template <TraceLevel Level> void execute_threaded();
+  template <TraceLevel Level> void execute_jit();
+
+  // Fetches and performs the instruction at the PC.
+  template <TraceLevel Level> ShouldBreak step();
+
+  // Stops the machine, unless it is resuming from this very breakpoint.
+  template <TraceLevel Level> ShouldBreak op_break(DecodedInstruction);
+  // Records an access to a watched page, stopping the machine at the next
+  // dispatch if a watchpoint covers it.
+  void check_watchpoints(uint16_t address, WatchKind kind, uint16_t value);
+
+  // Whether the budget is spent before `instruction`, fetched from `pc`,
+  // can run. A superinstruction that would overrun it is swapped for the
+  // plain record of its first instruction.
+  bool budget_spent(DecodedInstruction &instruction, uint16_t pc) {
+    if (m_instructions + MAX_FUSED_LENGTH <= m_limit) [[likely]] {
+      return false;
+    }
+    if (m_instructions >= m_limit) {
+      m_exit_reason = ExitReason::BudgetExhausted;
+      return true;
+    }
+    if (m_instructions + fused_length(instruction.handler) > m_limit) {
+      instruction = decode(Instruction(m_memory.read(pc)));
+    }
+    return false;
+  }
+
+  // Runs translated code from `block`.
+  Jit::Exit run_native(const void *block);
+
+  // N, Z or P for m_result. BR is the only instruction that needs them, so
+  // nothing works them out before it asks.
+  uint16_t condition_flags() const {
+    if (m_result == 0) {
+      return to_underlying(ConditionFlag::ZRO);
+    }
+    return m_result >> 15 ? to_underlying(ConditionFlag::NEG)
+                          : to_underlying(ConditionFlag::POS);
+  }
+
+  // One function per handler. perform() and the threaded engine both call
+  // these, so the engines cannot drift apart.
+  template <TraceLevel Level, Handler H> ShouldBreak op_add(DecodedInstruction);
+  template <TraceLevel Level, Handler H> ShouldBreak op_and(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_br(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_jmp(DecodedInstruction);
+  template <TraceLevel Level, Handler H> ShouldBreak op_jsr(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_ld(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_ldi(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_ldr(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_lea(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_not(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_rti(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_sti(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_st(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_str(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_trap(DecodedInstruction);
+  template <TraceLevel Level> ShouldBreak op_res(DecodedInstruction);
+  // Runs every instruction of a superinstruction group in turn.
+  template <TraceLevel Level, Handler H>
+  ShouldBreak op_fused(DecodedInstruction);
+
+  // Advances the PC past the next instruction of a fused group, as dispatch
+  // would have, and returns its record.
+  template <TraceLevel Level> DecodedInstruction next_in_group(Handler);
+
+  // Counts the instruction at `pc` into m_profile when profiling, and
+  // appends it to m_trace when tracing.
+  template <TraceLevel Level> void observe(uint16_t pc) {
+    if constexpr (Level >= TraceLevel::Binary) {
+      if (m_trace != nullptr) {
+        m_trace->instruction(pc, m_memory.read(pc));
+      }
+    }
+    if constexpr (Level >= TraceLevel::Profile) {
+      m_profile->count(pc, m_memory.read(pc));
+    }
+  }
+  // Undoes the dispatch of the instruction at `pc`, so that the next
+  // execute() starts with it.
+  template <TraceLevel Level> void back_out(uint16_t pc) {
+    set_register(Register::PC, pc, ShouldUpdateCondition::No);
+    m_instructions--;
+    if constexpr (Level >= TraceLevel::Binary) {
+      if (m_trace != nullptr) {
+        m_trace->retract();
+      }
+    }
+  }
+
+  // read_memory() followed by a trace of the load.
+  template <TraceLevel Level> uint16_t load(uint16_t address);
+  // write_memory() preceded by a trace of the store.
+  template <TraceLevel Level> void store(uint16_t address, uint16_t value);
+
+  // Turns the record at `address` into a superinstruction if it starts one of
+  // the groups fuse() knows. Every other word of the group keeps its own
+  // record, so jumping into the middle of a group still runs exactly the
+  // instructions there. Groups never cover a breakpoint, and nothing is
+  // fused while watchpoints are set, so the machine can stop between any
+  // two instructions.
+  void fuse_at(uint16_t address);
+
+  // Whether KBSR should report a key.
+  bool key_ready();
+  // Whether a GETC or IN would find a character now. Only input from
+  // callbacks can run dry and come back later.
+  bool trap_input_ready();
+  // Backs out of the trap just fetched, so the next execute() performs it
+  // again, and stops the machine until then.
+  template <TraceLevel Level> ShouldBreak wait_for_input();
+  // The next character of input, for KBDR or a trap.
+  uint8_t take_key(InputEvent);
+
+  void invalidate_decoded(uint16_t address) {
+    m_decoded[address].handler = Handler::Undecoded;
+    // A fused group that started a word or two earlier covers this word too.
+    for (uint16_t back = 1; back < MAX_FUSED_LENGTH && back <= address;
+         back++) {
+      auto &record = m_decoded[address - back];
+      if (fused_length(record.handler) > back) {
+        record.handler = Handler::Undecoded;
+      }
+    }
+  }
+  // Drops everything derived from the `count` words at `address` onwards:
+  // their decoded records and all translated blocks.
+  void invalidate_code(uint16_t address, size_t count);
+
+  struct FreeDeleter {
+    void operator()(void *pointer) const { std::free(pointer); }
+  };
+  // calloc() hands out large blocks as fresh zero pages, so a new (or
+  // forked) machine does not pay for clearing tables it may barely touch.
+  static std::unique_ptr<DecodedInstruction[], FreeDeleter> allocate_decoded();
+
+  Memory m_memory;
+  // The COND slot is unused: m_result stands in for it.
   uint16_t m_registers[to_underlying(Register::COUNT)] = {0};
-};
\ No newline at end of file
+  // The last value written with ShouldUpdateCondition::Yes.
+  uint16_t m_result = 0;
+  // One record per memory word, filled lazily by fetch() and reset whenever
+  // the word changes. All-zero bytes are Handler::Undecoded.
+  std::unique_ptr<DecodedInstruction[], FreeDeleter> m_decoded =
+      allocate_decoded();
+  // Created the first time Engine::Jit runs.
+  std::unique_ptr<Jit> m_jit;
+  // Created the first time the machine runs with profiling.
+  std::unique_ptr<Profile> m_profile;
+
+  ExitReason m_exit_reason = ExitReason::EndOfMemory;
+  uint64_t m_instructions = 0;
+  // The instruction count the current execute() stops at.
+  uint64_t m_limit = UNLIMITED;
+
+  // One flag per word, once any breakpoint was set.
+  std::vector<bool> m_breakpoints;
+  // The breakpoint the current execute() started at, which it performs
+  // instead of stopping at. NO_BREAKPOINT if it started anywhere else.
+  static constexpr uint32_t NO_BREAKPOINT = MEMORY_MAX;
+  uint32_t m_resume_from = NO_BREAKPOINT;
+  std::vector<Watchpoint> m_watchpoints;
+  // Bit i for every page i with a watchpoint on it.
+  uint32_t m_watched_pages = 0;
+  bool m_watch_pending = false;
+  WatchHit m_watch_hit = {};
+  uint64_t m_clean_since = 0;
+
+  std::istream *m_input = &std::cin;
+  std::ostream *m_output = &std::cout;
+  bool m_console = true;
+  bool m_may_run_dry = false;
+  // How each trap vector is served. Only the standard traps have a service
+  // routine until one is set.
+  std::array<TrapKind, TRAP_VECTORS> m_trap_kinds = builtin_trap_kinds();
+  // Indexed by vector, once any handler is set.
+  std::vector<TrapHandler> m_trap_handlers;
+  // The streams over the callbacks of set_io(), if it was given any.
+  std::unique_ptr<CallbackStreams> m_callbacks;
+  InputRecorder *m_recorder = nullptr;
+  InputReplay *m_replay = nullptr;
+  TraceRecorder *m_trace = nullptr;
+};
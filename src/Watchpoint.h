@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// Which accesses a watchpoint stops at.
+enum class WatchKind : uint8_t {
+  Read = 1,
+  Write = 2,
+  Access = 3 /* either */
+};
+
+class InvalidWatchKind {};
+
+inline WatchKind watch_kind_from_name(const char *name) {
+  if (std::strcmp(name, "r") == 0) {
+    return WatchKind::Read;
+  }
+  if (std::strcmp(name, "w") == 0) {
+    return WatchKind::Write;
+  }
+  if (std::strcmp(name, "rw") == 0) {
+    return WatchKind::Access;
+  }
+  throw InvalidWatchKind();
+}
+
+inline const char *watch_kind_name(WatchKind kind) {
+  switch (kind) {
+  case WatchKind::Read:
+    return "WatchKind::Read";
+  case WatchKind::Write:
+    return "WatchKind::Write";
+  case WatchKind::Access:
+    return "WatchKind::Access";
+  }
+  return "Unrecognized";
+}
+
+// The words [first, last] of memory.
+struct Watchpoint {
+  uint16_t first;
+  uint16_t last;
+  WatchKind kind;
+
+  bool matches(uint16_t address, WatchKind access) const {
+    return address >= first && address <= last &&
+           (static_cast<uint8_t>(kind) & static_cast<uint8_t>(access));
+  }
+};
+
+// The access a watchpoint stopped the machine at.
+struct WatchHit {
+  uint16_t address;
+  WatchKind kind;
+  // The word read, or the word written.
+  uint16_t value;
+  // The instruction that made the access.
+  uint16_t pc;
+};
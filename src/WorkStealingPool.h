@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Runs a fixed set of tasks over a number of worker threads. Every worker
+// starts with a contiguous share of the tasks in its own deque and works from
+// the back of it; once that runs dry it steals from the front of the others',
+// so a few slow tasks do not leave the remaining workers idle.
+class WorkStealingPool {
+public:
+  explicit WorkStealingPool(
+      size_t threads = std::thread::hardware_concurrency())
+      : m_threads(std::max<size_t>(threads, 1)) {}
+
+  size_t threads() const { return m_threads; }
+
+  // Calls task(0) ... task(count - 1), each exactly once, and returns when all
+  // of them are done. `task` must not throw.
+  void run(size_t count, const std::function<void(size_t)> &task) {
+    auto workers = std::min(m_threads, count);
+    if (workers == 0) {
+      return;
+    }
+
+    std::vector<Queue> queues(workers);
+    for (size_t i = 0; i < count; i++) {
+      queues[i * workers / count].tasks.push_back(i);
+    }
+
+    std::vector<std::jthread> threads;
+    for (size_t id = 0; id < workers; id++) {
+      threads.emplace_back([&queues, &task, id] {
+        while (auto next = take(queues, id)) {
+          task(*next);
+        }
+      });
+    }
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<size_t> tasks;
+  };
+
+  // No task is ever added once run() starts, so finding every queue empty
+  // means the worker is done.
+  static std::optional<size_t> take(std::vector<Queue> &queues, size_t id) {
+    {
+      auto &own = queues[id];
+      std::lock_guard lock(own.mutex);
+      if (!own.tasks.empty()) {
+        auto task = own.tasks.back();
+        own.tasks.pop_back();
+        return task;
+      }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+      auto &victim = queues[(id + i) % queues.size()];
+      std::lock_guard lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        auto task = victim.tasks.front();
+        victim.tasks.pop_front();
+        return task;
+      }
+    }
+    return std::nullopt;
+  }
+
+  size_t m_threads;
+};
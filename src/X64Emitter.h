@@ -0,0 +1,268 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+
+// The x86-64 general purpose registers, numbered as they are encoded.
+enum class X64Register : uint8_t {
+  RAX = 0,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+  None = 0xff
+};
+
+// Condition codes as encoded in the low nibble of Jcc.
+enum class X64Condition : uint8_t {
+  Below = 0x2,
+  AboveEqual = 0x3,
+  Equal = 0x4,
+  NotEqual = 0x5,
+  Above = 0x7,
+  Sign = 0x8,
+  NotSign = 0x9,
+  LessEqual = 0xe,
+  Greater = 0xf
+};
+
+// [base + index * scale + disp]
+struct X64Memory {
+  X64Register base;
+  int32_t disp = 0;
+  X64Register index = X64Register::None;
+  uint8_t scale = 1;
+};
+
+// Just enough of an x86-64 assembler for the JIT. Every method appends one
+// instruction at the cursor; 32-bit operand size unless the name says
+// otherwise.
+class X64Emitter {
+public:
+  X64Emitter(uint8_t *begin, uint8_t *end) : m_cursor(begin), m_end(end) {}
+
+  uint8_t *cursor() const { return m_cursor; }
+
+  // Set once an instruction did not fit. Whatever was emitted is then
+  // incomplete and must be thrown away.
+  bool overflowed() const { return m_overflowed; }
+
+  void mov(X64Register dst, X64Register src) {
+    encode(false, false, {0x89}, code(src), dst);
+  }
+  void mov64(X64Register dst, X64Register src) {
+    encode(true, false, {0x89}, code(src), dst);
+  }
+  void mov(X64Register dst, uint32_t imm) {
+    if (code(dst) & 8) {
+      emit(0x41);
+    }
+    emit(0xb8 + (code(dst) & 7));
+    emit32(imm);
+  }
+  void movzx16(X64Register dst, X64Register src) {
+    encode(false, false, {0x0f, 0xb7}, code(dst), src);
+  }
+  void movzx16(X64Register dst, X64Memory src) {
+    encode(false, false, {0x0f, 0xb7}, code(dst), src);
+  }
+  void load64(X64Register dst, X64Memory src) {
+    encode(true, false, {0x8b}, code(dst), src);
+  }
+  void store16(X64Memory dst, X64Register src) {
+    encode(false, true, {0x89}, code(src), dst);
+  }
+  void store32(X64Memory dst, X64Register src) {
+    encode(false, false, {0x89}, code(src), dst);
+  }
+  void store8(X64Memory dst, uint8_t imm) {
+    encode(false, false, {0xc6}, 0, dst);
+    emit(imm);
+  }
+  void lea(X64Register dst, X64Memory src) {
+    encode(false, false, {0x8d}, code(dst), src);
+  }
+
+  void add(X64Register dst, X64Register src) {
+    encode(false, false, {0x01}, code(src), dst);
+  }
+  void add64(X64Register dst, X64Memory src) {
+    encode(true, false, {0x03}, code(dst), src);
+  }
+  void add64(X64Memory dst, int32_t imm) {
+    encode(true, false, {0x81}, 0, dst);
+    emit32(imm);
+  }
+  void and_(X64Register dst, X64Register src) {
+    encode(false, false, {0x21}, code(src), dst);
+  }
+  void and_(X64Register dst, int32_t imm) {
+    encode(false, false, {0x81}, 4, dst);
+    emit32(imm);
+  }
+  void not_(X64Register dst) { encode(false, false, {0xf7}, 2, dst); }
+  void shr(X64Register dst, uint8_t imm) {
+    encode(false, false, {0xc1}, 5, dst);
+    emit(imm);
+  }
+  void imul(X64Register dst, X64Register src, int8_t imm) {
+    encode(false, false, {0x6b}, code(dst), src);
+    emit(static_cast<uint8_t>(imm));
+  }
+  void cmp(X64Register dst, int32_t imm) {
+    encode(false, false, {0x81}, 7, dst);
+    emit32(imm);
+  }
+  void cmp64(X64Register a, X64Memory b) {
+    encode(true, false, {0x3b}, code(a), b);
+  }
+  void cmp8(X64Memory dst, uint8_t imm) {
+    encode(false, false, {0x80}, 7, dst);
+    emit(imm);
+  }
+  void test16(X64Register a, X64Register b) {
+    encode(false, true, {0x85}, code(b), a);
+  }
+  void test64(X64Register a, X64Register b) {
+    encode(true, false, {0x85}, code(b), a);
+  }
+
+  void push(X64Register reg) {
+    if (code(reg) & 8) {
+      emit(0x41);
+    }
+    emit(0x50 + (code(reg) & 7));
+  }
+  void pop(X64Register reg) {
+    if (code(reg) & 8) {
+      emit(0x41);
+    }
+    emit(0x58 + (code(reg) & 7));
+  }
+  void jmp(X64Register target) { encode(false, false, {0xff}, 4, target); }
+  void ret() { emit(0xc3); }
+
+  // Relative jumps return the address of their rel32 field, so that they can
+  // be linked once the target is known.
+  uint8_t *jmp(const void *target = nullptr) {
+    emit(0xe9);
+    return rel32(target);
+  }
+  uint8_t *jcc(X64Condition condition, const void *target = nullptr) {
+    emit(0x0f);
+    emit(0x80 + static_cast<uint8_t>(condition));
+    return rel32(target);
+  }
+
+  // Points the rel32 field at `field` to the cursor.
+  void bind(uint8_t *field) {
+    if (!m_overflowed) {
+      link(field, m_cursor);
+    }
+  }
+
+  // Points the rel32 field at `field` to `target`.
+  static void link(uint8_t *field, const void *target) {
+    auto relative = static_cast<int32_t>(
+        static_cast<const uint8_t *>(target) - (field + 4));
+    std::memcpy(field, &relative, sizeof(relative));
+  }
+
+private:
+  static uint8_t code(X64Register reg) { return static_cast<uint8_t>(reg); }
+
+  void emit(uint8_t byte) {
+    if (m_cursor >= m_end) {
+      m_overflowed = true;
+      return;
+    }
+    *m_cursor++ = byte;
+  }
+  void emit32(uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+      emit(static_cast<uint8_t>(value >> (8 * i)));
+    }
+  }
+
+  uint8_t *rel32(const void *target) {
+    auto field = m_cursor;
+    emit32(0);
+    if (target != nullptr && !m_overflowed) {
+      link(field, target);
+    }
+    return field;
+  }
+
+  // [66] [REX] opcode ModRM, register-direct form.
+  void encode(bool wide, bool word, std::initializer_list<uint8_t> opcode,
+              uint8_t reg, X64Register rm) {
+    if (word) {
+      emit(0x66);
+    }
+    uint8_t rex = 0x40 | (wide ? 0x8 : 0) | ((reg & 8) ? 0x4 : 0) |
+                  ((code(rm) & 8) ? 0x1 : 0);
+    if (rex != 0x40) {
+      emit(rex);
+    }
+    for (auto byte : opcode) {
+      emit(byte);
+    }
+    emit(0xc0 | ((reg & 7) << 3) | (code(rm) & 7));
+  }
+
+  // [66] [REX] opcode ModRM [SIB] [disp], memory form.
+  void encode(bool wide, bool word, std::initializer_list<uint8_t> opcode,
+              uint8_t reg, X64Memory rm) {
+    bool has_index = rm.index != X64Register::None;
+    if (word) {
+      emit(0x66);
+    }
+    uint8_t rex = 0x40 | (wide ? 0x8 : 0) | ((reg & 8) ? 0x4 : 0) |
+                  ((has_index && (code(rm.index) & 8)) ? 0x2 : 0) |
+                  ((code(rm.base) & 8) ? 0x1 : 0);
+    if (rex != 0x40) {
+      emit(rex);
+    }
+    for (auto byte : opcode) {
+      emit(byte);
+    }
+
+    uint8_t base = code(rm.base) & 7;
+    // RSP/R12 as a base always need a SIB byte, and RBP/R13 cannot be
+    // encoded without a displacement.
+    bool sib = has_index || base == 4;
+    uint8_t mod = 2;
+    if (rm.disp == 0 && base != 5) {
+      mod = 0;
+    } else if (rm.disp >= -128 && rm.disp <= 127) {
+      mod = 1;
+    }
+    emit((mod << 6) | ((reg & 7) << 3) | (sib ? 4 : base));
+    if (sib) {
+      uint8_t scale = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2;
+      uint8_t index = has_index ? code(rm.index) & 7 : 4;
+      emit((scale << 6) | (index << 3) | base);
+    }
+    if (mod == 1) {
+      emit(static_cast<uint8_t>(rm.disp));
+    } else if (mod == 2) {
+      emit32(static_cast<uint32_t>(rm.disp));
+    }
+  }
+
+  uint8_t *m_cursor;
+  uint8_t *m_end;
+  bool m_overflowed = false;
+};
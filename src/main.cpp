@@ -1,14 +1,20 @@
-#define VM_DEBUG
-
+#include <Aot.h>
+#include <Assembler.h>
+#include <AsyncOutput.h>
+#include <Batch.h>
+#include <Checkpoint.h>
+#include <Debugger.h>
+#include <HostTraps.h>
+#include <Image.h>
+#include <InputLog.h>
+#include <MemoryDump.h>
 #include <Platform.h>
+#include <TraceLog.h>
 #include <VirtualMachine.h>
+#include <WorkStealingPool.h>
+#include <fstream>
 #include <iostream>
-
-void handle_interrupt(int signal) {
-  restore_input_buffering();
-  std::cout << "\n";
-  exit(-2);
-}
+#include <sstream>
 
 void setup() {
   signal(SIGINT, handle_interrupt);
@@ -17,144 +23,536 @@ void setup() {
 
 void teardown() { restore_input_buffering(); }
 
-uint16_t swap16(uint16_t value) { return (value << 8) | (value >> 8); }
-
-void execute_image(FILE *file, VirtualMachine &vm) {
-  // the origin tells where in memory to place the image
-  uint16_t origin;
-  fread(&origin, sizeof(origin), 1, file);
-  origin = swap16(origin);
-
-  // we know the maximum file size so we only need one fread
-  uint16_t max_read = VirtualMachine::MEMORY_MAX - origin;
-  uint16_t *p = vm.base() + origin;
-  size_t read = fread(p, sizeof(uint16_t), max_read, file);
-
-  while (read-- < 0) {
-    *p = swap16(*p);
-    ++p;
-  }
+void execute_image(const ImageFile &image, VirtualMachine &vm, Engine engine,
+                   TraceLevel level) {
+  image.load_into(vm);
 
   vm.dump_memory();
-  vm.execute();
+  vm.execute(engine, level);
 }
 
-void run_example(VirtualMachine &vm) {
+// Runs every job of the manifest at `path` and prints the report.
+bool execute_batch(const char *path, Engine engine, size_t threads,
+                   uint64_t budget) {
+  std::ifstream manifest(path);
+  if (!manifest) {
+    std::cout << "Cannot open manifest: " << path << "\n";
+    return false;
+  }
+  std::vector<BatchJob> jobs;
+  try {
+    jobs = read_manifest(manifest);
+  } catch (InvalidManifest &) {
+    std::cout << "Invalid manifest: " << path << "\n";
+    return false;
+  }
+  write_report(std::cout, jobs, run_batch(jobs, engine, threads, budget));
+  return true;
+}
 
+// Reads two digits and prints their sum, as long as it is a digit too.
+static constexpr const char *EXAMPLE = R"(
+        .ORIG x3000
+        IN
+        JSR TO_INT
+        ST R0, FIRST
+        IN
+        JSR TO_INT
+        LD R1, FIRST
+        ADD R0, R0, R1
+        JSR TO_CHAR
+        OUT
+        HALT
+FIRST   .BLKW 1
+
+; R0 from an ASCII digit to its value, and back.
+TO_INT  LD R5, MINUS_ZERO
+        ADD R0, R0, R5
+        RET
+TO_CHAR LD R5, ZERO
+        ADD R0, R0, R5
+        RET
+MINUS_ZERO .FILL #-48
+ZERO    .FILL #48
+        .END
+)";
+
+void run_example(VirtualMachine &vm, Engine engine, TraceLevel level) {
   vm.dump_registers();
+  assemble(EXAMPLE).load_into(vm);
+  vm.dump_memory();
+  vm.execute(engine, level);
+}
 
-  uint16_t program[VirtualMachine::MEMORY_MAX] = {0};
-
-  /*
-  // ADD R0, R0, 2
-  program[VirtualMachine::PC_START] = 0b0001'0000'0010'0010;
-  // ADD R0, R0, 1
-  program[VirtualMachine::PC_START + 1] = 0b0001'0000'0010'0001;
-  */
-  // TRAP IN
-  program[0x3000] = 0xf023;
-
-  // JSR to_int(R0)
-  program[0x3001] = 0x480A;
-
-  // The char is in R0, copy it to memory
-  // ST R0 7
-  program[0x3002] = 0x3007;
-
-  // Grab another char
-  // TRAP IN
-  program[0x3003] = 0xf023;
-
-  // JSR to_int(R0)
-  program[0x3004] = 0x4807;
-
-  // Load the first char (now in memory) into R1
-  // LD R1, 4
-  program[0x3005] = 0x2204;
-
-  // Add R0 and R1
-  // ADD R0, R0, R1
-  program[0x3006] = 0b0001'000'000'0'00'001;
-
-  // JSR to_char(R0)
-  program[0x3007] = 0x480A;
-
-  // Print the result that is in R0
-  // TRAP PUT
-  program[0x3008] = 0xf021;
-
-  // TRAP HALT
-  program[0x3009] = 0xf025;
-
-  // program[0x300A] = (the char is copied here)
-
-  /// Subroutines
-  // to_int(R0)
-
-  // LD R5, 10
-  std::cout << "0x3000C: to_int(R0)\n";
-  program[0x300C] = 0b0010'101'000001010;
-
-  // ADD R0, R0, R5
-  program[0x300D] = 0b0001'000'000'0'00'101;
-
-  // RET
-  program[0x300E] = 0b1100'000'111'000000;
+// The program in the source file at `path`, or nothing if it cannot be
+// read or assembled.
+std::optional<Assembly> assemble_file(const char *path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    std::cout << "Cannot open source: " << path << "\n";
+    return std::nullopt;
+  }
+  std::string source(std::istreambuf_iterator<char>(file), {});
+  try {
+    return assemble(source);
+  } catch (AssemblyError &error) {
+    std::cout << path << ":" << error.line << ": " << error.message << "\n";
+    return std::nullopt;
+  }
+}
 
-  // to_char(R0)
-  // LD R5, 10
-  std::cout << "0x3012: to_char(R0)\n";
-  program[0x3012] = 0b0010'101'000001010;
+// vm asm <source> <image>: assembles the source into an object file.
+int assemble_to_image(const char *source_path, const char *image_path) {
+  auto assembly = assemble_file(source_path);
+  if (!assembly) {
+    return 2;
+  }
+  std::ofstream image(image_path, std::ios::binary | std::ios::trunc);
+  if (!image) {
+    std::cout << "Cannot write image: " << image_path << "\n";
+    return 2;
+  }
+  assembly->write_image(image);
+  return 0;
+}
 
-  // ADD R0, R0, R5
-  program[0x3013] = 0b0001'000'000'0'00'101;
+// vm aot <image> <cpp-path>: translates the image, or a source, to C++.
+int translate_to_cpp(const char *image_path, const char *cpp_path) {
+  VirtualMachine vm;
+  uint16_t origin = 0;
+  size_t size = 0;
+  if (std::string_view(image_path).ends_with(".asm")) {
+    auto assembly = assemble_file(image_path);
+    if (!assembly) {
+      return 2;
+    }
+    assembly->load_into(vm);
+    origin = assembly->origin;
+    size = assembly->words.size();
+  } else {
+    try {
+      ImageFile image(image_path);
+      image.load_into(vm);
+      origin = image.origin();
+      size = image.size();
+    } catch (CannotOpenImage &) {
+      std::cout << "Cannot open image: " << image_path << "\n";
+      return 2;
+    } catch (InvalidImage &) {
+      std::cout << "Invalid image: " << image_path << "\n";
+      return 2;
+    }
+  }
+  std::ofstream cpp(cpp_path, std::ios::trunc);
+  if (!cpp) {
+    std::cout << "Cannot write translation: " << cpp_path << "\n";
+    return 2;
+  }
+  translate_image(vm, origin, size, cpp);
+  return 0;
+}
 
-  // RET
-  program[0x3014] = 0b1100'000'111'000000;
+// vm trace-dump <trace>: prints every record of a trace written with
+// --trace-file=, one instruction or memory access per line.
+int dump_trace(const char *path) {
+  std::optional<TraceReader> reader;
+  try {
+    reader.emplace(path);
+  } catch (CannotOpenTraceLog &) {
+    std::cout << "Cannot open trace: " << path << "\n";
+    return 2;
+  } catch (InvalidTraceLog &) {
+    std::cout << "Invalid trace: " << path << "\n";
+    return 2;
+  }
+  // Traces run to billions of lines.
+  AsyncOutput async_output(stdout);
+  std::ostream output(&async_output);
+  uint64_t instructions = 0;
+  try {
+    while (auto record = reader->next()) {
+      if (record->event == TraceEvent::Instruction) {
+        auto handler = decode(Instruction(record->value)).handler;
+        output << instructions++ << " " << hex(record->address) << " "
+               << hex(record->value) << " " << handler_name(handler) << "\n";
+      } else {
+        output << (record->event == TraceEvent::Read ? "  read " : "  write ")
+               << hex(record->address) << " " << hex(record->value) << "\n";
+      }
+    }
+  } catch (InvalidTraceLog &) {
+    output << std::flush;
+    std::cout << "Invalid trace: " << path << "\n";
+    return 2;
+  }
+  return 0;
+}
 
-  // Here we store data for the to_int(R0) subroutine
-  // Since the 0 char is 48 in ASCII, we need to substract it
-  // to obtain the digit's value.
-  program[0x3017] = (~48 + 1); // Two's complement of 48
+// The dump at `path`, or nothing if it cannot be read.
+std::optional<DumpFile> open_dump(const char *path) {
+  try {
+    return DumpFile(path);
+  } catch (CannotOpenDump &) {
+    std::cout << "Cannot open dump: " << path << "\n";
+  } catch (InvalidDump &) {
+    std::cout << "Invalid dump: " << path << "\n";
+  }
+  return std::nullopt;
+}
 
-  // Here we store data for the to_char(R0) subroutine
-  // We do the inverse here, we add 48.
-  program[0x301D] = 48;
+// vm dump-diff <before> <after>: prints what changed between two dumps.
+int diff_dumps(const char *before_path, const char *after_path) {
+  auto before = open_dump(before_path);
+  auto after = before ? open_dump(after_path) : std::nullopt;
+  if (!after) {
+    return 2;
+  }
+  write_diff(std::cout, before->state(), after->state());
+  return 0;
+}
 
-  vm.copy_memory_from(program);
-  vm.dump_memory();
+// vm [--engine=...] [--host-traps] debug <image> [input]: runs the image, or
+// a source, under the debugger console on stdin. The program reads `input`,
+// or nothing.
+int debug_program(int argc, const char **argv) {
+  VirtualMachine vm;
+  Engine engine = Engine::Switch;
+  int i = 1;
+  for (; strcmp(argv[i], "debug") != 0; i++) {
+    if (strncmp(argv[i], "--engine=", 9) == 0) {
+      try {
+        engine = engine_from_name(argv[i] + 9);
+      } catch (InvalidEngine &) {
+        std::cout << "Unknown engine: " << argv[i] + 9 << "\n";
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--host-traps") == 0) {
+      install_host_traps(vm);
+    } else {
+      break;
+    }
+  }
+  if (strcmp(argv[i], "debug") != 0 || i + 1 >= argc || i + 3 < argc) {
+    std::cout << "Usage: vm [--engine=switch|threaded|jit] [--host-traps] "
+                 "debug <image-or-asm-path> [input-path]\n";
+    return 2;
+  }
+  const char *image_path = argv[i + 1];
+  const char *input_path = i + 2 < argc ? argv[i + 2] : nullptr;
 
-  // std::cout << "Program: " << program[VirtualMachine::PC_START] << "\n";
-  vm.execute();
+  if (std::string_view(image_path).ends_with(".asm")) {
+    auto assembly = assemble_file(image_path);
+    if (!assembly) {
+      return 2;
+    }
+    assembly->load_into(vm);
+  } else {
+    try {
+      ImageFile(image_path).load_into(vm);
+    } catch (CannotOpenImage &) {
+      std::cout << "Cannot open image: " << image_path << "\n";
+      return 2;
+    } catch (InvalidImage &) {
+      std::cout << "Invalid image: " << image_path << "\n";
+      return 2;
+    }
+  }
+  std::ifstream input_file;
+  std::istringstream no_input;
+  if (input_path != nullptr) {
+    input_file.open(input_path, std::ios::binary);
+    if (!input_file) {
+      std::cout << "Cannot open input: " << input_path << "\n";
+      return 2;
+    }
+  }
+  vm.set_io(input_path != nullptr ? static_cast<std::istream &>(input_file)
+                                  : no_input,
+            std::cout);
+  run_debugger(vm, engine, std::cin, std::cout);
+  return 0;
 }
 
 int main(int argc, const char **argv) {
   if (argc < 2) {
-    std::cout << "Usage: vm <image-paths...>\n" << std::endl;
+    std::cout << "Usage: vm [--engine=switch|threaded|jit|lockstep] "
+                 "[--trace=none|binary|profile|opcode|full] "
+                 "[--profile=<json-path>] [--trace-file=<path>] [--host-traps] "
+                 "<image-or-asm-paths...>\n"
+                 "       vm [--checkpoint=<path>|--checkpoint-delta=<path>] "
+                 "[--dump=<path>|--dump-compressed=<path>] "
+                 "[--restore=<path>...] resume\n"
+                 "       vm [--engine=switch|threaded|jit|lockstep] [--jobs=N] "
+                 "[--budget=N] --batch=<manifest>\n"
+                 "       vm asm <source> <image-path>\n"
+                 "       vm aot <image-or-asm-path> <cpp-path>\n"
+                 "       vm trace-dump <trace-path>\n"
+                 "       vm dump-diff <before-dump> <after-dump>\n"
+                 "       vm [--engine=switch|threaded|jit] [--host-traps] "
+                 "debug <image-or-asm-path> [input-path]\n"
+              << std::endl;
     return 2;
   }
+  if (strcmp(argv[1], "asm") == 0) {
+    if (argc != 4) {
+      std::cout << "Usage: vm asm <source> <image-path>\n";
+      return 2;
+    }
+    return assemble_to_image(argv[2], argv[3]);
+  }
+  if (strcmp(argv[1], "trace-dump") == 0) {
+    if (argc != 3) {
+      std::cout << "Usage: vm trace-dump <trace-path>\n";
+      return 2;
+    }
+    return dump_trace(argv[2]);
+  }
+  if (strcmp(argv[1], "dump-diff") == 0) {
+    if (argc != 4) {
+      std::cout << "Usage: vm dump-diff <before-dump> <after-dump>\n";
+      return 2;
+    }
+    return diff_dumps(argv[2], argv[3]);
+  }
+  // The console reads whole lines from the terminal as it is, so it starts
+  // before setup() takes the terminal over.
+  for (size_t i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "debug") == 0) {
+      return debug_program(argc, argv);
+    }
+  }
+  if (strcmp(argv[1], "aot") == 0) {
+    if (argc != 4) {
+      std::cout << "Usage: vm aot <image-or-asm-path> <cpp-path>\n";
+      return 2;
+    }
+    return translate_to_cpp(argv[2], argv[3]);
+  }
 
   setup();
 
   VirtualMachine vm;
+  Engine engine = Engine::Switch;
+  TraceLevel level = TraceLevel::None;
+  size_t jobs = std::thread::hardware_concurrency();
+  // Instructions each batch job may perform.
+  uint64_t budget = VirtualMachine::UNLIMITED;
+  // Where to write the profile as JSON, if anywhere.
+  const char *profile_path = nullptr;
+  // Where to save the machine once it stops, if anywhere.
+  const char *checkpoint_path = nullptr;
+  CheckpointKind checkpoint_kind = CheckpointKind::Full;
+  // Where to dump the machine once it stops, if anywhere.
+  const char *dump_path = nullptr;
+  DumpFormat dump_format = DumpFormat::Raw;
+  std::optional<InputRecorder> recorder;
+  std::optional<InputReplay> replay;
+  std::optional<TraceRecorder> trace_log;
+  // Guest output goes through a background writer. Traced runs keep writing
+  // straight to std::cout, so that the trace stays in order with it.
+  AsyncOutput async_output(stdout);
+  std::ostream output(&async_output);
 
   for (size_t i = 1; i < argc; i++) {
     auto filepath = argv[i];
+    if (strncmp(filepath, "--engine=", 9) == 0) {
+      try {
+        engine = engine_from_name(filepath + 9);
+      } catch (InvalidEngine &) {
+        std::cout << "Unknown engine: " << filepath + 9 << "\n";
+        teardown();
+        return 2;
+      }
+      continue;
+    }
+    if (strncmp(filepath, "--trace=", 8) == 0) {
+      try {
+        level = trace_level_from_name(filepath + 8);
+      } catch (InvalidTraceLevel &) {
+        std::cout << "Unknown trace level: " << filepath + 8 << "\n";
+        teardown();
+        return 2;
+      }
+#ifndef VM_TRACE
+      if (level > TraceLevel::Profile) {
+        std::cout << "This build has no traced engines (VM_TRACE is off)\n";
+        teardown();
+        return 2;
+      }
+#endif
+      continue;
+    }
+    if (strncmp(filepath, "--profile=", 10) == 0) {
+      profile_path = filepath + 10;
+      continue;
+    }
+    if (strncmp(filepath, "--checkpoint=", 13) == 0) {
+      checkpoint_path = filepath + 13;
+      checkpoint_kind = CheckpointKind::Full;
+      continue;
+    }
+    if (strncmp(filepath, "--checkpoint-delta=", 19) == 0) {
+      checkpoint_path = filepath + 19;
+      checkpoint_kind = CheckpointKind::Incremental;
+      continue;
+    }
+    if (strncmp(filepath, "--dump=", 7) == 0) {
+      dump_path = filepath + 7;
+      dump_format = DumpFormat::Raw;
+      continue;
+    }
+    if (strncmp(filepath, "--dump-compressed=", 18) == 0) {
+      dump_path = filepath + 18;
+      dump_format = DumpFormat::Compressed;
+      continue;
+    }
+    if (strncmp(filepath, "--record=", 9) == 0) {
+      try {
+        recorder.emplace(filepath + 9);
+      } catch (CannotOpenInputLog &) {
+        std::cout << "Cannot write input log: " << filepath + 9 << "\n";
+        break;
+      }
+      vm.record_input(&*recorder);
+      continue;
+    }
+    if (strncmp(filepath, "--trace-file=", 13) == 0) {
+      try {
+        trace_log.emplace(filepath + 13);
+      } catch (CannotOpenTraceLog &) {
+        std::cout << "Cannot write trace: " << filepath + 13 << "\n";
+        break;
+      }
+      vm.record_trace(&*trace_log);
+      continue;
+    }
+    if (strncmp(filepath, "--replay=", 9) == 0) {
+      try {
+        replay.emplace(filepath + 9);
+      } catch (CannotOpenInputLog &) {
+        std::cout << "Cannot open input log: " << filepath + 9 << "\n";
+        break;
+      } catch (InvalidInputLog &) {
+        std::cout << "Invalid input log: " << filepath + 9 << "\n";
+        break;
+      }
+      vm.replay_input(&*replay);
+      continue;
+    }
+    if (strncmp(filepath, "--restore=", 10) == 0) {
+      try {
+        CheckpointFile(filepath + 10).restore_into(vm);
+      } catch (CannotOpenCheckpoint &) {
+        std::cout << "Cannot open checkpoint: " << filepath + 10 << "\n";
+        break;
+      } catch (InvalidCheckpoint &) {
+        std::cout << "Invalid checkpoint: " << filepath + 10 << "\n";
+        break;
+      }
+      continue;
+    }
+    if (strcmp(filepath, "--host-traps") == 0) {
+      install_host_traps(vm);
+      continue;
+    }
+    if (strncmp(filepath, "--jobs=", 7) == 0) {
+      jobs = std::strtoul(filepath + 7, nullptr, 10);
+      continue;
+    }
+    if (strncmp(filepath, "--budget=", 9) == 0) {
+      budget = std::strtoull(filepath + 9, nullptr, 10);
+      continue;
+    }
+    if (strncmp(filepath, "--batch=", 8) == 0) {
+      // Batch jobs are never traced: their traces would interleave.
+      if (!execute_batch(filepath + 8, engine, jobs, budget)) {
+        teardown();
+        return 2;
+      }
+      continue;
+    }
+    // --profile= profiles, and --trace-file= traces, whatever the level.
+    auto run_level = profile_path != nullptr
+                         ? std::max(level, TraceLevel::Profile)
+                         : level;
+    if (trace_log) {
+      run_level = std::max(run_level, TraceLevel::Binary);
+    }
+    vm.set_io(std::cin,
+              run_level <= TraceLevel::Profile ? output : std::cout);
+    // Carries on from wherever the machine is, such as a restored checkpoint.
+    if (strcmp(filepath, "resume") == 0) {
+      vm.execute(engine, run_level);
+      if (vm.exit_reason() == ExitReason::Halted) {
+        break;
+      }
+      continue;
+    }
     if (strcmp(filepath, "example") == 0) {
-      run_example(vm);
+      run_example(vm, engine, run_level);
+      if (vm.exit_reason() == ExitReason::Halted) {
+        break;
+      }
+      continue;
+    }
+    // Sources are assembled straight into memory.
+    if (std::string_view(filepath).ends_with(".asm")) {
+      auto assembly = assemble_file(filepath);
+      if (!assembly) {
+        break;
+      }
+      std::cout << "Executing: " << filepath << " source\n";
+      assembly->load_into(vm);
+      vm.dump_memory();
+      vm.execute(engine, run_level);
+      if (vm.exit_reason() == ExitReason::Halted) {
+        break;
+      }
       continue;
     }
-    FILE *file;
-    auto rc = fopen_s(&file, filepath, "r");
-    if (rc != 0) {
-      std::cout << "Error: " << errno;
+    std::optional<ImageFile> image;
+    try {
+      image.emplace(filepath);
+    } catch (CannotOpenImage &) {
+      std::cout << "Cannot open image: " << filepath << "\n";
+      break;
+    } catch (InvalidImage &) {
+      std::cout << "Invalid image: " << filepath << "\n";
       break;
     }
     std::cout << "Executing: " << filepath << " image\n";
-    execute_image(file, vm);
-    fclose(file);
+    execute_image(*image, vm, engine, run_level);
+    if (vm.exit_reason() == ExitReason::Halted) {
+      break;
+    }
+  }
+
+  if (vm.exit_reason() == ExitReason::ReplayDiverged) {
+    std::cout << "Replay diverged from the input log\n";
+  }
+  if (checkpoint_path != nullptr) {
+    try {
+      save_checkpoint(vm, checkpoint_path, checkpoint_kind);
+    } catch (CannotOpenCheckpoint &) {
+      std::cout << "Cannot write checkpoint: " << checkpoint_path << "\n";
+    }
+  }
+  if (dump_path != nullptr) {
+    std::ofstream dump(dump_path, std::ios::binary | std::ios::trunc);
+    write_dump(dump, state_of(vm), dump_format);
+    if (!dump.flush()) {
+      std::cout << "Cannot write dump: " << dump_path << "\n";
+    }
+  }
+  vm.dump_profile();
+  if (profile_path != nullptr && vm.profile() != nullptr) {
+    std::ofstream json(profile_path);
+    if (!json) {
+      std::cout << "Cannot write profile: " << profile_path << "\n";
+    }
+    vm.write_profile(json);
   }
 
   teardown();
-  return 0;
+  return vm.exit_reason() == ExitReason::Halted ? 1 : 0;
 }
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <ExitReason.h>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Just enough of a test harness: CHECK and CHECK_EQUAL report a failure and
+// carry on, and run_tests() runs every test and returns the exit status.
+
+inline int check_failures = 0;
+
+inline void check(bool passed, const char *expression, const char *file,
+                  int line) {
+  if (!passed) {
+    std::cout << file << ":" << line << ": failed: " << expression << "\n";
+    check_failures++;
+  }
+}
+
+template <typename T> std::string describe(const T &value) {
+  std::ostringstream out;
+  if constexpr (std::is_same_v<T, ExitReason>) {
+    out << exit_reason_name(value);
+  } else if constexpr (std::is_same_v<T, uint16_t>) {
+    out << "0x" << std::hex << value;
+  } else {
+    out << value;
+  }
+  return out.str();
+}
+
+template <typename T, typename U>
+void check_equal(const T &actual, const U &expected, const char *expression,
+                 const char *file, int line) {
+  if (!(actual == expected)) {
+    std::cout << file << ":" << line << ": failed: " << expression << " is "
+              << describe(actual) << ", expected " << describe(expected)
+              << "\n";
+    check_failures++;
+  }
+}
+
+#define CHECK(expression) check((expression), #expression, __FILE__, __LINE__)
+#define CHECK_EQUAL(actual, expected)                                          \
+  check_equal((actual), (expected), #actual, __FILE__, __LINE__)
+
+struct Test {
+  const char *name;
+  std::function<void()> run;
+};
+
+inline int run_tests(const std::vector<Test> &tests) {
+  for (auto &test : tests) {
+    auto before = check_failures;
+    test.run();
+    std::cout << (check_failures == before ? "ok   " : "FAIL ") << test.name
+              << "\n";
+  }
+  return check_failures == 0 ? 0 : 1;
+}
+
+// The source of tests/programs/`name`.asm.
+inline std::string program_source(const std::string &name) {
+  std::ifstream file(std::string(LC3_TEST_PROGRAMS) + "/" + name + ".asm");
+  std::ostringstream source;
+  source << file.rdbuf();
+  return source.str();
+}
@@ -0,0 +1,137 @@
+// Assembles the programs in tests/programs and checks the words against the
+// hand-assembled ones vm_bench runs, and that mistakes are reported on the
+// line they are on.
+
+#include "../bench/Workloads.h"
+#include "Check.h"
+#include <Assembler.h>
+#include <Image.h>
+#include <algorithm>
+#include <filesystem>
+
+static void assembles_the_workloads() {
+  for (auto &workload : workloads()) {
+    auto assembly = assemble(program_source(workload.name));
+    CHECK_EQUAL(assembly.origin, VirtualMachine::PC_START);
+    CHECK_EQUAL(assembly.words.size(), workload.words.size());
+    for (size_t i = 0;
+         i < std::min(assembly.words.size(), workload.words.size()); i++) {
+      if (assembly.words[i] != workload.words[i]) {
+        std::cout << "  " << workload.name << ", word " << i << "\n";
+        CHECK_EQUAL(assembly.words[i], workload.words[i]);
+      }
+    }
+  }
+}
+
+static void encodes_every_instruction() {
+  auto assembly = assemble(R"(
+        .ORIG x3000
+START   ADD R1, R2, R3
+        ADD R1, R2, #-16
+        AND R7, R0, x0F
+        NOT R4, R5
+        BR START
+        BRnzp START
+        BRn START
+        JMP R6
+        RET
+        JSR START
+        JSRR R3
+        LD R0, DATA
+        LDI R1, DATA
+        LDR R2, R3, #-32
+        LEA R4, DATA
+        ST R5, DATA
+        STI R6, DATA
+        STR R7, R0, #31
+        RTI
+        TRAP x25
+        GETC
+        OUT
+        PUTS
+        IN
+        PUTSP
+        HALT
+DATA    .FILL xBEEF
+        .BLKW 2
+        .STRINGZ "a\n\"\\"
+        .END
+  )");
+  const std::vector<uint16_t> expected = {
+      0x1283, 0x12b0, 0x5e2f, 0x997f, 0x0ffb, 0x0ffa, 0x09f9, 0xc180,
+      0xc1c0, 0x4ff6, 0x40c0, 0x200e, 0xa20d, 0x64e0, 0xe80b, 0x3a0a,
+      0xbc09, 0x7e1f, 0x8000, 0xf025, 0xf020, 0xf021, 0xf022, 0xf023,
+      0xf024, 0xf025, 0xbeef, 0x0000, 0x0000, 0x0061, 0x000a, 0x0022,
+      0x005c, 0x0000,
+  };
+  CHECK_EQUAL(assembly.words.size(), expected.size());
+  for (size_t i = 0; i < std::min(assembly.words.size(), expected.size());
+       i++) {
+    CHECK_EQUAL(assembly.words[i], expected[i]);
+  }
+}
+
+static void writes_images_vm_can_load() {
+  auto assembly = assemble(program_source("echo"));
+  auto path = (std::filesystem::temp_directory_path() / "lc3_test_echo.obj")
+                  .string();
+  {
+    std::ofstream image(path, std::ios::binary);
+    assembly.write_image(image);
+  }
+  {
+    // Big-endian: the origin's high byte comes first.
+    std::ifstream image(path, std::ios::binary);
+    char bytes[4] = {};
+    image.read(bytes, 4);
+    CHECK_EQUAL(int(uint8_t(bytes[0])), int(assembly.origin >> 8));
+    CHECK_EQUAL(int(uint8_t(bytes[1])), int(assembly.origin & 0xff));
+    CHECK_EQUAL(int(uint8_t(bytes[2])), int(assembly.words[0] >> 8));
+    CHECK_EQUAL(int(uint8_t(bytes[3])), int(assembly.words[0] & 0xff));
+  }
+  {
+    ImageFile image(path.c_str());
+    CHECK_EQUAL(image.origin(), assembly.origin);
+    CHECK_EQUAL(image.size(), assembly.words.size());
+    VirtualMachine vm;
+    image.load_into(vm);
+    for (size_t i = 0; i < assembly.words.size(); i++) {
+      CHECK_EQUAL(vm.read_memory(assembly.origin + i), assembly.words[i]);
+    }
+  }
+  std::filesystem::remove(path);
+}
+
+// The line and message assemble() gives up on `source` with.
+static void check_error(const char *source, size_t line, const char *message) {
+  try {
+    assemble(source);
+    std::cout << "  assembled: " << source << "\n";
+    CHECK(false);
+  } catch (AssemblyError &error) {
+    CHECK_EQUAL(error.line, line);
+    CHECK_EQUAL(std::string(error.message), std::string(message));
+  }
+}
+
+static void reports_mistakes() {
+  check_error(".ORIG x3000\nBR NOWHERE\n", 2, "undefined label");
+  check_error(".ORIG x3000\nADD R1, R1, #16\n", 2, "number out of range");
+  check_error(".ORIG x3000\nADD R8, R1, #1\n", 2, "expected a register");
+  check_error(".ORIG x3000\nA ADD R1, R1, #1\nA HALT\n", 3,
+              "duplicate label");
+  check_error(".ORIG x3000\nFROB R1\n", 2, "unknown instruction");
+  check_error(".ORIG x3000\nNOT R1\n", 2, "wrong number of operands");
+  check_error("ADD R1, R1, #1\n", 1, "expected .ORIG");
+  check_error(".ORIG x3000\n.STRINGZ \"open\n", 2, "unterminated string");
+}
+
+int main() {
+  return run_tests({
+      {"assembles_the_workloads", assembles_the_workloads},
+      {"encodes_every_instruction", encodes_every_instruction},
+      {"writes_images_vm_can_load", writes_images_vm_can_load},
+      {"reports_mistakes", reports_mistakes},
+  });
+}
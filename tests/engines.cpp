@@ -0,0 +1,283 @@
+// Runs the same programs on every engine and checks that they all end in
+// the same state: exit reason, registers, instruction count, output and
+// memory. Engine::Switch is the reference.
+
+#include "../bench/Workloads.h"
+#include "Check.h"
+#include <Assembler.h>
+#include <AotRuntime.h>
+#include <Lockstep.h>
+#include <MemoryDump.h>
+#include <VirtualMachine.h>
+#include <memory>
+
+extern const AotProgram &aot_arithmetic;
+extern const AotProgram &aot_memory_copy;
+extern const AotProgram &aot_recursive_calls;
+extern const AotProgram &aot_string_output;
+extern const AotProgram &aot_bubble_sort;
+extern const AotProgram &aot_self_modifying;
+extern const AotProgram &aot_echo;
+
+struct Program {
+  const char *name;
+  const AotProgram &translation;
+  uint16_t result;
+  // One input per run; Lockstep gives each its own lane.
+  std::vector<std::string> inputs = {""};
+};
+
+static std::vector<Program> programs() {
+  std::vector<Program> all = {
+      {"arithmetic", aot_arithmetic, 0},
+      {"memory_copy", aot_memory_copy, 0},
+      {"recursive_calls", aot_recursive_calls, 0},
+      {"string_output", aot_string_output, 0},
+      {"bubble_sort", aot_bubble_sort, 0},
+      {"self_modifying", aot_self_modifying, 0x000c},
+      {"echo", aot_echo, 12, {"hello world q", "abq", "q"}},
+  };
+  for (auto &workload : workloads()) {
+    for (auto &program : all) {
+      if (workload.name == std::string(program.name)) {
+        program.result = workload.checksum;
+      }
+    }
+  }
+  return all;
+}
+
+// A machine with a program loaded and its streams set.
+struct Run {
+  std::unique_ptr<VirtualMachine> vm = std::make_unique<VirtualMachine>();
+  std::istringstream input;
+  std::ostringstream output;
+  ExitReason reason = ExitReason::EndOfMemory;
+
+  Run(const Assembly &program, const std::string &keys) : input(keys) {
+    program.load_into(*vm);
+    vm->set_io(input, output);
+  }
+};
+
+// Checks that `run` ended as `reference` did, naming `what` if not.
+static void check_same(Run &run, Run &reference, const std::string &what) {
+  auto before = check_failures;
+  CHECK_EQUAL(run.reason, reference.reason);
+  for (size_t i = 0; i < to_underlying(Register::COUNT); i++) {
+    auto r = static_cast<Register>(i);
+    CHECK_EQUAL(run.vm->get_register(r), reference.vm->get_register(r));
+  }
+  CHECK_EQUAL(run.vm->instructions(), reference.vm->instructions());
+  CHECK_EQUAL(run.output.str(), reference.output.str());
+  CHECK_EQUAL(changed_pages(state_of(*run.vm), state_of(*reference.vm)),
+              0u);
+  if (check_failures != before) {
+    std::cout << "  in " << what << "\n";
+  }
+}
+
+static Assembly assemble_program(const char *name) {
+  return assemble(program_source(name));
+}
+
+static void engines_agree() {
+  const Engine engines[] = {Engine::Threaded, Engine::Jit};
+  for (auto &program : programs()) {
+    auto assembly = assemble_program(program.name);
+    for (auto &keys : program.inputs) {
+      std::string what = std::string(program.name) + " on \"" + keys + "\"";
+
+      Run reference(assembly, keys);
+      reference.reason = reference.vm->execute(Engine::Switch);
+      CHECK_EQUAL(reference.reason, ExitReason::Halted);
+      if (&keys == &program.inputs[0]) {
+        CHECK_EQUAL(reference.vm->get_register(Register::R0), program.result);
+      }
+
+      for (auto engine : engines) {
+        Run run(assembly, keys);
+        run.reason = run.vm->execute(engine);
+        check_same(run, reference, what + ", " + engine_name(engine));
+      }
+
+      // Slices that end inside superinstructions, translated blocks and
+      // traps' service loops alike.
+      for (auto engine : {Engine::Switch, Engine::Threaded, Engine::Jit}) {
+        Run run(assembly, keys);
+        do {
+          run.reason = run.vm->execute(engine, TraceLevel::None, 997);
+        } while (run.reason == ExitReason::BudgetExhausted);
+        check_same(run, reference,
+                   what + ", " + engine_name(engine) + " in slices");
+      }
+
+      Run translated(assembly, keys);
+      run_translated(*translated.vm, program.translation);
+      translated.reason = translated.vm->exit_reason();
+      check_same(translated, reference, what + ", translated");
+    }
+  }
+}
+
+static void lockstep_agrees() {
+  for (auto &program : programs()) {
+    auto assembly = assemble_program(program.name);
+    // Lanes on the same input too, so that there is more than one.
+    auto inputs = program.inputs;
+    inputs.push_back(inputs[0]);
+
+    VirtualMachine base;
+    assembly.load_into(base);
+    Lockstep lockstep(base, inputs.size());
+    std::vector<std::unique_ptr<std::istringstream>> lane_inputs;
+    std::vector<std::ostringstream> lane_outputs(inputs.size());
+    for (size_t lane = 0; lane < inputs.size(); lane++) {
+      lane_inputs.push_back(std::make_unique<std::istringstream>(inputs[lane]));
+      lockstep.lane(lane).set_io(*lane_inputs[lane], lane_outputs[lane]);
+    }
+    lockstep.run();
+
+    for (size_t lane = 0; lane < inputs.size(); lane++) {
+      Run reference(assembly, inputs[lane]);
+      reference.reason = reference.vm->execute(Engine::Switch);
+
+      auto &vm = lockstep.lane(lane);
+      auto what = std::string(program.name) + ", lane " + std::to_string(lane);
+      auto before = check_failures;
+      CHECK(lockstep.error(lane) == nullptr);
+      CHECK_EQUAL(vm.exit_reason(), reference.reason);
+      for (size_t i = 0; i < to_underlying(Register::COUNT); i++) {
+        auto r = static_cast<Register>(i);
+        CHECK_EQUAL(vm.get_register(r), reference.vm->get_register(r));
+      }
+      CHECK_EQUAL(vm.instructions(), reference.vm->instructions());
+      CHECK_EQUAL(lane_outputs[lane].str(), reference.output.str());
+      CHECK_EQUAL(changed_pages(state_of(vm), state_of(*reference.vm)), 0u);
+      if (check_failures != before) {
+        std::cout << "  in " << what << "\n";
+      }
+    }
+  }
+}
+
+// Where a machine stopped, and what it held there.
+struct Stop {
+  ExitReason reason;
+  uint16_t pc;
+  uint64_t instructions;
+  uint16_t r0;
+  uint16_t r2;
+  uint16_t r3;
+  WatchHit hit;
+
+  bool operator==(const Stop &other) const {
+    return reason == other.reason && pc == other.pc &&
+           instructions == other.instructions && r0 == other.r0 &&
+           r2 == other.r2 && r3 == other.r3 &&
+           (reason != ExitReason::Watchpoint ||
+            (hit.address == other.hit.address && hit.kind == other.hit.kind &&
+             hit.value == other.hit.value && hit.pc == other.hit.pc));
+  }
+};
+
+// The first `count` stops of `vm`, which has breakpoints or watchpoints set.
+static std::vector<Stop> stops(VirtualMachine &vm, Engine engine,
+                               size_t count) {
+  std::vector<Stop> all;
+  for (size_t i = 0; i < count; i++) {
+    auto reason = vm.execute(engine);
+    all.push_back({reason, vm.get_register(Register::PC), vm.instructions(),
+                   vm.get_register(Register::R0),
+                   vm.get_register(Register::R2),
+                   vm.get_register(Register::R3), vm.watch_hit()});
+    if (reason == ExitReason::Halted) {
+      break;
+    }
+  }
+  return all;
+}
+
+static void breakpoints_stop_every_engine() {
+  auto assembly = assemble_program("arithmetic");
+  auto checksum = workloads()[0].checksum;
+  std::vector<Stop> reference;
+  for (auto engine : {Engine::Switch, Engine::Threaded, Engine::Jit}) {
+    Run run(assembly, "");
+    // The top of the inner loop, and the BRp closing it, which fuses with
+    // the ADD before it.
+    run.vm->set_breakpoint(0x3002);
+    run.vm->set_breakpoint(0x3007);
+    auto hits = stops(*run.vm, engine, 6);
+    CHECK_EQUAL(hits.size(), 6u);
+    for (size_t i = 0; i < hits.size(); i++) {
+      CHECK_EQUAL(hits[i].reason, ExitReason::Breakpoint);
+      CHECK_EQUAL(hits[i].pc, uint16_t(i % 2 == 0 ? 0x3002 : 0x3007));
+    }
+    if (engine == Engine::Switch) {
+      reference = hits;
+    } else {
+      CHECK(hits == reference);
+    }
+
+    run.vm->clear_breakpoint(0x3002);
+    run.vm->clear_breakpoint(0x3007);
+    CHECK_EQUAL(run.vm->execute(engine), ExitReason::Halted);
+    CHECK_EQUAL(run.vm->get_register(Register::R0), checksum);
+  }
+
+  // A fork stops where its parent would.
+  Run parent(assembly, "");
+  parent.vm->set_breakpoint(0x3007);
+  auto child = parent.vm->fork();
+  CHECK_EQUAL(child->execute(Engine::Jit), ExitReason::Breakpoint);
+  CHECK_EQUAL(child->get_register(Register::PC), uint16_t(0x3007));
+}
+
+static void watchpoints_stop_every_engine() {
+  auto assembly = assemble_program("memory_copy");
+  auto checksum = workloads()[1].checksum;
+  std::vector<Stop> reference;
+  for (auto engine : {Engine::Switch, Engine::Threaded, Engine::Jit}) {
+    Run run(assembly, "");
+    run.vm->add_watchpoint({0x5000, 0x5001, WatchKind::Write});
+    run.vm->add_watchpoint({0x4002, 0x4002, WatchKind::Read});
+    auto hits = stops(*run.vm, engine, 8);
+    CHECK_EQUAL(hits.size(), 8u);
+    for (auto &hit : hits) {
+      CHECK_EQUAL(hit.reason, ExitReason::Watchpoint);
+    }
+    if (engine == Engine::Switch) {
+      reference = hits;
+      // The fill loop only writes 0x4002; the first pass of the copy
+      // stores the first two words before it reads it.
+      CHECK_EQUAL(hits[0].hit.address, uint16_t(0x5000));
+      CHECK(hits[0].hit.kind == WatchKind::Write);
+      CHECK_EQUAL(hits[1].hit.address, uint16_t(0x5001));
+      CHECK_EQUAL(hits[2].hit.address, uint16_t(0x4002));
+      CHECK(hits[2].hit.kind == WatchKind::Read);
+    } else {
+      CHECK(hits == reference);
+    }
+
+    run.vm->clear_watchpoints();
+    CHECK_EQUAL(run.vm->execute(engine), ExitReason::Halted);
+    CHECK_EQUAL(run.vm->get_register(Register::R0), checksum);
+  }
+
+  // A fork stops where its parent would.
+  Run parent(assembly, "");
+  parent.vm->add_watchpoint({0x5000, 0x5000, WatchKind::Write});
+  auto child = parent.vm->fork();
+  CHECK_EQUAL(child->execute(Engine::Threaded), ExitReason::Watchpoint);
+  CHECK_EQUAL(child->watch_hit().address, uint16_t(0x5000));
+}
+
+int main() {
+  return run_tests({
+      {"engines_agree", engines_agree},
+      {"lockstep_agrees", lockstep_agrees},
+      {"breakpoints_stop_every_engine", breakpoints_stop_every_engine},
+      {"watchpoints_stop_every_engine", watchpoints_stop_every_engine},
+  });
+}
@@ -0,0 +1,18 @@
+; ADD, AND and NOT in a loop of a million iterations.
+; Halts with R0 = xe00f.
+        .ORIG x3000
+        LD R1, OUTER
+OLOOP   LD R2, INNER
+ILOOP   ADD R3, R3, R2
+        AND R4, R3, #15
+        NOT R5, R4
+        ADD R3, R3, R5
+        ADD R2, R2, #-1
+        BRp ILOOP
+        ADD R1, R1, #-1
+        BRp OLOOP
+        ADD R0, R3, #0
+        HALT
+OUTER   .FILL #100
+INNER   .FILL #10000
+        .END
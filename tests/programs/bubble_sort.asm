@@ -0,0 +1,50 @@
+; Bubble sort of 200 pseudo-random words, 10 times.
+; Halts with R0 = x3e6e.
+        .ORIG x3000
+        LD R5, PASSES
+PASS    LD R1, ARRAY
+        LD R2, N
+        LD R3, SEED
+GEN     ADD R4, R3, R3
+        ADD R4, R4, R4
+        ADD R3, R4, R3
+        ADD R3, R3, #7
+        LD R4, MASK
+        AND R4, R3, R4
+        STR R4, R1, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp GEN
+        ST R3, SEED
+        LD R2, N
+        ADD R2, R2, #-1
+OUTER   LD R1, ARRAY
+        ADD R3, R2, #0
+INNER   LDR R4, R1, #0
+        LDR R0, R1, #1
+        NOT R7, R0
+        ADD R7, R7, #1
+        ADD R7, R4, R7
+        BRnz KEEP
+        STR R0, R1, #0
+        STR R4, R1, #1
+KEEP    ADD R1, R1, #1
+        ADD R3, R3, #-1
+        BRp INNER
+        ADD R2, R2, #-1
+        BRp OUTER
+        ADD R5, R5, #-1
+        BRp PASS
+        LD R1, ARRAY
+        LDR R0, R1, #0
+        LD R2, N
+        ADD R1, R1, R2
+        LDR R2, R1, #-1
+        ADD R0, R0, R2
+        HALT
+PASSES  .FILL #10
+ARRAY   .FILL x4000
+N       .FILL #200
+SEED    .FILL #1
+MASK    .FILL x3FFF
+        .END
@@ -0,0 +1,25 @@
+; Echoes its input up to a 'q', taking characters in turn from TRAP GETC and
+; from the keyboard's KBSR and KBDR. Halts with the number of characters
+; echoed in R0.
+        .ORIG x3000
+        AND R5, R5, #0
+        LD R4, NEGQ
+NEXT    GETC
+        ADD R1, R0, R4
+        BRz DONE
+        OUT
+        ADD R5, R5, #1
+POLL    LDI R1, KBSR
+        BRzp POLL
+        LDI R0, KBDR
+        ADD R1, R0, R4
+        BRz DONE
+        OUT
+        ADD R5, R5, #1
+        BRnzp NEXT
+DONE    ADD R0, R5, #0
+        HALT
+NEGQ    .FILL xFF8F             ; -'q'
+KBSR    .FILL xFE00
+KBDR    .FILL xFE02
+        .END
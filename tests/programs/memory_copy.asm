@@ -0,0 +1,35 @@
+; LDR and STR copying 4096 words, 100 times over.
+; Halts with R0 = x0800.
+        .ORIG x3000
+        LD R1, SOURCE
+        LD R2, COUNT
+FILL    STR R2, R1, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp FILL
+        LD R5, PASSES
+PASS    LD R1, SOURCE
+        LD R2, TARGET
+        LD R3, COUNT
+COPY    LDR R4, R1, #0
+        STR R4, R2, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #1
+        ADD R3, R3, #-1
+        BRp COPY
+        ADD R5, R5, #-1
+        BRp PASS
+        LD R2, TARGET
+        LD R3, COUNT
+        AND R0, R0, #0
+SUM     LDR R4, R2, #0
+        ADD R0, R0, R4
+        ADD R2, R2, #1
+        ADD R3, R3, #-1
+        BRp SUM
+        HALT
+SOURCE  .FILL x4000
+TARGET  .FILL x5000
+COUNT   .FILL #4096
+PASSES  .FILL #100
+        .END
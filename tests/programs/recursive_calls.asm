@@ -0,0 +1,32 @@
+; A recursive fib(18) through JSR and a stack, 20 times.
+; Halts with R0 = x0a18.
+        .ORIG x3000
+        LD R6, STACK
+        LD R5, PASSES
+PASS    LD R0, N
+        JSR FIB
+        ADD R5, R5, #-1
+        BRp PASS
+        HALT
+STACK   .FILL xF000
+PASSES  .FILL #20
+N       .FILL #18
+FIB     ADD R1, R0, #-2
+        BRn BASE
+        ADD R6, R6, #-1
+        STR R7, R6, #0
+        ADD R6, R6, #-1
+        STR R0, R6, #0
+        ADD R0, R0, #-1
+        JSR FIB
+        LDR R1, R6, #0
+        STR R0, R6, #0
+        ADD R0, R1, #-2
+        JSR FIB
+        LDR R1, R6, #0
+        ADD R0, R0, R1
+        ADD R6, R6, #1
+        LDR R7, R6, #0
+        ADD R6, R6, #1
+BASE    RET
+        .END
@@ -0,0 +1,20 @@
+; Rewrites its own code as it runs: the loop's first instruction after the
+; first pass, and an instruction further down a straight run of code before
+; it gets there. Halts with R0 = x000C.
+        .ORIG x3000
+        AND R0, R0, #0
+        LD R1, PASSES
+LOOP    ADD R0, R0, #1          ; becomes ADD R0, R0, #2
+        LD R2, ADD2
+        ST R2, LOOP
+        ADD R1, R1, #-1
+        BRp LOOP
+        LEA R3, PATCH
+        LD R2, ADD5
+        STR R2, R3, #0
+PATCH   ADD R0, R0, #0          ; becomes ADD R0, R0, #5
+        HALT
+PASSES  .FILL #4
+ADD2    .FILL x1022             ; ADD R0, R0, #2
+ADD5    .FILL x1025             ; ADD R0, R0, #5
+        .END
@@ -0,0 +1,22 @@
+; PUTS and a loop of OUT over a string, 2000 times.
+; Halts with R0 = x4ff0.
+        .ORIG x3000
+        LD R3, PASSES
+        AND R2, R2, #0
+PASS    LEA R0, TITLE
+        PUTS
+        LEA R1, BODY
+CHAR    LDR R0, R1, #0
+        BRz NEXT
+        OUT
+        ADD R2, R2, #1
+        ADD R1, R1, #1
+        BRnzp CHAR
+NEXT    ADD R3, R3, #-1
+        BRp PASS
+        ADD R0, R2, #0
+        HALT
+PASSES  .FILL #2000
+TITLE   .STRINGZ "lc3 bench: "
+BODY    .STRINGZ "the quick brown fox jumps over the lazy dog"
+        .END
@@ -0,0 +1,216 @@
+// Writes every kind of file the machine saves and reads it back: the state
+// that comes back must be the state that went out.
+
+#include "Check.h"
+#include <Assembler.h>
+#include <Checkpoint.h>
+#include <InputLog.h>
+#include <MemoryDump.h>
+#include <TraceLog.h>
+#include <VirtualMachine.h>
+#include <filesystem>
+#include <memory>
+
+// A file in the temporary directory, removed once the test is done with it.
+class TemporaryFile {
+public:
+  explicit TemporaryFile(const char *name)
+      : m_path((std::filesystem::temp_directory_path() /
+                ("lc3_test_" + std::string(name)))
+                   .string()) {}
+  ~TemporaryFile() { std::filesystem::remove(m_path); }
+
+  const char *path() const { return m_path.c_str(); }
+
+private:
+  std::string m_path;
+};
+
+// Reads nothing and writes nowhere until given streams of its own.
+static std::unique_ptr<VirtualMachine> load_program(const char *name) {
+  static std::istringstream nothing;
+  static std::ostream nowhere(nullptr);
+  auto vm = std::make_unique<VirtualMachine>();
+  assemble(program_source(name)).load_into(*vm);
+  vm->set_io(nothing, nowhere);
+  return vm;
+}
+
+static void check_same_machine(VirtualMachine &vm, VirtualMachine &expected) {
+  for (size_t i = 0; i < to_underlying(Register::COUNT); i++) {
+    auto r = static_cast<Register>(i);
+    CHECK_EQUAL(vm.get_register(r), expected.get_register(r));
+  }
+  CHECK_EQUAL(vm.instructions(), expected.instructions());
+  CHECK_EQUAL(changed_pages(state_of(vm), state_of(expected)), 0u);
+}
+
+static void checkpoints_restore() {
+  TemporaryFile full("full.checkpoint");
+  TemporaryFile incremental("incremental.checkpoint");
+
+  auto original = load_program("bubble_sort");
+  CHECK_EQUAL(original->run(50000), ExitReason::BudgetExhausted);
+  save_checkpoint(*original, full.path(), CheckpointKind::Full);
+  CHECK_EQUAL(original->run(30000), ExitReason::BudgetExhausted);
+  save_checkpoint(*original, incremental.path(), CheckpointKind::Incremental);
+  CHECK_EQUAL(original->execute(), ExitReason::Halted);
+
+  CheckpointFile first(full.path());
+  CheckpointFile second(incremental.path());
+  CHECK(first.kind() == CheckpointKind::Full);
+  CHECK(second.kind() == CheckpointKind::Incremental);
+  CHECK_EQUAL(first.instructions(), 50000u);
+  CHECK_EQUAL(second.instructions(), 80000u);
+
+  // Over another program, whose words the full checkpoint must clear.
+  auto chained = load_program("string_output");
+  first.restore_into(*chained);
+  second.restore_into(*chained);
+  CHECK_EQUAL(chained->execute(Engine::Threaded), ExitReason::Halted);
+  check_same_machine(*chained, *original);
+
+  auto resumed = load_program("string_output");
+  first.restore_into(*resumed);
+  CHECK_EQUAL(resumed->execute(Engine::Jit), ExitReason::Halted);
+  check_same_machine(*resumed, *original);
+
+  // An incremental checkpoint only follows the state it was taken after.
+  VirtualMachine fresh;
+  bool refused = false;
+  try {
+    second.restore_into(fresh);
+  } catch (InvalidCheckpoint &) {
+    refused = true;
+  }
+  CHECK(refused);
+}
+
+static void dumps_read_back() {
+  TemporaryFile raw("raw.dump");
+  TemporaryFile compressed("compressed.dump");
+
+  auto vm = load_program("bubble_sort");
+  CHECK_EQUAL(vm->run(50000), ExitReason::BudgetExhausted);
+  {
+    std::ofstream raw_file(raw.path(), std::ios::binary);
+    write_dump(raw_file, state_of(*vm), DumpFormat::Raw);
+    std::ofstream compressed_file(compressed.path(), std::ios::binary);
+    write_dump(compressed_file, state_of(*vm), DumpFormat::Compressed);
+  }
+  CHECK(std::filesystem::file_size(compressed.path()) <
+        std::filesystem::file_size(raw.path()));
+
+  auto expected = state_of(*vm);
+  for (auto path : {raw.path(), compressed.path()}) {
+    DumpFile dump(path);
+    auto &state = dump.state();
+    for (size_t i = 0; i < to_underlying(Register::COUNT); i++) {
+      CHECK_EQUAL(state.registers[i], expected.registers[i]);
+    }
+    CHECK_EQUAL(state.instructions, expected.instructions);
+    CHECK_EQUAL(changed_pages(state, expected), 0u);
+    std::ostringstream diff;
+    write_diff(diff, state, expected);
+    CHECK_EQUAL(diff.str(), "");
+  }
+  CHECK(DumpFile(raw.path()).format() == DumpFormat::Raw);
+  CHECK(DumpFile(compressed.path()).format() == DumpFormat::Compressed);
+
+  // The sort moves words of the array, which is all the diff may show
+  // besides the registers and the count.
+  DumpFile before(compressed.path());
+  CHECK_EQUAL(vm->run(1000), ExitReason::BudgetExhausted);
+  auto changed = changed_pages(before.state(), state_of(*vm));
+  CHECK_EQUAL(changed, uint32_t(1) << (0x4000 >> Memory::PAGE_BITS));
+  std::ostringstream diff;
+  write_diff(diff, before.state(), state_of(*vm));
+  CHECK(diff.str().find("instructions: 50000 -> 51000\n") !=
+        std::string::npos);
+}
+
+static void input_logs_replay() {
+  TemporaryFile log("input.log");
+  const std::string keys = "hello world q";
+
+  auto recorded = load_program("echo");
+  std::istringstream input(keys);
+  std::ostringstream output;
+  recorded->set_io(input, output);
+  {
+    InputRecorder recorder(log.path());
+    recorded->record_input(&recorder);
+    CHECK_EQUAL(recorded->execute(), ExitReason::Halted);
+    recorded->record_input(nullptr);
+  }
+  CHECK_EQUAL(output.str(), "hello world Program halted.\n");
+
+  // Replayed with nothing on the input stream, on every engine.
+  for (auto engine : {Engine::Switch, Engine::Threaded, Engine::Jit}) {
+    auto replayed = load_program("echo");
+    std::istringstream nothing;
+    std::ostringstream replayed_output;
+    replayed->set_io(nothing, replayed_output);
+    InputReplay replay(log.path());
+    replayed->replay_input(&replay);
+    CHECK_EQUAL(replayed->execute(engine), ExitReason::Halted);
+    CHECK(replay.finished());
+    CHECK_EQUAL(replayed_output.str(), output.str());
+    check_same_machine(*replayed, *recorded);
+  }
+}
+
+static void traces_read_back() {
+  TemporaryFile path("trace.bin");
+
+  auto vm = load_program("memory_copy");
+  CHECK_EQUAL(vm->run(20000), ExitReason::BudgetExhausted);
+  {
+    TraceRecorder recorder(path.path());
+    vm->record_trace(&recorder);
+    CHECK_EQUAL(vm->execute(Engine::Switch, TraceLevel::Binary),
+                ExitReason::Halted);
+    vm->record_trace(nullptr);
+  }
+
+  // Replays the trace onto a machine at the same starting point.
+  auto expected = load_program("memory_copy");
+  CHECK_EQUAL(expected->run(20000), ExitReason::BudgetExhausted);
+  TraceReader reader(path.path());
+  uint64_t instructions = 20000;
+  uint64_t writes = 0;
+  bool in_step = true;
+  while (auto record = reader.next()) {
+    switch (record->event) {
+    case TraceEvent::Instruction:
+      in_step = record->address == expected->get_register(Register::PC);
+      CHECK(in_step);
+      CHECK_EQUAL(record->value, expected->read_memory(record->address));
+      instructions++;
+      // The last one halts.
+      expected->run(1);
+      break;
+    case TraceEvent::Read:
+      break;
+    case TraceEvent::Write:
+      writes++;
+      CHECK_EQUAL(expected->read_memory(record->address), record->value);
+      break;
+    }
+    if (!in_step) {
+      break;
+    }
+  }
+  CHECK_EQUAL(instructions, vm->instructions());
+  CHECK_EQUAL(expected->exit_reason(), ExitReason::Halted);
+  CHECK(writes > 0);
+}
+
+int main() {
+  return run_tests({
+      {"checkpoints_restore", checkpoints_restore},
+      {"dumps_read_back", dumps_read_back},
+      {"input_logs_replay", input_logs_replay},
+      {"traces_read_back", traces_read_back},
+  });
+}